@@ -1,5 +1,5 @@
 #!/usr/bin/env python
-# create-ota - Create zlib-compressed Zigbee OTA file
+# create-ota - Create compressed Zigbee OTA file
 # Copyright 2023  Simon Arlott
 #
 # This program is free software: you can redistribute it and/or modify
@@ -17,18 +17,226 @@
 
 import argparse
 import functools
+import hashlib
+import struct
+import sys
+import time
 import zlib
 
 import zigpy.ota
 
 
-def create(filename, manufacturer_id, image_type, file_version, header_string):
-	with open(filename, "rb") as f:
-		data = f.read()
+# Codec identifiers, see main/ota_codec.h
+CODECS = {
+	"none": 0,
+	"zlib": 1,
+	"deflate": 2,
+}
+
+# Manufacturer-specific sub-element: codec header followed by the compressed image
+TAG_COMPRESSED_IMAGE = 0xF000
+
+# Manufacturer-specific sub-element: delta header followed by the compressed patch
+TAG_DELTA_IMAGE = 0xF001
+DELTA_FLAG_FALLBACK = 0x01
+
+# Manufacturer-specific sub-element: sizes and SHA-256 of the next image
+# sub-element's data and of the firmware it produces (after the image for
+# the legacy layout, which must stay the first sub-element)
+TAG_IMAGE_HASH = 0xF002
+
+# Sub-element data is split into independently compressed segments, each
+# preceded by its length; the device saves a checkpoint after every segment
+FLAG_SEGMENTED = 0x02
+
+# Patch operations, see main/ota_delta.h
+DELTA_COPY_ADD = 0x01
+DELTA_INSERT = 0x02
+DELTA_BLOCK = 16
+
+# Approximate size of zlib's inflate state on the device (32-bit), excluding the window
+INFLATE_STATE_SIZE = 7160
 
-	zobj = zlib.compressobj(level=zlib.Z_BEST_COMPRESSION)
+
+def compress(data, codec, window_bits):
+	if codec == "none":
+		return data
+
+	wbits = window_bits if codec == "zlib" else -window_bits
+	zobj = zlib.compressobj(level=zlib.Z_BEST_COMPRESSION, wbits=wbits)
 	zdata = zobj.compress(data)
 	zdata += zobj.flush()
+	return zdata
+
+
+def decompress(zdata, codec, window_bits):
+	if codec == "none":
+		return zdata
+
+	wbits = window_bits if codec == "zlib" else -window_bits
+	return zlib.decompress(zdata, wbits=wbits)
+
+
+def compress_segments(data, codec, window_bits, restart_interval):
+	if not restart_interval:
+		return compress(data, codec, window_bits)
+
+	zdata = b""
+	for offset in range(0, len(data), restart_interval):
+		segment = compress(data[offset:offset + restart_interval], codec, window_bits)
+		zdata += struct.pack("<I", len(segment)) + segment
+	return zdata
+
+
+def hash_subelement(tag, zdata, data):
+	header = struct.pack("<HI", tag, len(zdata)) + hashlib.sha256(zdata).digest()
+	header += struct.pack("<I", len(data)) + hashlib.sha256(data).digest()
+	return zigpy.ota.image.SubElement(
+		tag_id=zigpy.ota.image.ElementTagId(TAG_IMAGE_HASH), data=header,
+	)
+
+
+def image_subelements(data, codec, window_bits, restart_interval):
+	zdata = compress_segments(data, codec, window_bits, restart_interval)
+
+	if codec == "zlib" and window_bits == zlib.MAX_WBITS and not restart_interval:
+		# Understood by every firmware version
+		return [
+			zigpy.ota.image.SubElement(
+				tag_id=zigpy.ota.image.ElementTagId.UPGRADE_IMAGE, data=zdata,
+			),
+			hash_subelement(zigpy.ota.image.ElementTagId.UPGRADE_IMAGE, zdata, data),
+		]
+
+	flags = FLAG_SEGMENTED if restart_interval else 0
+	header = struct.pack("<BBBB", CODECS[codec], window_bits, flags, 0)
+	return [
+		hash_subelement(TAG_COMPRESSED_IMAGE, zdata, data),
+		zigpy.ota.image.SubElement(
+			tag_id=zigpy.ota.image.ElementTagId(TAG_COMPRESSED_IMAGE), data=header + zdata,
+		),
+	]
+
+
+def base_sha256(base):
+	# The device compares against the SHA-256 appended to the running image
+	digest = base[-32:]
+	if hashlib.sha256(base[:-32]).digest() != digest:
+		raise ValueError("Base image has no appended SHA-256")
+	return digest
+
+
+def make_patch(base, data):
+	# bsdiff style: approximate matches are copied from the base with a
+	# difference that is mostly zeros, everything else is inserted
+	index = {}
+	for offset in range(0, len(base) - DELTA_BLOCK + 1, 4):
+		index.setdefault(base[offset:offset + DELTA_BLOCK], offset)
+
+	patch = bytearray()
+
+	def insert(literal):
+		if literal:
+			patch.extend(struct.pack("<BI", DELTA_INSERT, len(literal)) + literal)
+
+	pos = 0
+	literal_start = 0
+	while pos + DELTA_BLOCK <= len(data):
+		offset = index.get(data[pos:pos + DELTA_BLOCK])
+		if offset is None:
+			pos += 1
+			continue
+
+		while pos > literal_start and offset > 0 and data[pos - 1] == base[offset - 1]:
+			pos -= 1
+			offset -= 1
+
+		# Extend while more bytes match than differ
+		score = best = length = best_length = 0
+		while pos + length < len(data) and offset + length < len(base):
+			score += 1 if data[pos + length] == base[offset + length] else -1
+			length += 1
+			if score > best:
+				best = score
+				best_length = length
+			elif score < best - 64:
+				break
+
+		insert(data[literal_start:pos])
+		diff = bytes((data[pos + i] - base[offset + i]) & 0xFF for i in range(best_length))
+		patch.extend(struct.pack("<BII", DELTA_COPY_ADD, offset, best_length) + diff)
+		pos += best_length
+		literal_start = pos
+
+	insert(data[literal_start:])
+	return bytes(patch)
+
+
+def apply_patch(base, patch):
+	data = bytearray()
+	pos = 0
+	while pos < len(patch):
+		op = patch[pos]
+		if op == DELTA_COPY_ADD:
+			offset, length = struct.unpack_from("<II", patch, pos + 1)
+			pos += 9
+			data.extend((base[offset + i] + patch[pos + i]) & 0xFF for i in range(length))
+		elif op == DELTA_INSERT:
+			(length,) = struct.unpack_from("<I", patch, pos + 1)
+			pos += 5
+			data.extend(patch[pos:pos + length])
+		else:
+			raise ValueError(f"Unknown patch operation {op:02x}")
+		pos += length
+	return bytes(data)
+
+
+def delta_subelements(base, data, codec, window_bits, restart_interval, fallback):
+	patch = make_patch(base, data)
+	assert apply_patch(base, patch) == data
+
+	zdata = compress_segments(patch, codec, window_bits, restart_interval)
+	flags = (DELTA_FLAG_FALLBACK if fallback else 0) | (FLAG_SEGMENTED if restart_interval else 0)
+	header = struct.pack("<BBBBI", CODECS[codec], window_bits, flags, 0, len(base)) + base_sha256(base)
+	return [
+		hash_subelement(TAG_DELTA_IMAGE, zdata, data),
+		zigpy.ota.image.SubElement(
+			tag_id=zigpy.ota.image.ElementTagId(TAG_DELTA_IMAGE), data=header + zdata,
+		),
+	]
+
+
+def compare(filename):
+	with open(filename, "rb") as f:
+		data = f.read()
+
+	print(f"{'codec':8} {'window':>6} {'size':>9} {'ratio':>6} {'decode MB/s':>11} {'device RAM':>10}")
+	for codec in CODECS:
+		for window_bits in ([0] if codec == "none" else range(zlib.MAX_WBITS, 8, -1)):
+			zdata = compress(data, codec, window_bits)
+
+			start = time.perf_counter()
+			assert decompress(zdata, codec, window_bits) == data
+			elapsed = time.perf_counter() - start
+
+			ram = 0 if codec == "none" else INFLATE_STATE_SIZE + (1 << window_bits)
+			print(f"{codec:8} {window_bits:6} {len(zdata):9} {len(zdata) / len(data):6.3f} {len(data) / elapsed / 1e6:11.1f} {ram:10}")
+
+
+def create(filename, manufacturer_id, image_type, file_version, header_string, codec, window_bits, restart_interval, base, fallback):
+	with open(filename, "rb") as f:
+		data = f.read()
+
+	if base is None:
+		subelements = image_subelements(data, codec, window_bits, restart_interval)
+	else:
+		with open(base, "rb") as f:
+			base_data = f.read()
+
+		# Devices not running the base image skip the patch and use the full image
+		subelements = delta_subelements(base_data, data, codec, window_bits, restart_interval, fallback)
+		if fallback:
+			subelements += image_subelements(data, codec, window_bits, restart_interval)
 
 	image = zigpy.ota.image.OTAImage(
 		header=zigpy.ota.image.OTAImageHeader(
@@ -45,11 +253,7 @@ def create(filename, manufacturer_id, image_type, file_version, header_string):
 			header_string=header_string[0:32],
 			image_size=0,
 		),
-		subelements=[
-			zigpy.ota.image.SubElement(
-				tag_id=zigpy.ota.image.ElementTagId.UPGRADE_IMAGE, data=zdata,
-			)
-		],
+		subelements=subelements,
 	)
 
 	image.header.header_length = len(image.header.serialize())
@@ -58,18 +262,39 @@ def create(filename, manufacturer_id, image_type, file_version, header_string):
 
 if __name__ == "__main__":
 	any_int = functools.wraps(int)(functools.partial(int, base=0))
-	parser = argparse.ArgumentParser(description="Create zlib-compressed Zigbee OTA file",
+	parser = argparse.ArgumentParser(description="Create compressed Zigbee OTA file",
 		epilog="Reads a firmware image file and outputs an OTA file on standard output")
 	parser.add_argument("filename", metavar="INPUT", type=str, help="Firmware image filename")
-	parser.add_argument("output", metavar="OUTPUT", type=str, help="OTA filename")
-	parser.add_argument("-m", "--manufacturer_id", metavar="MANUFACTURER_ID", type=any_int, required=True, help="Manufacturer ID")
-	parser.add_argument("-i", "--image_type", metavar="IMAGE_ID", type=any_int, required=True, help="Image ID")
-	parser.add_argument("-v", "--file_version", metavar="VERSION", type=any_int, required=True, help="File version")
+	parser.add_argument("output", metavar="OUTPUT", type=str, nargs="?", help="OTA filename")
+	parser.add_argument("-m", "--manufacturer_id", metavar="MANUFACTURER_ID", type=any_int, help="Manufacturer ID")
+	parser.add_argument("-i", "--image_type", metavar="IMAGE_ID", type=any_int, help="Image ID")
+	parser.add_argument("-v", "--file_version", metavar="VERSION", type=any_int, help="File version")
 	parser.add_argument("-s", "--header_string", metavar="HEADER_STRING", type=str, default="", help="Header String")
+	parser.add_argument("-c", "--codec", choices=CODECS.keys(), default="zlib", help="Compression codec (default: zlib)")
+	parser.add_argument("-w", "--window_bits", metavar="BITS", type=int, choices=range(9, 16), default=zlib.MAX_WBITS,
+		help="Compression window size as a power of two, smaller windows need less RAM on the device (default: 15)")
+	parser.add_argument("-r", "--restart_interval", metavar="KB", type=int, default=0,
+		help="Compress in independent segments of this many KB, so devices can resume an interrupted download (default: off)")
+	parser.add_argument("-b", "--base", metavar="BASE", type=str,
+		help="Create a patch against this firmware image, devices must be running it")
+	parser.add_argument("-f", "--fallback", action="store_true",
+		help="Also include the full image, for devices not running BASE")
+	parser.add_argument("--compare", action="store_true",
+		help="Compare image size, decode speed and device RAM of all codecs for INPUT instead of creating an OTA file")
 
 	args = parser.parse_args()
+	if args.compare:
+		compare(args.filename)
+		sys.exit(0)
+	if args.output is None or args.manufacturer_id is None or args.image_type is None or args.file_version is None:
+		parser.error("OUTPUT, --manufacturer_id, --image_type and --file_version are required")
+	if args.fallback and args.base is None:
+		parser.error("--fallback requires --base")
+
 	output = args.output
 	del args.output
+	args.restart_interval *= 1024
+	del args.compare
 
 	data = create(**vars(args))
 	with open(output, "wb") as f:
@@ -0,0 +1,201 @@
+#!/usr/bin/env python
+# gen-dimming-lut - Generate the level to PWM duty table for the light driver
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+import argparse
+import os
+import re
+import sys
+
+LEVELS = 255
+MAX_LEVEL = 254
+
+# Kconfig LIGHT_PWM choices: frequency in Hz, duty resolution in bits
+PWM_SETTINGS = [(4000, 13), (2000, 15)]
+
+SOURCE_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "main")
+
+
+def cie1931(x):
+	# CIE 1931 lightness L* (0..100) to relative luminance Y (0..1)
+	lightness = x * 100.0
+	if lightness <= 8.0:
+		return lightness / 903.3
+	return ((lightness + 16.0) / 116.0) ** 3
+
+
+def curve_function(curve, gamma):
+	if curve == "cie1931":
+		return cie1931
+	if curve == "gamma":
+		return lambda x: x ** gamma
+	return lambda x: x
+
+
+def generate(curve, gamma, resolution):
+	max_duty = 1 << resolution
+	f = curve_function(curve, gamma)
+
+	table = [0]
+	for level in range(1, LEVELS):
+		duty = round(f(level / MAX_LEVEL) * max_duty)
+		# Level 1 must still produce light
+		table.append(max(duty, 1))
+	return table
+
+
+def check(table, resolution):
+	max_duty = 1 << resolution
+	errors = []
+
+	if len(table) != LEVELS:
+		errors.append(f"table has {len(table)} entries, expected {LEVELS}")
+	if table[0] != 0:
+		errors.append(f"level 0 maps to {table[0]}, expected 0")
+	if table[1] == 0:
+		errors.append("level 1 maps to 0")
+	if table[MAX_LEVEL] != max_duty:
+		errors.append(f"level {MAX_LEVEL} maps to {table[MAX_LEVEL]}, expected {max_duty}")
+	for level in range(1, len(table)):
+		if table[level] < table[level - 1]:
+			errors.append(f"not monotonic at level {level}: {table[level - 1]} > {table[level]}")
+
+	return errors
+
+
+def output(table, curve, gamma, resolution):
+	lines = [
+		"/* Generated by gen-dimming-lut.py, do not edit */",
+		"#pragma once",
+		"",
+		"#include <stdint.h>",
+		"",
+		f"/* Curve: {curve}" + (f", gamma {gamma}" if curve == "gamma" else "") + " */",
+		f"#define DIMMING_LUT_RESOLUTION {resolution}",
+		"",
+		f"static const uint32_t dimming_lut[{LEVELS}] = {{",
+	]
+	for i in range(0, len(table), 8):
+		lines.append("    " + " ".join(f"{value:5d}," for value in table[i:i + 8]))
+	lines.append("};")
+	return "\n".join(lines) + "\n"
+
+
+def read_source(name):
+	with open(os.path.join(SOURCE_DIR, name)) as f:
+		return f.read()
+
+
+def read_mireds_range():
+	# LIGHT_MIREDS_MIN and LIGHT_MIREDS_MAX in main/light_curve.h
+	header = read_source("light_curve.h")
+	return tuple(int(re.search(rf"#define\s+LIGHT_MIREDS_{name}\s+(\d+)", header).group(1)) for name in ("MIN", "MAX"))
+
+
+def read_calibration():
+	# light_calibration_default in main/light_curve.c: mireds, cw, ww (per mille), lumen
+	source = read_source("light_curve.c")
+	match = re.search(r"light_calibration_default\s*=\s*{\s*\.count\s*=\s*(\d+),\s*\.points\s*=\s*{(.*?)}\s*,?\s*}\s*;",
+		source, re.DOTALL)
+	if not match:
+		sys.exit("gen-dimming-lut: light_calibration_default not found in main/light_curve.c")
+	points = [tuple(int(value) for value in point)
+		for point in re.findall(r"{\s*(\d+),\s*(\d+),\s*(\d+),\s*(\d+)\s*}", match.group(2))]
+	if len(points) != int(match.group(1)):
+		sys.exit("gen-dimming-lut: light_calibration_default count does not match its points")
+	return points
+
+
+def interpolate(calibration, mireds):
+	if mireds <= calibration[0][0]:
+		return calibration[0][1:]
+	if mireds >= calibration[-1][0]:
+		return calibration[-1][1:]
+	for a, b in zip(calibration, calibration[1:]):
+		if mireds <= b[0]:
+			t = (mireds - a[0]) / (b[0] - a[0])
+			return tuple(x + (y - x) * t for x, y in zip(a[1:], b[1:]))
+
+
+def mix_table(calibration, mireds_range, max_duty):
+	# Full brightness duty per temperature, scaled to the dimmest mix like light_curve_set_calibration()
+	points = [interpolate(calibration, mireds) for mireds in range(mireds_range[0], mireds_range[1] + 1)]
+	lumen_min = min(lumen for _, _, lumen in points)
+	return [(round(cw * max_duty / 1000 * lumen_min / lumen), round(ww * max_duty / 1000 * lumen_min / lumen))
+		for cw, ww, lumen in points]
+
+
+def compare(curve, gamma):
+	calibration = read_calibration()
+	mireds_range = read_mireds_range()
+	print(f"{'PWM':>9} {'bits':>4} {'step ns':>7} {'level 1 us':>10} {'aligned us':>10} {'phased us':>9} {'fades us':>8}")
+	for frequency, resolution in PWM_SETTINGS:
+		max_duty = 1 << resolution
+		period_us = 1e6 / frequency
+		table = generate(curve, gamma, resolution)
+		mix = mix_table(calibration, mireds_range, max_duty)
+
+		# Shortest pulse: level 1 at the temperature where one channel is at full duty
+		level1 = min(max(cw, ww) * table[1] >> resolution for cw, ww in mix)
+
+		# Peak time both channels are on, with both pulses starting the period and
+		# with WW ending it (light_driver.c)
+		aligned = phased = 0
+		for level in range(1, LEVELS):
+			for cw, ww in mix:
+				cw = cw * table[level] >> resolution
+				ww = ww * table[level] >> resolution
+				aligned = max(aligned, min(cw, ww))
+				phased = max(phased, cw + ww - max_duty)
+
+		# Hardware fades between temperatures at full brightness, both duties step linearly
+		fades = 0
+		for a in mix[::25]:
+			for b in mix[::25]:
+				for step in range(33):
+					cw = a[0] + (b[0] - a[0]) * step // 32
+					ww = a[1] + (b[1] - a[1]) * step // 32
+					fades = max(fades, cw + ww - max_duty)
+
+		step_ns = period_us * 1000 / max_duty
+		print(f"{frequency:6} Hz {resolution:4} {step_ns:7.1f} {level1 * step_ns / 1000:10.3f} "
+			f"{aligned * step_ns / 1000:10.1f} {phased * step_ns / 1000:9.1f} {fades * step_ns / 1000:8.1f}")
+
+
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser(description="Generate the level to PWM duty table for the light driver")
+	parser.add_argument("output", metavar="OUTPUT", type=str, nargs="?", help="Header filename")
+	parser.add_argument("-c", "--curve", choices=["cie1931", "gamma", "linear"], default="cie1931", help="Dimming curve")
+	parser.add_argument("-g", "--gamma", type=float, default=2.2, help="Exponent for the gamma curve")
+	parser.add_argument("-r", "--resolution", type=int, default=13, help="PWM duty resolution in bits")
+	parser.add_argument("--compare", action="store_true",
+		help="Model the PWM settings: shortest pulse and peak time both channels are on")
+
+	args = parser.parse_args()
+	if args.compare:
+		compare(args.curve, args.gamma)
+		sys.exit(0)
+	if not args.output:
+		parser.error("OUTPUT is required")
+
+	table = generate(args.curve, args.gamma, args.resolution)
+	errors = check(table, args.resolution)
+	if errors:
+		for error in errors:
+			print(f"gen-dimming-lut: {error}", file=sys.stderr)
+		sys.exit(1)
+
+	with open(args.output, "w") as f:
+		f.write(output(table, args.curve, args.gamma, args.resolution))
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "diag.h"
+#include "driver/ledc.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "freertos/task.h"
+
+/* Controls and records of the fake ESP-IDF, FreeRTOS and Zigbee stack the
+ * firmware sources are built against on the host (see stubs/). */
+
+/* Misuse of an API the real one would not survive either */
+void fake_fail(const char *message);
+
+/* Partitions: RAM with NOR flash semantics, a write can only clear bits and an
+ * erase must cover whole sectors. They start out filled with fill. */
+esp_partition_t *fake_partition_create(const char *label, size_t size, uint8_t fill);
+uint8_t *fake_partition_data(const esp_partition_t *partition);
+void fake_partition_set_sha256(const esp_partition_t *partition, const uint8_t *sha256);
+
+typedef struct {
+    uint32_t sectors_erased;
+    uint32_t writes;
+    uint32_t bytes_written;
+} fake_flash_stats_t;
+
+extern fake_flash_stats_t fake_flash_stats;
+
+/* esp_ota_get_running_partition() and esp_ota_get_next_update_partition() */
+void fake_ota_set_partitions(const esp_partition_t *running, const esp_partition_t *next);
+extern const esp_partition_t *fake_boot_partition;     // set by esp_ota_set_boot_partition()
+
+extern bool fake_restarted;                            // esp_restart() was called
+extern esp_reset_reason_t fake_reset_reason;
+
+/* Start over as after a reset: RTC_NOINIT_ATTR memory is lost on a power-on,
+ * timers, LEDC, shutdown handlers and the Zigbee stack start from scratch and
+ * the clock from boot. NVS and the partitions are flash and stay. */
+void fake_reboot(esp_reset_reason_t reason);
+
+/* esp_timer: move the clock on, running the timers due on the way */
+void fake_time_advance(int64_t us);
+void fake_timers_reset(void);
+
+/* LEDC channels: duty is the programmed value, output what the channel is
+ * driven at (or fading to, for fade_ms) */
+typedef struct {
+    bool configured;
+    int gpio;
+    bool invert;
+    uint32_t duty;
+    uint32_t output;
+    uint32_t fade_ms;
+} fake_ledc_channel_t;
+
+typedef struct {
+    uint32_t updates;       // ledc_update_duty()
+    uint32_t fades;         // ledc_fade_start()
+    uint32_t stops;         // ledc_fade_stop()
+} fake_ledc_stats_t;
+
+extern fake_ledc_channel_t fake_ledc[LEDC_CHANNEL_MAX];
+extern fake_ledc_stats_t fake_ledc_stats;
+void fake_ledc_reset(void);
+
+/* Last OTA FileOffset written through esp_zb_zcl_set_attribute_val() */
+extern uint32_t fake_ota_file_offset;
+
+/* Zigbee stack: the attribute setters check the lock is held */
+extern uint32_t fake_zb_factory_resets;
+bool fake_zigbee_locked(void);
+void fake_zigbee_reset(void);
+
+/* report_attribute() calls */
+extern uint32_t fake_reports;
+
+/* diag_count() totals and the last diag_light_on() */
+extern uint32_t fake_diag_counters[DIAG_COUNTER_MAX];
+extern uint32_t fake_diag_light_on_ms;
+
+/* NVS: every namespace is erased */
+void fake_nvs_erase_all(void);
+
+typedef struct {
+    uint32_t sets;
+    uint32_t commits;
+} fake_nvs_stats_t;
+
+extern fake_nvs_stats_t fake_nvs_stats;
+
+/* Tasks run on painted host stacks of their own, whatever stack they were
+ * given. Wait for a task to return and free its host stack. */
+void fake_task_join(TaskHandle_t task);
+
+/* Wait until no other task can run: each is blocked on something nobody has given it */
+void fake_tasks_wait_idle(void);
+
+/* Deepest host stack use of a task so far, in bytes */
+size_t fake_task_stack_used(TaskHandle_t task);
@@ -0,0 +1,25 @@
+#include "diag.h"
+#include "fake.h"
+
+/* The diagnostics cluster, reduced to its counters */
+
+uint32_t fake_diag_counters[DIAG_COUNTER_MAX];
+uint32_t fake_diag_light_on_ms = 0;
+
+void diag_count(diag_counter_t counter, uint32_t value)
+{
+    __atomic_fetch_add(&fake_diag_counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void diag_latency(uint32_t latency_us)
+{
+}
+
+void diag_light_on(uint32_t light_on_ms)
+{
+    fake_diag_light_on_ms = light_on_ms;
+}
+
+void diag_ota_progress(uint32_t max_stall_us, uint32_t bytes_per_s)
+{
+}
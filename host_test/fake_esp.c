@@ -0,0 +1,194 @@
+#include "fake.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_app_format.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define FAKE_SECTOR_SIZE        4096
+#define FAKE_SHUTDOWN_HANDLERS  5
+#define FAKE_RTC_GARBAGE        0xA5
+
+typedef struct {
+    esp_partition_t partition;
+    uint8_t *data;
+    uint8_t sha256[32];
+} fake_partition_t;
+
+esp_log_level_t fake_log_level = ESP_LOG_WARN;
+fake_flash_stats_t fake_flash_stats;
+const esp_partition_t *fake_boot_partition = NULL;
+bool fake_restarted = false;
+esp_reset_reason_t fake_reset_reason = ESP_RST_POWERON;
+
+static const esp_partition_t *running_partition = NULL;
+static const esp_partition_t *next_partition = NULL;
+
+void fake_fail(const char *message)
+{
+    fprintf(stderr, "%s\n", message);
+    abort();
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    return code == ESP_OK ? "ESP_OK" : "ESP_ERR";
+}
+
+static shutdown_handler_t shutdown_handlers[FAKE_SHUTDOWN_HANDLERS];
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handle)
+{
+    for (int i = 0; i < FAKE_SHUTDOWN_HANDLERS; i++) {
+        if (!shutdown_handlers[i]) {
+            shutdown_handlers[i] = handle;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+// Returns to the caller, the test decides when the device comes back up
+void esp_restart(void)
+{
+    for (int i = FAKE_SHUTDOWN_HANDLERS - 1; i >= 0; i--) {
+        if (shutdown_handlers[i])
+            shutdown_handlers[i]();
+    }
+    fake_restarted = true;
+}
+
+// RTC_NOINIT_ATTR variables, only there when something linked in has them
+extern uint8_t __start_fake_rtc_noinit[] __attribute__((weak));
+extern uint8_t __stop_fake_rtc_noinit[] __attribute__((weak));
+
+// Byte by byte, ASan would see the padding between the variables as overflows
+__attribute__((no_sanitize_address))
+static void rtc_power_loss(void)
+{
+    for (volatile uint8_t *p = __start_fake_rtc_noinit; p < __stop_fake_rtc_noinit; p++)
+        *p = FAKE_RTC_GARBAGE;
+}
+
+void fake_reboot(esp_reset_reason_t reason)
+{
+    if (reason == ESP_RST_POWERON)
+        rtc_power_loss();
+    fake_reset_reason = reason;
+    fake_restarted = false;
+    for (int i = 0; i < FAKE_SHUTDOWN_HANDLERS; i++)
+        shutdown_handlers[i] = NULL;
+    fake_timers_reset();
+    fake_ledc_reset();
+    fake_zigbee_reset();
+}
+
+esp_reset_reason_t esp_reset_reason(void)
+{
+    return fake_reset_reason;
+}
+
+// Same polynomial and inversion as zlib
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    return crc32(crc, buf, len);
+}
+
+esp_partition_t *fake_partition_create(const char *label, size_t size, uint8_t fill)
+{
+    fake_partition_t *fake = calloc(1, sizeof(*fake));
+
+    fake->partition.size = size;
+    fake->partition.erase_size = FAKE_SECTOR_SIZE;
+    strncpy(fake->partition.label, label, sizeof(fake->partition.label) - 1);
+    fake->data = malloc(size);
+    memset(fake->data, fill, size);
+    return &fake->partition;
+}
+
+uint8_t *fake_partition_data(const esp_partition_t *partition)
+{
+    return ((const fake_partition_t *)partition)->data;
+}
+
+void fake_partition_set_sha256(const esp_partition_t *partition, const uint8_t *sha256)
+{
+    memcpy(((fake_partition_t *)partition)->sha256, sha256, 32);
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if (src_offset > partition->size || size > partition->size - src_offset)
+        return ESP_ERR_INVALID_SIZE;
+
+    memcpy(dst, fake_partition_data(partition) + src_offset, size);
+    return ESP_OK;
+}
+
+// NOR flash: bits can only be cleared, so writing over data that was not erased corrupts it
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    uint8_t *data = fake_partition_data(partition);
+    const uint8_t *bytes = src;
+
+    if (dst_offset > partition->size || size > partition->size - dst_offset)
+        return ESP_ERR_INVALID_SIZE;
+
+    for (size_t i = 0; i < size; i++)
+        data[dst_offset + i] &= bytes[i];
+    fake_flash_stats.writes++;
+    fake_flash_stats.bytes_written += size;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (offset % FAKE_SECTOR_SIZE || size % FAKE_SECTOR_SIZE)
+        return ESP_ERR_INVALID_ARG;
+    if (offset > partition->size || size > partition->size - offset)
+        return ESP_ERR_INVALID_SIZE;
+
+    memset(fake_partition_data(partition) + offset, 0xFF, size);
+    fake_flash_stats.sectors_erased += size / FAKE_SECTOR_SIZE;
+    return ESP_OK;
+}
+
+// For an app partition this is the SHA-256 appended to the image
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition, uint8_t *sha_256)
+{
+    memcpy(sha_256, ((const fake_partition_t *)partition)->sha256, 32);
+    return ESP_OK;
+}
+
+void fake_ota_set_partitions(const esp_partition_t *running, const esp_partition_t *next)
+{
+    running_partition = running;
+    next_partition = next;
+    fake_boot_partition = NULL;
+    fake_restarted = false;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+    return running_partition;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+    return next_partition;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    if (fake_partition_data(partition)[0] != ESP_IMAGE_HEADER_MAGIC)
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+
+    fake_boot_partition = partition;
+    return ESP_OK;
+}
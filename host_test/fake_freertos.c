@@ -0,0 +1,335 @@
+#include "fake.h"
+#include "freertos/semphr.h"
+#include "freertos/stream_buffer.h"
+#include "freertos/task.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Tasks are threads and every primitive shares one lock, so that "every task
+ * is blocked" can be decided in one place. Priorities are ignored; a task that
+ * wants to let the others run first uses fake_tasks_wait_idle().
+ */
+
+#define FAKE_TASK_STACK_SIZE    (512 * 1024)    // host frames, with sanitizers, are much larger
+#define FAKE_STACK_PAINT        0xA5
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed;                  // something was given
+static pthread_cond_t blocked = PTHREAD_COND_INITIALIZER;     // a task started waiting
+static pthread_once_t changed_once = PTHREAD_ONCE_INIT;
+static StaticTask_t *tasks = NULL;
+static __thread StaticTask_t *current = NULL;
+
+static void changed_init(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&changed, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void enter(void)
+{
+    pthread_once(&changed_once, changed_init);
+    pthread_mutex_lock(&lock);
+}
+
+static void leave(void)
+{
+    pthread_mutex_unlock(&lock);
+}
+
+// Something was given: every blocked task has to look again
+static void wake_all(void)
+{
+    for (StaticTask_t *task = tasks; task; task = task->next)
+        task->blocked = false;
+    pthread_cond_broadcast(&changed);
+}
+
+static struct timespec deadline(TickType_t ticks)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ticks / 1000;
+    ts.tv_nsec += (long)(ticks % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+// Called with the lock held and the condition false, returns false on timeout.
+// The task stays blocked until something is given or the time is up.
+static bool wait(TickType_t ticks, const struct timespec *until)
+{
+    if (ticks == 0)
+        return false;
+
+    if (current && !current->blocked) {
+        current->blocked = true;
+        pthread_cond_broadcast(&blocked);
+    }
+
+    int ret = ticks == portMAX_DELAY
+        ? pthread_cond_wait(&changed, &lock)
+        : pthread_cond_timedwait(&changed, &lock, until);
+
+    if (ret == ETIMEDOUT) {
+        if (current)
+            current->blocked = false;
+        return false;
+    }
+    return true;
+}
+
+static void *task_main(void *arg)
+{
+    StaticTask_t *task = arg;
+
+    current = task;
+    task->function(task->arg);
+
+    enter();
+    for (StaticTask_t **p = &tasks; *p; p = &(*p)->next) {
+        if (*p == task) {
+            *p = task->next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&blocked);
+    leave();
+    return NULL;
+}
+
+static TaskHandle_t task_start(TaskFunction_t function, const char *name, void *arg, StaticTask_t *task)
+{
+    pthread_attr_t attr;
+
+    memset(task, 0, sizeof(*task));
+    task->name = name;
+    task->function = function;
+    task->arg = arg;
+    task->stack_size = FAKE_TASK_STACK_SIZE;
+    task->stack = aligned_alloc(4096, task->stack_size);
+    memset(task->stack, FAKE_STACK_PAINT, task->stack_size);
+
+    enter();
+    task->next = tasks;
+    tasks = task;
+    leave();
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, task->stack, task->stack_size);
+    if (pthread_create(&task->thread, &attr, task_main, task)) {
+        perror("pthread_create");
+        abort();
+    }
+    pthread_attr_destroy(&attr);
+    return task;
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t function, const char *name, uint32_t stack_depth, void *arg,
+    UBaseType_t priority, StackType_t *stack, StaticTask_t *task)
+{
+    return task_start(function, name, arg, task);
+}
+
+void fake_task_join(TaskHandle_t task)
+{
+    pthread_join(task->thread, NULL);
+    free(task->stack);
+    task->stack = NULL;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    enter();
+    task->notifications++;
+    wake_all();
+    leave();
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    struct timespec until = deadline(ticks_to_wait);
+    uint32_t value;
+
+    enter();
+    while (!current->notifications && wait(ticks_to_wait, &until))
+        ;
+    value = current->notifications;
+    if (value)
+        current->notifications = clear_on_exit ? 0 : value - 1;
+    leave();
+    return value;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return current;
+}
+
+TaskHandle_t xTaskGetHandle(const char *name)
+{
+    StaticTask_t *task;
+
+    enter();
+    for (task = tasks; task && strcmp(task->name, name); task = task->next)
+        ;
+    leave();
+    return task;
+}
+
+// Free stack in bytes, the paint is untouched from the far end up to the deepest frame
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    size_t free = 0;
+
+    while (free < task->stack_size && task->stack[free] == FAKE_STACK_PAINT)
+        free++;
+    return free;
+}
+
+size_t fake_task_stack_used(TaskHandle_t task)
+{
+    return task->stack_size - uxTaskGetStackHighWaterMark(task);
+}
+
+void fake_tasks_wait_idle(void)
+{
+    enter();
+    while (1) {
+        bool idle = true;
+        for (StaticTask_t *task = tasks; task; task = task->next) {
+            if (task != current && !task->blocked)
+                idle = false;
+        }
+        if (idle)
+            break;
+        pthread_cond_wait(&blocked, &lock);
+    }
+    leave();
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *semaphore)
+{
+    semaphore->count = 0;
+    return semaphore;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    BaseType_t ret = pdFAIL;
+
+    enter();
+    if (!semaphore->count) {
+        semaphore->count = 1;
+        wake_all();
+        ret = pdPASS;
+    }
+    leave();
+    return ret;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait)
+{
+    struct timespec until = deadline(ticks_to_wait);
+    BaseType_t ret = pdFAIL;
+
+    enter();
+    while (!semaphore->count && wait(ticks_to_wait, &until))
+        ;
+    if (semaphore->count) {
+        semaphore->count--;
+        ret = pdPASS;
+    }
+    leave();
+    return ret;
+}
+
+StreamBufferHandle_t xStreamBufferCreateStatic(size_t size, size_t trigger_level, uint8_t *storage,
+    StaticStreamBuffer_t *buffer)
+{
+    *buffer = (StaticStreamBuffer_t) { .storage = storage, .size = size };
+    return buffer;
+}
+
+BaseType_t xStreamBufferReset(StreamBufferHandle_t buffer)
+{
+    enter();
+    buffer->head = 0;
+    buffer->length = 0;
+    wake_all();
+    leave();
+    return pdPASS;
+}
+
+// Waits for room for all of the data, on timeout sends what fits
+size_t xStreamBufferSend(StreamBufferHandle_t buffer, const void *data, size_t size, TickType_t ticks_to_wait)
+{
+    struct timespec until = deadline(ticks_to_wait);
+    const uint8_t *src = data;
+
+    enter();
+    while (buffer->size - buffer->length < size && wait(ticks_to_wait, &until))
+        ;
+    if (size > buffer->size - buffer->length)
+        size = buffer->size - buffer->length;
+    for (size_t i = 0; i < size; i++)
+        buffer->storage[(buffer->head + buffer->length + i) % buffer->size] = src[i];
+    buffer->length += size;
+    if (size)
+        wake_all();
+    leave();
+    return size;
+}
+
+size_t xStreamBufferReceive(StreamBufferHandle_t buffer, void *data, size_t size, TickType_t ticks_to_wait)
+{
+    struct timespec until = deadline(ticks_to_wait);
+    uint8_t *dst = data;
+
+    enter();
+    while (!buffer->length && wait(ticks_to_wait, &until))
+        ;
+    if (size > buffer->length)
+        size = buffer->length;
+    for (size_t i = 0; i < size; i++)
+        dst[i] = buffer->storage[(buffer->head + i) % buffer->size];
+    buffer->head = (buffer->head + size) % buffer->size;
+    buffer->length -= size;
+    if (size)
+        wake_all();
+    leave();
+    return size;
+}
+
+size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t buffer)
+{
+    size_t spaces;
+
+    enter();
+    spaces = buffer->size - buffer->length;
+    leave();
+    return spaces;
+}
+
+BaseType_t xStreamBufferIsEmpty(StreamBufferHandle_t buffer)
+{
+    BaseType_t empty;
+
+    enter();
+    empty = buffer->length == 0;
+    leave();
+    return empty;
+}
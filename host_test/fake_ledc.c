@@ -0,0 +1,142 @@
+#include "fake.h"
+#include "driver/ledc.h"
+#include "soc/soc_caps.h"
+
+/* Channels take effect as the driver would program the hardware: a duty is
+ * latched by ledc_update_duty(), a fade by ledc_fade_start(). A fade shows
+ * as its target and duration, the steps are left to the hardware. */
+
+typedef struct {
+    bool configured;
+    unsigned int resolution;
+} timer_state_t;
+
+static timer_state_t ledc_timers[LEDC_TIMER_MAX];
+static bool fade_installed = false;
+static ledc_timer_t channel_timers[LEDC_CHANNEL_MAX];
+static uint32_t fade_targets[LEDC_CHANNEL_MAX];
+static uint32_t fade_times_ms[LEDC_CHANNEL_MAX];
+
+fake_ledc_channel_t fake_ledc[LEDC_CHANNEL_MAX];
+fake_ledc_stats_t fake_ledc_stats;
+
+static bool valid(ledc_mode_t speed_mode, ledc_channel_t channel)
+{
+    return speed_mode == LEDC_LOW_SPEED_MODE && channel >= 0 && channel < LEDC_CHANNEL_MAX && fake_ledc[channel].configured;
+}
+
+static bool valid_duty(ledc_channel_t channel, uint32_t duty)
+{
+    return duty <= (1u << ledc_timers[channel_timers[channel]].resolution);
+}
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t *timer_conf)
+{
+    if (timer_conf->speed_mode != LEDC_LOW_SPEED_MODE || timer_conf->timer_num >= LEDC_TIMER_MAX
+            || timer_conf->duty_resolution == 0 || timer_conf->duty_resolution >= SOC_LEDC_TIMER_BIT_WIDTH)
+        return ESP_ERR_INVALID_ARG;
+
+    ledc_timers[timer_conf->timer_num] = (timer_state_t) { true, timer_conf->duty_resolution };
+    return ESP_OK;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t *ledc_conf)
+{
+    ledc_channel_t channel = ledc_conf->channel;
+
+    if (ledc_conf->speed_mode != LEDC_LOW_SPEED_MODE || channel >= LEDC_CHANNEL_MAX
+            || ledc_conf->timer_sel >= LEDC_TIMER_MAX || !ledc_timers[ledc_conf->timer_sel].configured)
+        return ESP_ERR_INVALID_ARG;
+
+    channel_timers[channel] = ledc_conf->timer_sel;
+    if (!valid_duty(channel, ledc_conf->duty))
+        return ESP_ERR_INVALID_ARG;
+
+    fake_ledc[channel] = (fake_ledc_channel_t) {
+        .configured = true,
+        .gpio = ledc_conf->gpio_num,
+        .invert = ledc_conf->flags.output_invert,
+        .duty = ledc_conf->duty,
+        .output = ledc_conf->duty,
+    };
+    return ESP_OK;
+}
+
+esp_err_t ledc_fade_func_install(int intr_alloc_flags)
+{
+    if (fade_installed)
+        return ESP_ERR_INVALID_STATE;
+
+    fade_installed = true;
+    return ESP_OK;
+}
+
+esp_err_t ledc_set_duty(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t duty)
+{
+    if (!valid(speed_mode, channel) || !valid_duty(channel, duty))
+        return ESP_ERR_INVALID_ARG;
+
+    fake_ledc[channel].duty = duty;
+    return ESP_OK;
+}
+
+esp_err_t ledc_update_duty(ledc_mode_t speed_mode, ledc_channel_t channel)
+{
+    if (!valid(speed_mode, channel))
+        return ESP_ERR_INVALID_ARG;
+
+    fake_ledc[channel].output = fake_ledc[channel].duty;
+    fake_ledc[channel].fade_ms = 0;
+    fake_ledc_stats.updates++;
+    return ESP_OK;
+}
+
+esp_err_t ledc_set_fade_with_time(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t target_duty, int max_fade_time_ms)
+{
+    if (!valid(speed_mode, channel) || !valid_duty(channel, target_duty) || max_fade_time_ms <= 0)
+        return ESP_ERR_INVALID_ARG;
+    if (!fade_installed)
+        return ESP_ERR_INVALID_STATE;
+
+    fade_targets[channel] = target_duty;
+    fade_times_ms[channel] = max_fade_time_ms;
+    return ESP_OK;
+}
+
+esp_err_t ledc_fade_start(ledc_mode_t speed_mode, ledc_channel_t channel, ledc_fade_mode_t fade_mode)
+{
+    if (!valid(speed_mode, channel))
+        return ESP_ERR_INVALID_ARG;
+    if (!fade_installed || !fade_times_ms[channel])
+        return ESP_ERR_INVALID_STATE;
+
+    fake_ledc[channel].duty = fade_targets[channel];
+    fake_ledc[channel].output = fade_targets[channel];
+    fake_ledc[channel].fade_ms = fade_times_ms[channel];
+    fade_times_ms[channel] = 0;
+    fake_ledc_stats.fades++;
+    return ESP_OK;
+}
+
+esp_err_t ledc_fade_stop(ledc_mode_t speed_mode, ledc_channel_t channel)
+{
+    if (!valid(speed_mode, channel))
+        return ESP_ERR_INVALID_ARG;
+    if (!fade_installed)
+        return ESP_ERR_INVALID_STATE;
+
+    fake_ledc_stats.stops++;
+    return ESP_OK;
+}
+
+void fake_ledc_reset(void)
+{
+    for (int i = 0; i < LEDC_TIMER_MAX; i++)
+        ledc_timers[i] = (timer_state_t) { 0 };
+    for (int i = 0; i < LEDC_CHANNEL_MAX; i++) {
+        fake_ledc[i] = (fake_ledc_channel_t) { 0 };
+        fade_times_ms[i] = 0;
+    }
+    fade_installed = false;
+    fake_ledc_stats = (fake_ledc_stats_t) { 0 };
+}
@@ -0,0 +1,230 @@
+#include "fake.h"
+#include "nvs_flash.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/* Every set is committed at once, so a commit only counts. Values are stored
+ * inline, so the fake never allocates while the firmware runs. */
+
+#define FAKE_NVS_NAMESPACES     16
+#define FAKE_NVS_ENTRIES        128
+#define FAKE_NVS_NAME_SIZE      NVS_KEY_NAME_MAX_SIZE
+#define FAKE_NVS_VALUE_SIZE     512
+
+typedef enum {
+    TYPE_U8,
+    TYPE_U16,
+    TYPE_U32,
+    TYPE_BLOB,
+} entry_type_t;
+
+typedef struct {
+    bool used;
+    uint8_t namespace_index;
+    char key[FAKE_NVS_NAME_SIZE];
+    entry_type_t type;
+    uint8_t data[FAKE_NVS_VALUE_SIZE];
+    size_t size;
+} entry_t;
+
+typedef struct {
+    char name[FAKE_NVS_NAME_SIZE];
+    bool used;
+} namespace_t;
+
+fake_nvs_stats_t fake_nvs_stats;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static namespace_t namespaces[FAKE_NVS_NAMESPACES];
+static entry_t entries[FAKE_NVS_ENTRIES];
+
+// Handles are namespace index + 1, with the read-only flag above
+#define HANDLE_READONLY         0x100
+
+void fake_nvs_erase_all(void)
+{
+    pthread_mutex_lock(&lock);
+    memset(entries, 0, sizeof(entries));
+    memset(namespaces, 0, sizeof(namespaces));
+    fake_nvs_stats = (fake_nvs_stats_t) { 0 };
+    pthread_mutex_unlock(&lock);
+}
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *namespace_name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    int free_index = -1;
+    esp_err_t err = ESP_OK;
+
+    if (strlen(namespace_name) >= FAKE_NVS_NAME_SIZE)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&lock);
+    int i;
+    for (i = 0; i < FAKE_NVS_NAMESPACES; i++) {
+        if (namespaces[i].used && !strcmp(namespaces[i].name, namespace_name))
+            break;
+        if (!namespaces[i].used && free_index < 0)
+            free_index = i;
+    }
+
+    if (i == FAKE_NVS_NAMESPACES) {
+        if (open_mode == NVS_READONLY) {
+            err = ESP_ERR_NVS_NOT_FOUND;
+        } else if (free_index < 0) {
+            err = ESP_ERR_NO_MEM;
+        } else {
+            i = free_index;
+            namespaces[i].used = true;
+            strcpy(namespaces[i].name, namespace_name);
+        }
+    }
+    if (err == ESP_OK)
+        *out_handle = (i + 1) | (open_mode == NVS_READONLY ? HANDLE_READONLY : 0);
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    pthread_mutex_lock(&lock);
+    fake_nvs_stats.commits++;
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+static entry_t *find(nvs_handle_t handle, const char *key)
+{
+    uint8_t index = (handle & ~HANDLE_READONLY) - 1;
+
+    for (int i = 0; i < FAKE_NVS_ENTRIES; i++) {
+        if (entries[i].used && entries[i].namespace_index == index && !strcmp(entries[i].key, key))
+            return &entries[i];
+    }
+    return NULL;
+}
+
+static esp_err_t set(nvs_handle_t handle, const char *key, entry_type_t type, const void *value, size_t size)
+{
+    esp_err_t err = ESP_OK;
+
+    if (handle & HANDLE_READONLY)
+        return ESP_ERR_NVS_READ_ONLY;
+    if (strlen(key) >= FAKE_NVS_NAME_SIZE)
+        return ESP_ERR_INVALID_ARG;
+    if (size > FAKE_NVS_VALUE_SIZE)
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+
+    pthread_mutex_lock(&lock);
+    entry_t *entry = find(handle, key);
+    for (int i = 0; !entry && i < FAKE_NVS_ENTRIES; i++) {
+        if (!entries[i].used)
+            entry = &entries[i];
+    }
+
+    if (entry) {
+        *entry = (entry_t) {
+            .used = true,
+            .namespace_index = (handle & ~HANDLE_READONLY) - 1,
+            .type = type,
+            .size = size,
+        };
+        strcpy(entry->key, key);
+        memcpy(entry->data, value, size);
+        fake_nvs_stats.sets++;
+    } else {
+        err = ESP_ERR_NO_MEM;
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+static esp_err_t get(nvs_handle_t handle, const char *key, entry_type_t type, void *value, size_t *size)
+{
+    esp_err_t err = ESP_OK;
+
+    pthread_mutex_lock(&lock);
+    entry_t *entry = find(handle, key);
+    if (!entry || entry->type != type) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (type == TYPE_BLOB && !value) {
+        *size = entry->size;
+    } else if (*size < entry->size) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        memcpy(value, entry->data, entry->size);
+        *size = entry->size;
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value)
+{
+    return set(handle, key, TYPE_U8, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value)
+{
+    size_t size = sizeof(*out_value);
+    return get(handle, key, TYPE_U8, out_value, &size);
+}
+
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char *key, uint16_t value)
+{
+    return set(handle, key, TYPE_U16, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char *key, uint16_t *out_value)
+{
+    size_t size = sizeof(*out_value);
+    return get(handle, key, TYPE_U16, out_value, &size);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return set(handle, key, TYPE_U32, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+    size_t size = sizeof(*out_value);
+    return get(handle, key, TYPE_U32, out_value, &size);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    return set(handle, key, TYPE_BLOB, value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    return get(handle, key, TYPE_BLOB, out_value, length);
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    esp_err_t err = ESP_OK;
+
+    if (handle & HANDLE_READONLY)
+        return ESP_ERR_NVS_READ_ONLY;
+
+    pthread_mutex_lock(&lock);
+    entry_t *entry = find(handle, key);
+    if (entry) {
+        *entry = (entry_t) { 0 };
+    } else {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
@@ -0,0 +1,124 @@
+#include "fake.h"
+#include "esp_private/esp_clk.h"
+#include "esp_timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* A clock that only moves when told to, so that debounce and transition
+ * times can be stepped through exactly. Callbacks run in the caller of
+ * fake_time_advance(), as they would in the esp_timer task. */
+
+#define FAKE_TIMERS             16
+#define FAKE_BOOT_TIME_US       300000          // app_main() starts about this long after reset
+
+struct esp_timer {
+    bool used;
+    bool armed;
+    esp_timer_cb_t callback;
+    void *arg;
+    int64_t expiry_us;
+    uint64_t period_us;
+};
+
+static struct esp_timer timers[FAKE_TIMERS];
+static int64_t time_us = FAKE_BOOT_TIME_US;
+
+int64_t esp_timer_get_time(void)
+{
+    return __atomic_load_n(&time_us, __ATOMIC_RELAXED);
+}
+
+// Counts from power-on, through the ROM and the bootloader
+uint64_t esp_clk_rtc_time(void)
+{
+    return esp_timer_get_time();
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    for (int i = 0; i < FAKE_TIMERS; i++) {
+        if (!timers[i].used) {
+            timers[i] = (struct esp_timer) {
+                .used = true,
+                .callback = create_args->callback,
+                .arg = create_args->arg,
+            };
+            *out_handle = &timers[i];
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+static esp_err_t start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us)
+{
+    if (timer->armed)
+        return ESP_ERR_INVALID_STATE;
+
+    timer->armed = true;
+    timer->expiry_us = esp_timer_get_time() + timeout_us;
+    timer->period_us = period_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    return start(timer, period, period);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (!timer->armed)
+        return ESP_ERR_INVALID_STATE;
+
+    timer->armed = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    if (timer->armed)
+        return ESP_ERR_INVALID_STATE;
+
+    timer->used = false;
+    return ESP_OK;
+}
+
+void fake_time_advance(int64_t us)
+{
+    int64_t until_us = esp_timer_get_time() + us;
+
+    // Earliest timer first, each at its own time
+    while (1) {
+        struct esp_timer *next = NULL;
+        for (int i = 0; i < FAKE_TIMERS; i++) {
+            if (timers[i].armed && timers[i].expiry_us <= until_us
+                    && (!next || timers[i].expiry_us < next->expiry_us))
+                next = &timers[i];
+        }
+        if (!next)
+            break;
+
+        if (next->expiry_us > esp_timer_get_time())
+            __atomic_store_n(&time_us, next->expiry_us, __ATOMIC_RELAXED);
+        if (next->period_us)
+            next->expiry_us += next->period_us;
+        else
+            next->armed = false;
+        next->callback(next->arg);
+    }
+    __atomic_store_n(&time_us, until_us, __ATOMIC_RELAXED);
+}
+
+void fake_timers_reset(void)
+{
+    for (int i = 0; i < FAKE_TIMERS; i++)
+        timers[i] = (struct esp_timer) { 0 };
+    __atomic_store_n(&time_us, FAKE_BOOT_TIME_US, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,62 @@
+#include "fake.h"
+
+#include <ha/esp_zigbee_ha_standard.h>
+
+uint32_t fake_ota_file_offset = 0;
+uint32_t fake_zb_factory_resets = 0;
+
+static int lock_depth = 0;
+
+bool fake_zigbee_locked(void)
+{
+    return lock_depth > 0;
+}
+
+// Recursive, as the stack's lock is
+bool esp_zb_lock_acquire(TickType_t block_ticks)
+{
+    lock_depth++;
+    return true;
+}
+
+void esp_zb_lock_release(void)
+{
+    if (lock_depth == 0)
+        fake_fail("esp_zb_lock_release() without the lock");
+    lock_depth--;
+}
+
+esp_zb_zcl_status_t esp_zb_zcl_set_attribute_val(uint8_t endpoint, uint16_t cluster_id, uint8_t cluster_role,
+    uint16_t attr_id, void *value_p, bool check)
+{
+    // The OTA client sets its attribute from the Zigbee task, where the lock is not needed
+    if (cluster_id == ESP_ZB_ZCL_CLUSTER_ID_OTA_UPGRADE && attr_id == ESP_ZB_ZCL_ATTR_OTA_UPGRADE_FILE_OFFSET_ID)
+        fake_ota_file_offset = *(const uint32_t *)value_p;
+    else if (!fake_zigbee_locked())
+        fake_fail("esp_zb_zcl_set_attribute_val() without the Zigbee lock");
+    return ESP_ZB_ZCL_STATUS_SUCCESS;
+}
+
+esp_zb_zcl_status_t esp_zb_zcl_set_manufacturer_attribute_val(uint8_t endpoint, uint16_t cluster_id,
+    uint8_t cluster_role, uint16_t manuf_code, uint16_t attr_id, void *value_p, bool check)
+{
+    if (!fake_zigbee_locked())
+        fake_fail("esp_zb_zcl_set_manufacturer_attribute_val() without the Zigbee lock");
+    return ESP_ZB_ZCL_STATUS_SUCCESS;
+}
+
+esp_err_t esp_zb_zcl_update_reporting_info(esp_zb_zcl_reporting_info_t *report_info)
+{
+    return ESP_OK;
+}
+
+void esp_zb_factory_reset(void)
+{
+    fake_zb_factory_resets++;
+}
+
+void fake_zigbee_reset(void)
+{
+    lock_depth = 0;
+    fake_zb_factory_resets = 0;
+}
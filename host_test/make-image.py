@@ -0,0 +1,73 @@
+#!/usr/bin/env python
+# make-image - Create a stand-in firmware image for the host tests
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+import argparse
+import hashlib
+import random
+import struct
+
+ESP_IMAGE_HEADER_MAGIC = 0xE9
+
+
+def image(size, seed):
+	# Roughly as compressible as an app image: code-like words from a small
+	# vocabulary, strings, zero padding and some incompressible data
+	rng = random.Random(seed)
+	words = [struct.pack("<I", rng.getrandbits(32)) for _ in range(512)]
+	strings = [f"{rng.choice(['light', 'ota', 'zb', 'nvs'])}: value %d at {n}\n\0".encode() for n in range(64)]
+
+	data = bytearray([ESP_IMAGE_HEADER_MAGIC])
+	while len(data) < size:
+		kind = rng.random()
+		if kind < 0.6:
+			data.extend(b"".join(rng.choice(words) for _ in range(rng.randrange(4, 64))))
+		elif kind < 0.8:
+			data.extend(rng.choice(strings))
+		elif kind < 0.9:
+			data.extend(bytes(rng.randrange(16, 256)))
+		else:
+			data.extend(rng.randbytes(rng.randrange(16, 512)))
+	return data[:size]
+
+
+def modify(data, seed):
+	# A later build: a few insertions and changed words, most code just moves
+	rng = random.Random(seed)
+	data = bytearray(data)
+	for _ in range(8):
+		offset = rng.randrange(1, len(data))
+		data[offset:offset] = rng.randbytes(rng.randrange(1, 256))
+	for _ in range(64):
+		offset = rng.randrange(1, len(data) - 4)
+		data[offset:offset + 4] = rng.randbytes(4)
+	return data
+
+
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser(description="Create a stand-in firmware image for the host tests",
+		epilog="The image ends with its SHA-256, like an app image, so it can be the base of a patch")
+	parser.add_argument("output", metavar="OUTPUT", type=str, help="Image filename")
+	parser.add_argument("-s", "--size", metavar="BYTES", type=int, default=192 * 1024, help="Image size (default: 192 KB)")
+	parser.add_argument("-S", "--seed", metavar="SEED", type=int, default=1, help="Random seed (default: 1)")
+	parser.add_argument("-m", "--modified", action="store_true", help="Create a later build of the image")
+
+	args = parser.parse_args()
+	data = image(args.size - 32, args.seed)
+	if args.modified:
+		data = modify(data, args.seed + 1)
+
+	with open(args.output, "wb") as f:
+		f.write(data + hashlib.sha256(data).digest())
@@ -0,0 +1,422 @@
+#include "fake.h"
+#include "ota.h"
+#include "ota_codec.h"
+#include "test.h"
+
+#include <esp_log.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <nvs.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Replays an OTA file through the firmware's OTA code, built for the host
+ * against fakes of ESP-IDF, FreeRTOS and the Zigbee stack. The file is handed
+ * over as the stack does it: START with the header fields, the payload after
+ * the file header in RECEIVE messages of BLOCK_SIZE bytes, then CHECK, APPLY
+ * and FINISH, all from a "Zigbee_main" task while the OTA writer task runs.
+ *
+ *   ota_replay [-b BASE] [-c] [-i OFFSET|end]... [-v] IMAGE OTA BLOCK_SIZE...
+ *
+ * -b runs BASE, with its appended SHA-256, so patches against it apply.
+ * -i aborts the download once before the block at payload OFFSET (or after
+ * the last block) and starts it again, as when the server goes away.
+ * -c also corrupts the first byte written at every abort, so a resumed
+ * download must fail and start over from the beginning.
+ *
+ * The written partition must be identical to IMAGE. The figures are for the
+ * host: with the sanitizers, the stacks are deeper and inflate is slower.
+ */
+
+#define PARTITION_SIZE          (1024 * 1024)   // ota_0 and ota_1 in partitions.csv
+#define PARTITION_GARBAGE       0x5A            // anything not erased before it is written shows
+#define MAX_INTERRUPTS          16
+#define INTERRUPT_END           SIZE_MAX
+#define ZIGBEE_TASK_PRIORITY    5
+
+typedef struct {
+    size_t offset;
+    bool done;
+} interrupt_t;
+
+typedef struct {
+    const uint8_t *file;
+    const uint8_t *payload;
+    size_t payload_size;
+    size_t block_size;
+    interrupt_t *interrupts;
+    int interrupt_count;
+    uint8_t *partition;
+    bool corrupt;
+
+    // Results
+    bool finished;
+    bool corrupted;             // resumed over the corrupted byte, not failed yet
+    uint32_t blocks;
+    uint32_t max_block_calls;
+    uint32_t restarts;
+    uint32_t resumes;
+    size_t zigbee_stack;
+} replay_t;
+
+/* inflate() calls by the codec, through -Wl,--wrap=inflate */
+static uint32_t inflate_calls = 0;
+static uint64_t inflate_ns = 0;
+static uint64_t inflate_out = 0;
+
+int __real_inflate(z_streamp strm, int flush);
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int __wrap_inflate(z_streamp strm, int flush)
+{
+    uInt avail_out = strm->avail_out;
+    uint64_t start = now_ns();
+    int ret = __real_inflate(strm, flush);
+
+    inflate_ns += now_ns() - start;
+    inflate_out += avail_out - strm->avail_out;
+    inflate_calls++;
+    return ret;
+}
+
+/* Heap in use by everything linked in, through -Wl,--wrap for each function.
+ * The fakes don't allocate while a download runs, so the peak above the
+ * level at its start is the firmware's. */
+static size_t heap_used = 0;
+static size_t heap_peak = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static void heap_add(void *ptr)
+{
+    size_t used = __atomic_add_fetch(&heap_used, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+
+    while (used > peak && !__atomic_compare_exchange_n(&heap_peak, &peak, used, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void heap_remove(void *ptr)
+{
+    __atomic_sub_fetch(&heap_used, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+}
+
+void *__wrap_malloc(size_t size)
+{
+    void *ptr = __real_malloc(size);
+    heap_add(ptr);
+    return ptr;
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    void *ptr = __real_calloc(count, size);
+    heap_add(ptr);
+    return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    size_t old_size = malloc_usable_size(ptr);
+    void *new_ptr = __real_realloc(ptr, size);
+
+    if (new_ptr || !size) {
+        __atomic_sub_fetch(&heap_used, old_size, __ATOMIC_RELAXED);
+        heap_add(new_ptr);
+    }
+    return new_ptr;
+}
+
+void __wrap_free(void *ptr)
+{
+    heap_remove(ptr);
+    __real_free(ptr);
+}
+
+static uint16_t get_u16(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static esp_err_t replay_send(const replay_t *replay, esp_zb_zcl_ota_upgrade_status_t status,
+    const uint8_t *payload, size_t size)
+{
+    esp_zb_zcl_ota_upgrade_value_message_t message = {
+        .info = {
+            .status = ESP_ZB_ZCL_STATUS_SUCCESS,
+            .dst_endpoint = 1,
+            .cluster = ESP_ZB_ZCL_CLUSTER_ID_OTA_UPGRADE,
+        },
+        .upgrade_status = status,
+        .ota_header = {
+            .manufacturer_code = get_u16(&replay->file[10]),
+            .image_type = get_u16(&replay->file[12]),
+            .file_version = get_u32(&replay->file[14]),
+            .image_size = get_u32(&replay->file[52]),
+        },
+        .payload_size = size,
+        .payload = payload,
+    };
+
+    return zb_ota_upgrade_status_handler(message);
+}
+
+// The server continues from the FileOffset the device asked for
+static bool replay_start(replay_t *replay, size_t *position)
+{
+    size_t header_length = replay->payload - replay->file;
+
+    fake_ota_file_offset = 0;
+    if (replay_send(replay, ESP_ZB_ZCL_OTA_UPGRADE_STATUS_START, NULL, 0) != ESP_OK) {
+        return false;
+    }
+
+    *position = 0;
+    if (fake_ota_file_offset) {
+        if (fake_ota_file_offset < header_length || fake_ota_file_offset - header_length > replay->payload_size) {
+            fprintf(stderr, "FileOffset %" PRIu32 " outside the file\n", fake_ota_file_offset);
+            return false;
+        }
+        *position = fake_ota_file_offset - header_length;
+        replay->resumes++;
+    }
+    return true;
+}
+
+static interrupt_t *replay_interrupt(const replay_t *replay, size_t position)
+{
+    for (int i = 0; i < replay->interrupt_count; i++) {
+        interrupt_t *interrupt = &replay->interrupts[i];
+        size_t offset = interrupt->offset < replay->payload_size ? interrupt->offset : replay->payload_size;
+
+        if (!interrupt->done && offset <= position)
+            return interrupt;
+    }
+    return NULL;
+}
+
+static bool replay_run(replay_t *replay)
+{
+    size_t position;
+
+    if (!replay_start(replay, &position)) {
+        return false;
+    }
+
+    while (1) {
+        interrupt_t *interrupt = replay_interrupt(replay, position);
+        if (interrupt) {
+            interrupt->done = true;
+            replay_send(replay, ESP_ZB_ZCL_OTA_UPGRADE_STATUS_ABORT, NULL, 0);
+            replay->restarts++;
+            if (replay->corrupt)
+                replay->partition[0] ^= 0xFF;
+            if (!replay_start(replay, &position)) {
+                return false;
+            }
+            replay->corrupted = replay->corrupt && position;
+            continue;
+        }
+
+        if (position == replay->payload_size) {
+            break;
+        }
+
+        size_t size = replay->payload_size - position;
+        if (size > replay->block_size)
+            size = replay->block_size;
+
+        uint32_t calls = inflate_calls;
+        if (replay_send(replay, ESP_ZB_ZCL_OTA_UPGRADE_STATUS_RECEIVE, replay->payload + position, size) != ESP_OK) {
+            if (!replay->corrupted) {
+                return false;
+            }
+
+            // The stack gives up on the download, the next one must not resume
+            replay->corrupted = false;
+            replay->restarts++;
+            if (!replay_start(replay, &position)) {
+                return false;
+            }
+            if (position) {
+                fprintf(stderr, "Resumed over a corrupted partition\n");
+                return false;
+            }
+            continue;
+        }
+
+        // The writer has a lower priority, on the device it runs once the stack is idle
+        fake_tasks_wait_idle();
+        if (inflate_calls - calls > replay->max_block_calls)
+            replay->max_block_calls = inflate_calls - calls;
+        replay->blocks++;
+        position += size;
+    }
+
+    replay_send(replay, ESP_ZB_ZCL_OTA_UPGRADE_STATUS_CHECK, NULL, 0);
+    replay_send(replay, ESP_ZB_ZCL_OTA_UPGRADE_STATUS_APPLY, NULL, 0);
+    replay_send(replay, ESP_ZB_ZCL_OTA_UPGRADE_STATUS_FINISH, NULL, 0);
+    return fake_restarted;
+}
+
+static void replay_task(void *arg)
+{
+    replay_t *replay = arg;
+
+    replay->finished = replay_run(replay);
+    replay->zigbee_stack = fake_task_stack_used(xTaskGetCurrentTaskHandle());
+}
+
+static bool checkpoint_erased(void)
+{
+    nvs_handle_t handle;
+    size_t size = 0;
+    esp_err_t err;
+
+    if (nvs_open("ota", NVS_READONLY, &handle) != ESP_OK)
+        return true;
+    err = nvs_get_blob(handle, "checkpoint", NULL, &size);
+    nvs_close(handle);
+    return err == ESP_ERR_NVS_NOT_FOUND;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-b BASE] [-c] [-i OFFSET|end]... [-v] IMAGE OTA BLOCK_SIZE...\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    interrupt_t interrupts[MAX_INTERRUPTS];
+    int interrupt_count = 0;
+    const char *base_filename = NULL;
+    bool corrupt = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:ci:v")) != -1) {
+        switch (opt) {
+        case 'b':
+            base_filename = optarg;
+            break;
+        case 'c':
+            corrupt = true;
+            break;
+        case 'i':
+            if (interrupt_count == MAX_INTERRUPTS)
+                usage(argv[0]);
+            interrupts[interrupt_count++].offset = strcmp(optarg, "end") ? strtoul(optarg, NULL, 0) : INTERRUPT_END;
+            break;
+        case 'v':
+            fake_log_level = ESP_LOG_DEBUG;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind < 3)
+        usage(argv[0]);
+
+    size_t image_size, file_size, base_size = 0;
+    uint8_t *image = test_load_file(argv[optind], &image_size);
+    uint8_t *file = test_load_file(argv[optind + 1], &file_size);
+    uint8_t *base = base_filename ? test_load_file(base_filename, &base_size) : NULL;
+
+    if (file_size < 56 || get_u16(&file[6]) > file_size || image_size > PARTITION_SIZE || base_size > PARTITION_SIZE
+            || (base && base_size < 32)) {
+        fprintf(stderr, "Invalid input files\n");
+        return EXIT_FAILURE;
+    }
+
+    // Without a base the running image matches no patch
+    esp_partition_t *running = fake_partition_create("ota_0", PARTITION_SIZE, 0xFF);
+    esp_partition_t *next = fake_partition_create("ota_1", PARTITION_SIZE, PARTITION_GARBAGE);
+    if (base) {
+        memcpy(fake_partition_data(running), base, base_size);
+        fake_partition_set_sha256(running, base + base_size - 32);
+    }
+    fake_ota_set_partitions(running, next);
+
+    replay_t replay = {
+        .file = file,
+        .interrupts = interrupts,
+        .interrupt_count = interrupt_count,
+        .partition = fake_partition_data(next),
+        .corrupt = corrupt,
+    };
+    replay.payload = test_ota_payload(file, file_size, &replay.payload_size);
+
+    bool ok = true;
+    printf("%5s %6s %11s %4s %12s %9s %4s %12s %12s %7s %7s %7s %9s\n", "block", "blocks", "calls/block", "max",
+        "inflate MB/s", "codec RAM", "heap", "Zigbee stack", "writer stack", "commits", "sectors", "resumed", "image");
+
+    for (int i = optind + 2; i < argc; i++) {
+        replay.block_size = strtoul(argv[i], NULL, 0);
+        if (replay.block_size == 0 || replay.block_size > UINT16_MAX)
+            usage(argv[0]);
+
+        replay.blocks = 0;
+        replay.max_block_calls = 0;
+        replay.restarts = 0;
+        replay.resumes = 0;
+        replay.corrupted = false;
+        for (int j = 0; j < interrupt_count; j++)
+            interrupts[j].done = false;
+
+        fake_nvs_erase_all();
+        memset(fake_partition_data(next), PARTITION_GARBAGE, PARTITION_SIZE);
+        fake_flash_stats = (fake_flash_stats_t) { 0 };
+        fake_boot_partition = NULL;
+        fake_restarted = false;
+        inflate_calls = 0;
+        inflate_ns = 0;
+        inflate_out = 0;
+
+        StaticTask_t task;
+        size_t heap_start = __atomic_load_n(&heap_used, __ATOMIC_RELAXED);
+        __atomic_store_n(&heap_peak, heap_start, __ATOMIC_RELAXED);
+        fake_task_join(xTaskCreateStatic(replay_task, "Zigbee_main", 0, &replay, ZIGBEE_TASK_PRIORITY, NULL, &task));
+
+        size_t heap = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED) - heap_start;
+        TaskHandle_t writer = xTaskGetHandle("OTA_writer");
+        bool identical = replay.finished && fake_boot_partition == next
+            && !memcmp(fake_partition_data(next), image, image_size);
+        bool erased = checkpoint_erased();
+
+        char resumed[16];
+        snprintf(resumed, sizeof(resumed), "%" PRIu32 "/%" PRIu32, replay.resumes, replay.restarts);
+        printf("%5zu %6" PRIu32 " %11.2f %4" PRIu32 " %12.1f %9zu %4zu %12zu %12zu %7" PRIu32 " %7" PRIu32 " %7s %9s\n",
+            replay.block_size, replay.blocks, replay.blocks ? (double)inflate_calls / replay.blocks : 0,
+            replay.max_block_calls, inflate_ns ? inflate_out * 1e3 / inflate_ns : 0, ota_codec_peak_memory(), heap,
+            replay.zigbee_stack, writer ? fake_task_stack_used(writer) : 0, fake_nvs_stats.commits,
+            fake_flash_stats.sectors_erased, resumed,
+            !replay.finished ? "FAILED" : identical ? "identical" : "DIFFERENT");
+
+        if (!erased)
+            fprintf(stderr, "OTA checkpoint left in NVS\n");
+        ok = ok && identical && erased;
+    }
+
+    free(base);
+    free(file);
+    free(image);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
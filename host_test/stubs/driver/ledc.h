@@ -0,0 +1,80 @@
+#pragma once
+
+/* Host stand-in for the ESP-IDF header: channels only record what was
+ * written to them, see fake.h */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef int gpio_num_t;
+
+typedef enum {
+    LEDC_LOW_SPEED_MODE,
+    LEDC_SPEED_MODE_MAX,
+} ledc_mode_t;
+
+typedef enum {
+    LEDC_TIMER_0,
+    LEDC_TIMER_1,
+    LEDC_TIMER_2,
+    LEDC_TIMER_3,
+    LEDC_TIMER_MAX,
+} ledc_timer_t;
+
+typedef enum {
+    LEDC_CHANNEL_0,
+    LEDC_CHANNEL_1,
+    LEDC_CHANNEL_2,
+    LEDC_CHANNEL_3,
+    LEDC_CHANNEL_4,
+    LEDC_CHANNEL_5,
+    LEDC_CHANNEL_MAX,
+} ledc_channel_t;
+
+typedef enum {
+    LEDC_AUTO_CLK,
+    LEDC_USE_XTAL_CLK,
+    LEDC_USE_RC_FAST_CLK,
+} ledc_clk_cfg_t;
+
+typedef enum {
+    LEDC_INTR_DISABLE,
+    LEDC_INTR_FADE_END,
+} ledc_intr_type_t;
+
+typedef enum {
+    LEDC_FADE_NO_WAIT,
+    LEDC_FADE_WAIT_DONE,
+} ledc_fade_mode_t;
+
+typedef struct {
+    ledc_mode_t speed_mode;
+    unsigned int duty_resolution;
+    ledc_timer_t timer_num;
+    uint32_t freq_hz;
+    ledc_clk_cfg_t clk_cfg;
+} ledc_timer_config_t;
+
+typedef struct {
+    gpio_num_t gpio_num;
+    ledc_mode_t speed_mode;
+    ledc_channel_t channel;
+    ledc_intr_type_t intr_type;
+    ledc_timer_t timer_sel;
+    uint32_t duty;
+    int hpoint;
+    struct {
+        unsigned int output_invert: 1;
+    } flags;
+} ledc_channel_config_t;
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t *timer_conf);
+esp_err_t ledc_channel_config(const ledc_channel_config_t *ledc_conf);
+esp_err_t ledc_fade_func_install(int intr_alloc_flags);
+esp_err_t ledc_set_duty(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t duty);
+esp_err_t ledc_update_duty(ledc_mode_t speed_mode, ledc_channel_t channel);
+esp_err_t ledc_set_fade_with_time(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t target_duty, int max_fade_time_ms);
+esp_err_t ledc_fade_start(ledc_mode_t speed_mode, ledc_channel_t channel, ledc_fade_mode_t fade_mode);
+esp_err_t ledc_fade_stop(ledc_mode_t speed_mode, ledc_channel_t channel);
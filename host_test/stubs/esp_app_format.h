@@ -0,0 +1,5 @@
+#pragma once
+
+/* Host stand-in for the ESP-IDF header, only what the host-built sources use */
+
+#define ESP_IMAGE_HEADER_MAGIC          0xE9
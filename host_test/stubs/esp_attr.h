@@ -0,0 +1,6 @@
+#pragma once
+
+/* Host stand-in for the ESP-IDF header: RTC memory is a section of its own,
+ * which fake_reboot() fills with garbage on a power-on */
+
+#define RTC_NOINIT_ATTR                 __attribute__((section("fake_rtc_noinit")))
@@ -0,0 +1,32 @@
+#pragma once
+
+/* Host stand-in for the ESP-IDF header, only what the host-built sources use */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK                          0
+#define ESP_FAIL                        -1
+#define ESP_ERR_NO_MEM                  0x101
+#define ESP_ERR_INVALID_ARG             0x102
+#define ESP_ERR_INVALID_STATE           0x103
+#define ESP_ERR_INVALID_SIZE            0x104
+#define ESP_ERR_NOT_FOUND               0x105
+#define ESP_ERR_TIMEOUT                 0x107
+#define ESP_ERR_NVS_NOT_FOUND           0x1102
+#define ESP_ERR_NVS_READ_ONLY           0x1107
+#define ESP_ERR_NVS_INVALID_LENGTH      0x110c
+#define ESP_ERR_NVS_VALUE_TOO_LONG      0x110e
+#define ESP_ERR_OTA_VALIDATE_FAILED     0x1503
+
+const char *esp_err_to_name(esp_err_t code);
+
+#define ESP_ERROR_CHECK(x) do { \
+        esp_err_t err_rc_ = (x); \
+        if (err_rc_ != ESP_OK) { \
+            fprintf(stderr, "%s:%d: ESP_ERROR_CHECK failed: %s = %d\n", __FILE__, __LINE__, #x, err_rc_); \
+            abort(); \
+        } \
+    } while (0)
@@ -0,0 +1,27 @@
+#pragma once
+
+/* Host stand-in for the ESP-IDF header, logs to stderr up to fake_log_level */
+
+#include <stdio.h>
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+extern esp_log_level_t fake_log_level;
+
+#define FAKE_LOG(level, letter, tag, format, ...) do { \
+        if (fake_log_level >= (level)) \
+            fprintf(stderr, letter " %s: " format "\n", tag, ##__VA_ARGS__); \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) FAKE_LOG(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) FAKE_LOG(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) FAKE_LOG(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) FAKE_LOG(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) FAKE_LOG(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
@@ -0,0 +1,7 @@
+#pragma once
+
+/* Host stand-in for the ESP-IDF header, the RTC clock is the fake esp_timer clock */
+
+#include <stdint.h>
+
+uint64_t esp_clk_rtc_time(void);
@@ -0,0 +1,7 @@
+#pragma once
+
+/* Host stand-in for the ESP-IDF header, only what the host-built sources use */
+
+#include <stdint.h>
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
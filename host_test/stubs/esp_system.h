@@ -0,0 +1,27 @@
+#pragma once
+
+/* Host stand-in for the ESP-IDF header: esp_restart() runs the shutdown
+ * handlers and records the restart, see fake_reboot() */
+
+#include "esp_err.h"
+
+typedef enum {
+    ESP_RST_UNKNOWN,
+    ESP_RST_POWERON,
+    ESP_RST_EXT,
+    ESP_RST_SW,
+    ESP_RST_PANIC,
+    ESP_RST_INT_WDT,
+    ESP_RST_TASK_WDT,
+    ESP_RST_WDT,
+    ESP_RST_DEEPSLEEP,
+    ESP_RST_BROWNOUT,
+    ESP_RST_SDIO,
+} esp_reset_reason_t;
+
+void esp_restart(void);
+esp_reset_reason_t esp_reset_reason(void);
+
+typedef void (*shutdown_handler_t)(void);
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handle);
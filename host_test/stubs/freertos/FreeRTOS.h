@@ -0,0 +1,29 @@
+#pragma once
+
+/* Host stand-in for the FreeRTOS header. Tasks are threads and every
+ * primitive shares one lock, see fake_freertos.c. */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint8_t StackType_t;                // the ESP32 ports count stacks in bytes
+
+#define portMAX_DELAY                   ((TickType_t)0xFFFFFFFF)
+#define portTICK_PERIOD_MS              1
+#define pdMS_TO_TICKS(ms)               ((TickType_t)(ms))
+#define pdFALSE                         0
+#define pdTRUE                          1
+#define pdPASS                          1
+#define pdFAIL                          0
+
+typedef struct {
+    pthread_mutex_t lock;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED    { PTHREAD_MUTEX_INITIALIZER }
+#define portENTER_CRITICAL(mux)         pthread_mutex_lock(&(mux)->lock)
+#define portEXIT_CRITICAL(mux)          pthread_mutex_unlock(&(mux)->lock)
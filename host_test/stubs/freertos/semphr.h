@@ -0,0 +1,15 @@
+#pragma once
+
+/* Host stand-in for the FreeRTOS header, only what the host-built sources use */
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+    unsigned int count;
+} StaticSemaphore_t;
+
+typedef StaticSemaphore_t *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *semaphore);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait);
@@ -0,0 +1,22 @@
+#pragma once
+
+/* Host stand-in for the FreeRTOS header, only what the host-built sources use */
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+    uint8_t *storage;
+    size_t size;
+    size_t head;
+    size_t length;
+} StaticStreamBuffer_t;
+
+typedef StaticStreamBuffer_t *StreamBufferHandle_t;
+
+StreamBufferHandle_t xStreamBufferCreateStatic(size_t size, size_t trigger_level, uint8_t *storage,
+    StaticStreamBuffer_t *buffer);
+BaseType_t xStreamBufferReset(StreamBufferHandle_t buffer);
+size_t xStreamBufferSend(StreamBufferHandle_t buffer, const void *data, size_t size, TickType_t ticks_to_wait);
+size_t xStreamBufferReceive(StreamBufferHandle_t buffer, void *data, size_t size, TickType_t ticks_to_wait);
+size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t buffer);
+BaseType_t xStreamBufferIsEmpty(StreamBufferHandle_t buffer);
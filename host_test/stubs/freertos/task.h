@@ -0,0 +1,31 @@
+#pragma once
+
+/* Host stand-in for the FreeRTOS header, only what the host-built sources use */
+
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *);
+
+typedef struct fake_task {
+    pthread_t thread;
+    const char *name;
+    TaskFunction_t function;
+    void *arg;
+    uint8_t *stack;                         // host stack, the task's own is too small for it
+    size_t stack_size;
+    uint32_t notifications;
+    bool blocked;                           // waiting for something that has not happened
+    struct fake_task *next;
+} StaticTask_t;
+
+typedef StaticTask_t *TaskHandle_t;
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t function, const char *name, uint32_t stack_depth, void *arg,
+    UBaseType_t priority, StackType_t *stack, StaticTask_t *task);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+TaskHandle_t xTaskGetHandle(const char *name);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
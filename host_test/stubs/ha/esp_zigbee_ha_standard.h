@@ -0,0 +1,119 @@
+#pragma once
+
+/* Host stand-in for the esp-zigbee-lib header, only what the host-built sources use */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+
+typedef enum {
+    ESP_ZB_ZCL_STATUS_SUCCESS = 0x00,
+    ESP_ZB_ZCL_STATUS_FAIL = 0x01,
+} esp_zb_zcl_status_t;
+
+typedef enum {
+    ESP_ZB_ZCL_CLUSTER_SERVER_ROLE = 0x01,
+    ESP_ZB_ZCL_CLUSTER_CLIENT_ROLE = 0x02,
+} esp_zb_zcl_cluster_role_t;
+
+#define ESP_ZB_AF_HA_PROFILE_ID                         0x0104
+
+#define ESP_ZB_ZCL_CLUSTER_ID_ON_OFF                    0x0006
+#define ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL             0x0008
+#define ESP_ZB_ZCL_CLUSTER_ID_OTA_UPGRADE               0x0019
+#define ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL             0x0300
+
+#define ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID                0x0000
+#define ESP_ZB_ZCL_ATTR_ON_OFF_START_UP_ON_OFF          0x4003
+#define ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_CURRENT_LEVEL_ID  0x0000
+#define ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_ON_OFF_TRANSITION_TIME_ID 0x0010
+#define ESP_ZB_ZCL_ATTR_OTA_UPGRADE_FILE_OFFSET_ID      0x0001
+#define ESP_ZB_ZCL_ATTR_COLOR_CONTROL_COLOR_TEMPERATURE_ID 0x0007
+#define ESP_ZB_ZCL_ATTR_COLOR_CONTROL_START_UP_COLOR_TEMPERATURE_MIREDS_ID 0x4010
+#define ESP_ZB_ZCL_ATTR_NON_MANUFACTURER_SPECIFIC       0xFFFF
+
+#define ESP_ZB_ZCL_ON_OFF_ON_OFF_DEFAULT_VALUE          false
+#define ESP_ZB_ZCL_COLOR_CONTROL_COLOR_TEMPERATURE_DEF_VALUE 0x00FA
+
+#define ESP_ZB_ZCL_CMD_DIRECTION_TO_SRV                 0x00
+
+typedef enum {
+    ESP_ZB_ZCL_OTA_UPGRADE_STATUS_START,
+    ESP_ZB_ZCL_OTA_UPGRADE_STATUS_APPLY,
+    ESP_ZB_ZCL_OTA_UPGRADE_STATUS_RECEIVE,
+    ESP_ZB_ZCL_OTA_UPGRADE_STATUS_FINISH,
+    ESP_ZB_ZCL_OTA_UPGRADE_STATUS_ABORT,
+    ESP_ZB_ZCL_OTA_UPGRADE_STATUS_CHECK,
+    ESP_ZB_ZCL_OTA_UPGRADE_STATUS_OK,
+    ESP_ZB_ZCL_OTA_UPGRADE_STATUS_ERROR,
+    ESP_ZB_ZCL_OTA_UPGRADE_IMAGE_STATUS_NORMAL,
+    ESP_ZB_ZCL_OTA_UPGRADE_STATUS_BUSY,
+    ESP_ZB_ZCL_OTA_UPGRADE_STATUS_SERVER_NOT_FOUND,
+} esp_zb_zcl_ota_upgrade_status_t;
+
+typedef struct {
+    esp_zb_zcl_status_t status;
+    uint8_t dst_endpoint;
+    uint16_t cluster;
+} esp_zb_device_cb_common_info_t;
+
+typedef struct {
+    uint16_t manufacturer_code;
+    uint16_t image_type;
+    uint32_t file_version;
+    uint32_t image_size;
+} esp_zb_zcl_ota_upgrade_ota_header_t;
+
+typedef struct {
+    esp_zb_device_cb_common_info_t info;
+    esp_zb_zcl_ota_upgrade_status_t upgrade_status;
+    esp_zb_zcl_ota_upgrade_ota_header_t ota_header;
+    uint16_t payload_size;
+    const uint8_t *payload;
+} esp_zb_zcl_ota_upgrade_value_message_t;
+
+typedef struct esp_zb_attribute_list_s esp_zb_attribute_list_t;
+
+esp_zb_zcl_status_t esp_zb_zcl_set_attribute_val(uint8_t endpoint, uint16_t cluster_id, uint8_t cluster_role,
+    uint16_t attr_id, void *value_p, bool check);
+
+esp_zb_zcl_status_t esp_zb_zcl_set_manufacturer_attribute_val(uint8_t endpoint, uint16_t cluster_id,
+    uint8_t cluster_role, uint16_t manuf_code, uint16_t attr_id, void *value_p, bool check);
+
+typedef struct {
+    uint8_t direction;
+    uint8_t ep;
+    uint16_t cluster_id;
+    uint8_t cluster_role;
+    uint16_t attr_id;
+    uint16_t manuf_code;
+    struct {
+        uint16_t short_addr;
+        uint8_t endpoint;
+        uint16_t profile_id;
+    } dst;
+    union {
+        struct {
+            uint16_t min_interval;
+            uint16_t max_interval;
+            uint16_t def_min_interval;
+            uint16_t def_max_interval;
+            union {
+                uint8_t u8;
+                uint16_t u16;
+                uint32_t u32;
+            } delta;
+        } send_info;
+    } u;
+} esp_zb_zcl_reporting_info_t;
+
+esp_err_t esp_zb_zcl_update_reporting_info(esp_zb_zcl_reporting_info_t *report_info);
+
+/* The stack lock, held by the caller while it touches the attribute table */
+bool esp_zb_lock_acquire(TickType_t block_ticks);
+void esp_zb_lock_release(void);
+
+void esp_zb_factory_reset(void);
@@ -0,0 +1,7 @@
+#pragma once
+
+/* Host stand-in for the ESP-IDF header, only what the host-built sources use */
+
+#include "nvs.h"
+
+esp_err_t nvs_flash_init(void);
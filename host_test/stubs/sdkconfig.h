@@ -0,0 +1,22 @@
+#pragma once
+
+/* Host stand-in for the generated header: the defaults of main/Kconfig.projbuild,
+ * the number of zones and the OTA window can be set by the build */
+
+#define CONFIG_LIGHT_DIMMING_CURVE_CIE1931      1
+#define CONFIG_LIGHT_DIMMING_GAMMA_X10          22
+#define CONFIG_LIGHT_PWM_4KHZ_13BIT             1
+#define CONFIG_LIGHT_PWM_FREQUENCY              4000
+#define CONFIG_LIGHT_PWM_RESOLUTION             13
+#ifndef CONFIG_LIGHT_ZONES
+#define CONFIG_LIGHT_ZONES                      1
+#endif
+#define CONFIG_LIGHT_ZONE1_GPIO_CW              10
+#define CONFIG_LIGHT_ZONE1_GPIO_WW              5
+#define CONFIG_LIGHT_ZONE2_GPIO_CW              6
+#define CONFIG_LIGHT_ZONE2_GPIO_WW              7
+#define CONFIG_LIGHT_ZONE3_GPIO_CW              2
+#define CONFIG_LIGHT_ZONE3_GPIO_WW              3
+#ifndef CONFIG_LIGHT_OTA_MAX_WINDOW_BITS
+#define CONFIG_LIGHT_OTA_MAX_WINDOW_BITS        15
+#endif
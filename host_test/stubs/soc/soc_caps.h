@@ -0,0 +1,6 @@
+#pragma once
+
+/* Host stand-in for the ESP-IDF header, the ESP32-C6 values */
+
+#define SOC_LEDC_CHANNEL_NUM            6
+#define SOC_LEDC_TIMER_BIT_WIDTH        20
@@ -0,0 +1,12 @@
+#pragma once
+
+/* Host stand-in for the ZBOSS header, only what the host-built sources use */
+
+enum zb_zcl_on_off_start_up_on_off_e {
+    ZB_ZCL_ON_OFF_START_UP_ON_OFF_IS_OFF = 0,
+    ZB_ZCL_ON_OFF_START_UP_ON_OFF_IS_ON = 1,
+    ZB_ZCL_ON_OFF_START_UP_ON_OFF_IS_TOGGLE = 2,
+    ZB_ZCL_ON_OFF_START_UP_ON_OFF_IS_PREVIOUS = 0xFF,
+};
+
+#define ZB_ZCL_COLOR_CONTROL_START_UP_COLOR_TEMPERATURE_USE_PREVIOUS_VALUE      0xFFFF
@@ -0,0 +1,5 @@
+#pragma once
+
+/* Host stand-in for the esp-zigbee-lib header, see ha/esp_zigbee_ha_standard.h */
+
+#include "ha/esp_zigbee_ha_standard.h"
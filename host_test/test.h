@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Checks for the host tests: a failed check is reported and counted, the
+ * test carries on and the program fails at the end. */
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) do { \
+        long long check_a = (long long)(a), check_b = (long long)(b); \
+        if (check_a != check_b) { \
+            fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, \
+                check_a, check_b); \
+            test_failures++; \
+        } \
+    } while (0)
+
+#define RUN(test, ...) do { \
+        int failures = test_failures; \
+        test(__VA_ARGS__); \
+        printf("%-40s %s\n", #test, test_failures == failures ? "ok" : "FAILED"); \
+    } while (0)
+
+static inline int test_result(void)
+{
+    if (test_failures) {
+        fprintf(stderr, "%d checks failed\n", test_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Deterministic, so a failure can be reproduced
+static inline uint32_t test_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static inline uint8_t *test_load_file(const char *filename, size_t *size)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t *data = malloc(*size ? *size : 1);
+    if (fread(data, 1, *size, f) != *size) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    return data;
+}
+
+// The stack hands the OTA file over without its header
+static inline const uint8_t *test_ota_payload(const uint8_t *file, size_t file_size, size_t *size)
+{
+    size_t header_length = file[6] | (file[7] << 8);
+
+    *size = file_size - header_length;
+    return file + header_length;
+}
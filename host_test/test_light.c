@@ -0,0 +1,553 @@
+#include "boot.h"
+#include "dimming_lut.h"
+#include "fake.h"
+#include "light_curve.h"
+#include "light_driver.h"
+#include "test.h"
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+/* The light driver, light_curve.c and the reset gesture of boot.c on the fake
+ * LEDC, NVS and timers: every duty the driver can program, checked against a
+ * model of the calibration in floating point, the startup rules across power
+ * cycles, the reboot gesture, and a micro-benchmark of the duty path.
+ */
+
+#define STATE_DEBOUNCE_US       (1000 * 1000)       // as in light_driver.c
+
+// Inputs the sweep covers, the ends are clamped
+#define SWEEP_MIREDS_MIN        (LIGHT_MIREDS_MIN - 10)
+#define SWEEP_MIREDS_MAX        (LIGHT_MIREDS_MAX + 10)
+
+#define BENCH_CURVE_CALLS       1000000
+#define BENCH_LEVEL_CALLS       20000
+
+// What the zone's LEDs are driven at, WW is on an inverted channel
+static light_duty_t output(uint8_t zone)
+{
+    const fake_ledc_channel_t *cw = &fake_ledc[2 * zone];
+    const fake_ledc_channel_t *ww = &fake_ledc[2 * zone + 1];
+
+    return (light_duty_t) {
+        cw->invert ? LIGHT_MAX_DUTY - cw->output : cw->output,
+        ww->invert ? LIGHT_MAX_DUTY - ww->output : ww->output,
+    };
+}
+
+static bool output_is(uint8_t zone, light_duty_t duty)
+{
+    light_duty_t out = output(zone);
+    return out.cw == duty.cw && out.ww == duty.ww;
+}
+
+// app_main() up to the point where Zigbee starts
+static void boot(esp_reset_reason_t reason)
+{
+    fake_reboot(reason);
+    light_init();
+    light_restore_state();
+}
+
+// A boot that lives past the gesture window, the light then is in a known state
+static void boot_clean(void)
+{
+    boot(ESP_RST_POWERON);
+    light_load_settings();
+    light_boot_success();
+}
+
+// CIE 1931 lightness to luminance, what gen-dimming-lut.py puts in the table
+static double model_brightness(uint8_t level)
+{
+    double lightness = 100.0 * level / LIGHT_LEVEL_MAX;
+    double luminance = lightness > 8 ? pow((lightness + 16) / 116, 3) : lightness / 903.3;
+    return luminance * LIGHT_MAX_DUTY;
+}
+
+// The default calibration interpolated at mireds, scaled to the 1000 lumen of its ends
+static void model_mix(uint16_t mireds, double *cw, double *ww)
+{
+    const light_calibration_point_t *points = light_calibration_default.points;
+    size_t last = light_calibration_default.count - 1;
+    double lumen_min = 1000;
+
+    if (mireds < points[0].mireds)
+        mireds = points[0].mireds;
+    if (mireds > points[last].mireds)
+        mireds = points[last].mireds;
+
+    size_t i = 0;
+    while (i < last - 1 && mireds > points[i + 1].mireds)
+        i++;
+    double t = (double)(mireds - points[i].mireds) / (points[i + 1].mireds - points[i].mireds);
+    double lumen = points[i].lumen + t * (points[i + 1].lumen - points[i].lumen);
+    double scale = (double)LIGHT_MAX_DUTY / LIGHT_CALIBRATION_SCALE * lumen_min / lumen;
+
+    *cw = (points[i].cw + t * (points[i + 1].cw - points[i].cw)) * scale;
+    *ww = (points[i].ww + t * (points[i + 1].ww - points[i].ww)) * scale;
+}
+
+static void test_dimming_lut(void)
+{
+    CHECK_EQ(dimming_lut[0], 0);
+    CHECK_EQ(dimming_lut[LIGHT_LEVEL_MAX], LIGHT_MAX_DUTY);
+    for (int level = LIGHT_LEVEL_MIN; level <= LIGHT_LEVEL_MAX; level++) {
+        CHECK(dimming_lut[level] > dimming_lut[level - 1]);
+        CHECK(fabs(dimming_lut[level] - model_brightness(level)) <= 0.5);
+    }
+}
+
+static void test_init(void)
+{
+    boot_clean();
+
+    // CW straight, WW inverted, from 0% duty
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        CHECK(fake_ledc[2 * zone].configured);
+        CHECK(!fake_ledc[2 * zone].invert);
+        CHECK(fake_ledc[2 * zone + 1].configured);
+        CHECK(fake_ledc[2 * zone + 1].invert);
+    }
+    CHECK_EQ(fake_ledc[0].gpio, CONFIG_LIGHT_ZONE1_GPIO_CW);
+    CHECK_EQ(fake_ledc[1].gpio, CONFIG_LIGHT_ZONE1_GPIO_WW);
+#if LIGHT_ZONES > 1
+    CHECK_EQ(fake_ledc[2].gpio, CONFIG_LIGHT_ZONE2_GPIO_CW);
+    CHECK_EQ(fake_ledc[3].gpio, CONFIG_LIGHT_ZONE2_GPIO_WW);
+#endif
+
+    // A factory-new light comes on at full level and the default temperature
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++)
+        CHECK(output_is(zone, light_curve_duty(true, LIGHT_LEVEL_MAX, ESP_ZB_ZCL_COLOR_CONTROL_COLOR_TEMPERATURE_DEF_VALUE)));
+}
+
+// Every level at every temperature, through update_duty() to the LEDC
+static void test_duty_sweep(void)
+{
+    boot_clean();
+    light_set_on_off(0, true);
+
+    for (uint16_t mireds = SWEEP_MIREDS_MIN; mireds <= SWEEP_MIREDS_MAX; mireds++) {
+        double mix_cw, mix_ww;
+        light_duty_t previous = { 0, 0 };
+        uint32_t updates = fake_ledc_stats.updates;
+
+        model_mix(mireds, &mix_cw, &mix_ww);
+        light_set_temperature(0, mireds);
+        for (int level = LIGHT_LEVEL_MIN; level <= LIGHT_LEVEL_MAX; level++) {
+            light_set_level(0, level);
+            light_duty_t duty = output(0);
+
+            CHECK(output_is(0, light_curve_duty(true, level, mireds)));
+            CHECK(duty.cw <= LIGHT_MAX_DUTY && duty.ww <= LIGHT_MAX_DUTY);
+            // The mix is rounded to whole duty steps before it is dimmed
+            CHECK(fabs(duty.cw - mix_cw * dimming_lut[level] / LIGHT_MAX_DUTY) <= 1.5);
+            CHECK(fabs(duty.ww - mix_ww * dimming_lut[level] / LIGHT_MAX_DUTY) <= 1.5);
+            CHECK(duty.cw >= previous.cw && duty.ww >= previous.ww);
+            CHECK_EQ(fake_ledc[0].fade_ms, 0);
+            previous = duty;
+        }
+        // One write of both channels per command
+        CHECK_EQ(fake_ledc_stats.updates - updates, 2 * (LIGHT_LEVEL_MAX - LIGHT_LEVEL_MIN + 2));
+    }
+
+    // Off is 0% on both channels, whatever the level and temperature
+    light_set_on_off(0, false);
+    CHECK(output_is(0, (light_duty_t) { 0, 0 }));
+    light_set_level(0, 100);
+    light_set_temperature(0, 300);
+    CHECK(output_is(0, (light_duty_t) { 0, 0 }));
+    light_set_on_off(0, true);
+    CHECK(output_is(0, light_curve_duty(true, 100, 300)));
+}
+
+static void test_transition(void)
+{
+    boot_clean();
+    light_set_temperature(0, 250);
+    light_set_level(0, 50);
+
+    // The stack steps the level, the hardware fade heads for the target at once
+    light_move_to_level(0, 200, 20);
+    light_set_level(0, 60);
+    CHECK(output_is(0, light_curve_duty(true, 200, 250)));
+    CHECK_EQ(fake_ledc[0].fade_ms, 2000);
+    CHECK_EQ(fake_ledc[1].fade_ms, 2000);
+
+    // Later steps of the same transition leave the fade alone
+    uint32_t fades = fake_ledc_stats.fades;
+    fake_time_advance(500 * 1000);
+    light_set_level(0, 120);
+    CHECK_EQ(fake_ledc_stats.fades, fades);
+
+    // Past the deadline a level is a new command again
+    fake_time_advance(2000 * 1000);
+    light_set_level(0, 80);
+    CHECK(output_is(0, light_curve_duty(true, 80, 250)));
+    CHECK_EQ(fake_ledc[0].fade_ms, 0);
+}
+
+// Changes to several zones between light_begin_update() and light_end_update() are one LEDC write
+static void test_batch(void)
+{
+    boot_clean();
+
+    fake_ledc_stats_t before = fake_ledc_stats;
+    light_begin_update();
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        light_set_level(zone, 100 + zone);
+        light_set_temperature(zone, 200 + 100 * zone);
+    }
+    CHECK_EQ(fake_ledc_stats.updates, before.updates);
+    CHECK(light_end_update());
+    CHECK_EQ(fake_ledc_stats.updates - before.updates, 2 * LIGHT_ZONES);
+    CHECK_EQ(fake_ledc_stats.stops - before.stops, 2 * LIGHT_ZONES);
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++)
+        CHECK(output_is(zone, light_curve_duty(true, 100 + zone, 200 + 100 * zone)));
+
+    // Nothing collected, nothing written
+    before = fake_ledc_stats;
+    light_begin_update();
+    CHECK(!light_end_update());
+    CHECK_EQ(fake_ledc_stats.updates, before.updates);
+}
+
+// A burst of changes is written once, after it settles
+static void test_state_writes(void)
+{
+    boot_clean();
+    light_flush_state();
+
+    uint32_t commits = fake_nvs_stats.commits;
+    uint32_t avoided = fake_diag_counters[DIAG_STATE_WRITES_AVOIDED];
+    uint32_t bytes = fake_diag_counters[DIAG_STATE_BYTES_WRITTEN];
+    light_set_level(0, 10);
+    fake_time_advance(STATE_DEBOUNCE_US);
+    CHECK_EQ(fake_nvs_stats.commits - commits, 1);
+    CHECK_EQ(fake_diag_counters[DIAG_STATE_WRITES_AVOIDED], avoided);
+    uint32_t blob = fake_diag_counters[DIAG_STATE_BYTES_WRITTEN] - bytes;
+    CHECK(blob > 0);
+
+    commits = fake_nvs_stats.commits;
+    bytes = fake_diag_counters[DIAG_STATE_BYTES_WRITTEN];
+    for (int i = 0; i < 30; i++)
+        light_set_level(0, 20 + i);
+    light_set_temperature(1, 350);
+    CHECK_EQ(fake_nvs_stats.commits, commits);
+    fake_time_advance(STATE_DEBOUNCE_US);
+    CHECK_EQ(fake_nvs_stats.commits - commits, 1);
+    CHECK_EQ(fake_diag_counters[DIAG_STATE_WRITES_AVOIDED] - avoided, 30);
+    CHECK_EQ(fake_diag_counters[DIAG_STATE_BYTES_WRITTEN] - bytes, 2 * blob);
+}
+
+// Recalls fade over the scene's own transition time unless the command brings one
+static void test_scene_transitions(void)
+{
+    static const light_scene_fields_t fields = { true, true, true, 200, true, 400 };
+    const light_duty_t stored = light_curve_duty(true, 100, 300);
+    const light_duty_t added = light_curve_duty(true, 200, 400);
+
+    fake_nvs_erase_all();
+    boot_clean();
+    light_set_level(0, 100);
+    light_set_temperature(0, 300);
+
+    // A stored scene has no transition time
+    light_store_scene(0, 0, 1);
+    light_set_level(0, 50);
+    light_recall_scene(0, 0, 1, 0xFFFF);
+    CHECK(output_is(0, stored));
+    CHECK_EQ(fake_ledc[0].fade_ms, 0);
+
+    // Add Scene brings the values and the transition time
+    light_add_scene(0, 0, 2, &fields, 30);
+    CHECK(output_is(0, stored));
+    light_recall_scene(0, 0, 2, 0xFFFF);
+    CHECK(output_is(0, added));
+    CHECK_EQ(fake_ledc[0].fade_ms, 3000);
+    light_recall_scene(0, 0, 1, 5);
+    CHECK(output_is(0, stored));
+    CHECK_EQ(fake_ledc[0].fade_ms, 500);
+
+    // Storing over it keeps the transition time, also across a power cycle
+    light_store_scene(0, 0, 2);
+    light_boot_success();
+    boot(ESP_RST_POWERON);
+    light_recall_scene(0, 0, 1, 0);
+    light_recall_scene(0, 0, 2, 0xFFFF);
+    CHECK(output_is(0, stored));
+    CHECK_EQ(fake_ledc[0].fade_ms, 3000);
+
+    // Fields an Add Scene leaves out are taken from the zone
+    light_add_scene(0, 0, 3, &(light_scene_fields_t) { .has_level = true, .level = 20 }, 0);
+    light_recall_scene(0, 0, 1, 0);
+    light_set_level(0, 10);
+    light_recall_scene(0, 0, 3, 0xFFFF);
+    CHECK(output_is(0, light_curve_duty(true, 20, 300)));
+    CHECK_EQ(fake_ledc[0].fade_ms, 0);
+    light_boot_success();
+}
+
+// Factory new, by the stack or by the reboot gesture, starts without scenes
+static void test_scene_tables(void)
+{
+    fake_nvs_erase_all();
+    boot_clean();
+
+    // Without scenes, defaults cost only the state write
+    uint32_t commits = fake_nvs_stats.commits;
+    light_set_defaults();
+    CHECK_EQ(fake_nvs_stats.commits - commits, 1);
+
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        light_set_level(zone, 100);
+        light_store_scene(zone, 0, 1);
+    }
+    light_set_defaults();
+    boot_clean();
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        light_set_level(zone, 50);
+        light_recall_scene(zone, 0, 1, 0);
+        CHECK(output_is(zone, light_curve_duty(true, 50, ESP_ZB_ZCL_COLOR_CONTROL_COLOR_TEMPERATURE_DEF_VALUE)));
+    }
+
+    light_store_scene(LIGHT_ZONES - 1, 0x1234, 2);
+    for (int i = 0; i < LIGHT_RESET_REBOOT_COUNT; i++) {
+        boot(ESP_RST_POWERON);
+        light_load_settings();
+    }
+    CHECK_EQ(fake_zb_factory_resets, 1);
+    boot_clean();
+    light_set_level(LIGHT_ZONES - 1, 20);
+    light_recall_scene(LIGHT_ZONES - 1, 0x1234, 2, 0);
+    CHECK(output_is(LIGHT_ZONES - 1, light_curve_duty(true, 20, ESP_ZB_ZCL_COLOR_CONTROL_COLOR_TEMPERATURE_DEF_VALUE)));
+}
+
+// Each StartUpOnOff after a power cut, with the light on and off before it
+static void test_startup_rules(void)
+{
+    static const struct {
+        uint8_t start_power;
+        bool power;
+        bool expected;
+    } rules[] = {
+        { LIGHT_STARTUP_OFF, false, false },
+        { LIGHT_STARTUP_OFF, true, false },
+        { LIGHT_STARTUP_ON, false, true },
+        { LIGHT_STARTUP_ON, true, true },
+        { LIGHT_STARTUP_TOGGLE, false, true },
+        { LIGHT_STARTUP_TOGGLE, true, false },
+        { LIGHT_STARTUP_PREVIOUS, false, false },
+        { LIGHT_STARTUP_PREVIOUS, true, true },
+    };
+
+    for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+        fake_nvs_erase_all();
+        boot_clean();
+        light_set_startup_on_off(0, rules[i].start_power);
+        light_set_level(0, 100);
+        light_set_temperature(0, 300);
+        light_set_on_off(0, rules[i].power);
+
+        // Stored once the changes settled, the power is cut after that
+        fake_time_advance(STATE_DEBOUNCE_US);
+        uint32_t reports = fake_reports;
+        boot(ESP_RST_POWERON);
+        CHECK(output_is(0, light_curve_duty(rules[i].expected, 100, 300)));
+        // Straight to the LEDC, nothing goes to the stack before it runs
+        CHECK_EQ(fake_reports, reports);
+        light_boot_success();
+    }
+
+    // StartUpColorTemperatureMireds, a temperature or the previous one
+    fake_nvs_erase_all();
+    boot_clean();
+    light_set_level(0, 100);
+    light_set_temperature(0, 300);
+    light_set_startup_temperature(0, 400);
+    light_flush_state();
+    boot(ESP_RST_POWERON);
+    CHECK(output_is(0, light_curve_duty(true, 100, 400)));
+    light_set_temperature(0, 300);
+    light_set_startup_temperature(0, LIGHT_STARTUP_TEMPERATURE_PREVIOUS);
+    light_flush_state();
+    boot(ESP_RST_POWERON);
+    CHECK(output_is(0, light_curve_duty(true, 100, 300)));
+    light_boot_success();
+
+    // A change not yet written is lost to a power cut, but not to esp_restart()
+    light_set_level(0, 50);
+    boot(ESP_RST_POWERON);
+    CHECK(output_is(0, light_curve_duty(true, 100, 300)));
+    light_set_level(0, 50);
+    esp_restart();
+    CHECK(fake_restarted);
+    boot(ESP_RST_SW);
+    CHECK(output_is(0, light_curve_duty(true, 50, 300)));
+    light_boot_success();
+}
+
+// A power-on that doesn't make it to light_boot_success(), returns true if it asked for a reset
+static bool power_cycle(esp_reset_reason_t reason)
+{
+    boot(reason);
+    light_load_settings();
+    return fake_zb_factory_resets > 0;
+}
+
+// What the stack does with esp_zb_factory_reset(): restart, and the device comes up factory new
+static void factory_reset(void)
+{
+    boot(ESP_RST_SW);
+    light_set_defaults();
+    light_boot_success();
+}
+
+static void test_reboot_gesture(void)
+{
+    fake_nvs_erase_all();
+    boot_clean();
+
+    // The light comes on every time up to the last power cycle of the gesture
+    for (int i = 1; i < LIGHT_RESET_REBOOT_COUNT; i++) {
+        CHECK(!power_cycle(ESP_RST_POWERON));
+        CHECK(output_is(0, light_curve_duty(true, LIGHT_LEVEL_MAX, ESP_ZB_ZCL_COLOR_CONTROL_COLOR_TEMPERATURE_DEF_VALUE)));
+    }
+    CHECK(power_cycle(ESP_RST_POWERON));
+    CHECK(output_is(0, (light_duty_t) { 0, 0 }));
+    factory_reset();
+
+    // A boot that gets through the window starts the count over
+    for (int i = 1; i < LIGHT_RESET_REBOOT_COUNT; i++)
+        CHECK(!power_cycle(ESP_RST_POWERON));
+    light_boot_success();
+    for (int i = 1; i < LIGHT_RESET_REBOOT_COUNT; i++)
+        CHECK(!power_cycle(ESP_RST_POWERON));
+    light_boot_success();
+
+    // Software resets in between don't count, only a crash writes flash right away, a brownout counts
+    static const struct {
+        esp_reset_reason_t reason;
+        uint32_t commits;
+    } software[] = {
+        { ESP_RST_SW, 0 },
+        { ESP_RST_PANIC, 1 },
+        { ESP_RST_INT_WDT, 1 },
+        { ESP_RST_TASK_WDT, 1 },
+    };
+    boot_clean();
+    for (int i = 1; i < LIGHT_RESET_REBOOT_COUNT - 1; i++)
+        CHECK(!power_cycle(ESP_RST_POWERON));
+    for (size_t i = 0; i < sizeof(software) / sizeof(software[0]); i++) {
+        uint32_t commits = fake_nvs_stats.commits;
+        CHECK(!power_cycle(software[i].reason));
+        CHECK_EQ(fake_nvs_stats.commits - commits, software[i].commits);
+    }
+    CHECK(!power_cycle(ESP_RST_BROWNOUT));
+    CHECK(power_cycle(ESP_RST_POWERON));
+    factory_reset();
+
+    // Once running, the window is over until the next power cycle
+    boot_clean();
+    uint32_t commits = fake_nvs_stats.commits;
+    light_boot_success();
+    CHECK_EQ(fake_nvs_stats.commits, commits);
+}
+
+static void test_boot_counters(void)
+{
+    uint32_t boots, crashes;
+
+    fake_nvs_erase_all();
+    boot_clean();
+    boot_get_counters(&boots, &crashes);
+    CHECK_EQ(boots, 1);
+    CHECK_EQ(crashes, 0);
+
+    // A power-on writes the gesture count, the counters wait for the clear after the window
+    uint32_t commits = fake_nvs_stats.commits;
+    boot(ESP_RST_POWERON);
+    CHECK_EQ(fake_nvs_stats.commits - commits, 1);
+    light_load_settings();
+    light_boot_success();
+    CHECK_EQ(fake_nvs_stats.commits - commits, 2);
+
+    // A restart writes nothing at all, its boot waits in RTC memory for the next write
+    commits = fake_nvs_stats.commits;
+    boot(ESP_RST_SW);
+    light_boot_success();
+    CHECK_EQ(fake_nvs_stats.commits, commits);
+    boot_get_counters(&boots, &crashes);
+    CHECK_EQ(boots, 3);
+
+    // A crash loop is on flash boot by boot, with the restart before it, and
+    // survives the power cut that ends it
+    for (int i = 0; i < 3; i++)
+        boot(ESP_RST_PANIC);
+    boot(ESP_RST_POWERON);
+    boot_get_counters(&boots, &crashes);
+    CHECK_EQ(boots, 7);
+    CHECK_EQ(crashes, 3);
+
+    // Counted in RTC memory, a boot cut short before the window ends is lost with it
+    boot(ESP_RST_POWERON);
+    boot_get_counters(&boots, &crashes);
+    CHECK_EQ(boots, 7);
+    light_load_settings();
+    light_boot_success();
+    boot(ESP_RST_POWERON);
+    boot_get_counters(&boots, &crashes);
+    CHECK_EQ(boots, 8);
+    CHECK_EQ(crashes, 3);
+    light_boot_success();
+}
+
+static double elapsed_ns(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+// Host time of the duty path, a relative figure for changes to it
+static void bench_duty_path(void)
+{
+    volatile uint32_t sink = 0;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < BENCH_CURVE_CALLS; i++) {
+        light_duty_t duty = light_curve_duty(true, 1 + i % LIGHT_LEVEL_MAX, LIGHT_MIREDS_MIN + i % 351);
+        sink += duty.cw + duty.ww;
+    }
+    printf("light_curve_duty()      %8.1f ns/call\n", elapsed_ns(&start) / BENCH_CURVE_CALLS);
+
+    boot_clean();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < BENCH_LEVEL_CALLS; i++)
+        light_set_level(0, 1 + i % LIGHT_LEVEL_MAX);
+    printf("light_set_level()       %8.1f ns/call (LEDC, NVS debounce and attributes included)\n",
+        elapsed_ns(&start) / BENCH_LEVEL_CALLS);
+    (void)sink;
+}
+
+int main(int argc, char *argv[])
+{
+    (void)TAG;      // defined by light_driver.h for the firmware sources
+
+    RUN(test_dimming_lut);
+    RUN(test_init);
+    RUN(test_duty_sweep);
+    RUN(test_transition);
+    RUN(test_batch);
+    RUN(test_state_writes);
+    RUN(test_scene_transitions);
+    RUN(test_scene_tables);
+    RUN(test_startup_rules);
+    RUN(test_reboot_gesture);
+    RUN(test_boot_counters);
+    bench_duty_path();
+    return test_result();
+}
@@ -0,0 +1,179 @@
+#include "effect.h"
+#include "fake.h"
+#include "freertos/semphr.h"
+#include "light_control.h"
+#include "light_curve.h"
+#include "light_driver.h"
+#include "test.h"
+
+/* The command queue of light_control.c against a light driver that only
+ * records what it is asked to do. The light task can be held at the start of
+ * a batch, so the queue fills up as it would behind a slow flash write.
+ */
+
+#define QUEUE_SIZE              32      // as in light_control.c
+
+typedef struct {
+    uint8_t zone;
+    light_command_type_t type;
+    uint16_t value;
+} applied_t;
+
+static applied_t applied[256];
+static int applied_count = 0;
+
+static StaticSemaphore_t gate_buffer;
+static SemaphoreHandle_t gate;
+static bool gate_closed = false;
+
+static void apply(uint8_t zone, light_command_type_t type, uint16_t value)
+{
+    if (applied_count < (int)(sizeof(applied) / sizeof(applied[0])))
+        applied[applied_count++] = (applied_t) { zone, type, value };
+}
+
+// The stand-in driver, in the light task
+
+void light_begin_update(void)
+{
+    if (gate_closed)
+        xSemaphoreTake(gate, portMAX_DELAY);
+}
+
+bool light_end_update(void) { return true; }
+void light_set_level(uint8_t zone, uint8_t level) { apply(zone, LIGHT_CMD_LEVEL, level); }
+void light_set_on_off(uint8_t zone, bool power) { apply(zone, LIGHT_CMD_ON_OFF, power); }
+void light_set_temperature(uint8_t zone, uint16_t temperature) { apply(zone, LIGHT_CMD_TEMPERATURE, temperature); }
+void light_store_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id) { apply(zone, LIGHT_CMD_STORE_SCENE, scene_id); }
+void light_recall_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id, uint16_t transition_time)
+{
+    apply(zone, LIGHT_CMD_RECALL_SCENE, scene_id);
+}
+
+void light_factory_reset(void) {}
+void light_set_defaults(void) {}
+void light_load_settings(void) {}
+void light_boot_success(void) {}
+void light_set_startup_on_off(uint8_t zone, uint8_t startup) {}
+void light_set_startup_temperature(uint8_t zone, uint16_t startup) {}
+void light_set_on_off_transition_time(uint8_t zone, uint16_t transition_time) {}
+void light_set_calibration(const light_calibration_t *calibration) {}
+void light_move_to_level(uint8_t zone, uint8_t level, uint16_t transition_time) {}
+void light_move_to_temperature(uint8_t zone, uint16_t temperature, uint16_t transition_time) {}
+void light_add_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id, const light_scene_fields_t *fields,
+    uint16_t transition_time) {}
+void light_remove_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id) {}
+void light_remove_group_scenes(uint8_t zone, uint16_t group_id) {}
+bool light_curve_parse_calibration(const uint8_t *data, size_t size, light_calibration_t *calibration) { return false; }
+void effect_init(void) {}
+void effect_trigger(uint8_t zone, uint8_t effect_id) {}
+void effect_step(uint8_t zone) {}
+
+// Hold the light task at its next batch, with the commands posted so far still queued
+static void hold(void)
+{
+    gate_closed = true;
+    light_control_post(0, LIGHT_CMD_ON_OFF, 1, 0);
+    fake_tasks_wait_idle();
+}
+
+static void release(void)
+{
+    gate_closed = false;
+    xSemaphoreGive(gate);
+    fake_tasks_wait_idle();
+}
+
+static const applied_t *last_applied(uint8_t zone, light_command_type_t type)
+{
+    for (int i = applied_count - 1; i >= 0; i--) {
+        if (applied[i].zone == zone && applied[i].type == type)
+            return &applied[i];
+    }
+    return NULL;
+}
+
+static void test_coalescing(void)
+{
+    light_control_stats_t before, after;
+
+    light_control_get_stats(&before);
+    applied_count = 0;
+    hold();
+    for (int i = 1; i <= 30; i++)
+        CHECK(light_control_post(0, LIGHT_CMD_LEVEL, i, 0));
+    release();
+    light_control_get_stats(&after);
+
+    // One level change reaches the driver, the last one
+    CHECK_EQ(applied_count, 2);
+    CHECK(last_applied(0, LIGHT_CMD_LEVEL) && last_applied(0, LIGHT_CMD_LEVEL)->value == 30);
+    CHECK_EQ(after.commands - before.commands, 31);
+    CHECK_EQ(after.coalesced - before.coalesced, 29);
+    CHECK_EQ(after.queue_depth, 0);
+}
+
+// A slider burst longer than the queue still ends at its final target
+static void test_full_queue(void)
+{
+    light_control_stats_t before, after;
+
+    light_control_get_stats(&before);
+    applied_count = 0;
+    hold();
+    for (int i = 1; i <= 3 * QUEUE_SIZE; i++) {
+        CHECK(light_control_post(0, LIGHT_CMD_LEVEL, i, 0));
+        CHECK(light_control_post(1, LIGHT_CMD_TEMPERATURE, 150 + i, 0));
+    }
+    light_control_get_stats(&after);
+    CHECK_EQ(after.queue_depth, QUEUE_SIZE);
+    CHECK_EQ(after.queue_depth_max, QUEUE_SIZE);
+
+    // Nothing to keep a scene command in, it is the only kind dropped
+    CHECK(!light_control_post_scene(0, LIGHT_CMD_STORE_SCENE, 0, 1, 0));
+    release();
+    light_control_get_stats(&after);
+
+    CHECK(last_applied(0, LIGHT_CMD_LEVEL) && last_applied(0, LIGHT_CMD_LEVEL)->value == 3 * QUEUE_SIZE);
+    CHECK(last_applied(1, LIGHT_CMD_TEMPERATURE) && last_applied(1, LIGHT_CMD_TEMPERATURE)->value == 150 + 3 * QUEUE_SIZE);
+    CHECK(!last_applied(0, LIGHT_CMD_STORE_SCENE));
+    CHECK_EQ(after.dropped - before.dropped, 1);
+    CHECK_EQ(after.coalesced - before.coalesced, 2 * (3 * QUEUE_SIZE - 1));
+    CHECK_EQ(after.queue_depth, 0);
+}
+
+// A command kept aside is newer than the ones in the queue, whatever their type
+static void test_overflow_order(void)
+{
+    applied_count = 0;
+    hold();
+    CHECK(light_control_post(0, LIGHT_CMD_LEVEL, 40, 0));
+    for (int i = 2; i < QUEUE_SIZE; i++)
+        CHECK(light_control_post(0, LIGHT_CMD_TEMPERATURE, 200 + i, 0));
+    CHECK(light_control_post(0, LIGHT_CMD_LEVEL, 50, 0));
+    CHECK(light_control_post(0, LIGHT_CMD_LEVEL, 0, 0));
+    release();
+
+    // Level 0 is an Off, it doesn't replace the level kept aside
+    CHECK(last_applied(0, LIGHT_CMD_LEVEL) && last_applied(0, LIGHT_CMD_LEVEL)->value == 50);
+    CHECK(last_applied(0, LIGHT_CMD_ON_OFF) && last_applied(0, LIGHT_CMD_ON_OFF)->value == 0);
+    CHECK(last_applied(0, LIGHT_CMD_TEMPERATURE) && last_applied(0, LIGHT_CMD_TEMPERATURE)->value == 200 + QUEUE_SIZE - 1);
+
+    // And the queue takes scene commands again
+    CHECK(light_control_post_scene(0, LIGHT_CMD_STORE_SCENE, 0, 1, 0));
+    fake_tasks_wait_idle();
+    CHECK(last_applied(0, LIGHT_CMD_STORE_SCENE));
+}
+
+int main(void)
+{
+    (void)TAG;      // defined by light_driver.h for the firmware sources
+    gate = xSemaphoreCreateBinaryStatic(&gate_buffer);
+    light_control_start();
+    fake_tasks_wait_idle();
+
+    RUN(test_coalescing);
+    RUN(test_full_queue);
+    RUN(test_overflow_order);
+    return test_result();
+}
@@ -0,0 +1,547 @@
+#include "ota_parser.h"
+#include "test.h"
+
+#include <string.h>
+
+/* Unit and fuzz tests of the streaming OTA sub-element parser, fed with OTA
+ * files from create-ota.py (given on the command line) and with hand-made
+ * files for the edge cases.
+ */
+
+#define TAG_UPGRADE_IMAGE       0x0000
+#define TAG_COMPRESSED_IMAGE    0xF000
+#define TAG_DELTA_IMAGE         0xF001
+#define TAG_IMAGE_HASH          0xF002
+#define TAG_UNKNOWN             0x1234
+
+#define FUZZ_ITERATIONS         200
+
+typedef struct {
+    uint16_t tag;
+    size_t offset;                  // payload offset of the data after the fixed header
+    size_t length;                  // as passed to begin()
+    uint8_t header[OTA_PARSER_MAX_HEADER];
+    size_t received;
+    int ends;
+} event_t;
+
+typedef struct {
+    bool fed;
+    bool finished;
+    const char *error;
+    size_t offset;
+    event_t *events;
+    size_t event_count;
+} result_t;
+
+static ota_parser_action_t test_begin(uint16_t tag, const uint8_t *header, size_t length);
+static bool test_data(const uint8_t *data, size_t size);
+static bool test_end(void);
+
+// Header sizes as in main/ota.c
+static const ota_parser_handler_t handlers[] = {
+    { TAG_UPGRADE_IMAGE, 0, test_begin, test_data, test_end },
+    { TAG_COMPRESSED_IMAGE, 4, test_begin, test_data, test_end },
+    { TAG_DELTA_IMAGE, 40, test_begin, test_data, test_end },
+    { TAG_IMAGE_HASH, 74, test_begin, test_data, test_end },
+};
+#define HANDLER_COUNT (sizeof(handlers) / sizeof(handlers[0]))
+
+static ota_parser_t parser;
+static size_t handler_count = HANDLER_COUNT;        // fewer leaves the last tags unknown
+static ota_parser_action_t actions[HANDLER_COUNT];
+static const uint8_t *payload;                      // what the parser is being fed
+static result_t *recording;
+static event_t *current;
+
+static const ota_parser_handler_t *handler_for(uint16_t tag)
+{
+    for (size_t i = 0; i < handler_count; i++) {
+        if (handlers[i].tag == tag)
+            return &handlers[i];
+    }
+    return NULL;
+}
+
+static ota_parser_action_t action_for(uint16_t tag)
+{
+    return actions[handler_for(tag) - handlers];
+}
+
+static void reset_handlers(void)
+{
+    handler_count = HANDLER_COUNT;
+    for (size_t i = 0; i < HANDLER_COUNT; i++)
+        actions[i] = OTA_PARSER_ACCEPT;
+}
+
+static event_t *add_event(result_t *result, uint16_t tag, size_t offset, size_t length, const uint8_t *header)
+{
+    event_t *event = &result->events[result->event_count++];
+
+    *event = (event_t) { .tag = tag, .offset = offset, .length = length };
+    memcpy(event->header, header, handler_for(tag)->header_size);
+    return event;
+}
+
+static ota_parser_action_t test_begin(uint16_t tag, const uint8_t *header, size_t length)
+{
+    CHECK(current == NULL);
+    event_t *event = add_event(recording, tag, parser.offset, length, header);
+    ota_parser_action_t action = action_for(tag);
+
+    current = action == OTA_PARSER_ACCEPT ? event : NULL;
+    return action;
+}
+
+static bool test_data(const uint8_t *data, size_t size)
+{
+    CHECK(current != NULL);
+    CHECK(size > 0);
+    if (!current)
+        return false;
+
+    // Slices point into the fed data, at the parser's offset
+    CHECK(data == payload + parser.offset);
+    current->received += size;
+    CHECK(current->received <= current->length);
+    return true;
+}
+
+static bool test_end(void)
+{
+    CHECK(current != NULL);
+    if (!current)
+        return false;
+
+    CHECK_EQ(current->received, current->length);
+    current->ends++;
+    current = NULL;
+    return true;
+}
+
+static void result_init(result_t *result, size_t size)
+{
+    *result = (result_t) { 0 };
+    result->events = malloc((size / OTA_PARSER_TLV_SIZE + 1) * sizeof(event_t));
+}
+
+// Walk the sub-elements directly, for what the handlers should see
+static void expect(const uint8_t *data, size_t size, result_t *result)
+{
+    size_t offset = 0;
+
+    result_init(result, size);
+    result->fed = true;
+    result->finished = true;
+    while (offset < size) {
+        if (size - offset < OTA_PARSER_TLV_SIZE) {
+            result->finished = false;
+            break;
+        }
+
+        uint16_t tag = data[offset] | (data[offset + 1] << 8);
+        size_t length = data[offset + 2] | (data[offset + 3] << 8) | (data[offset + 4] << 16)
+            | ((size_t)data[offset + 5] << 24);
+        const ota_parser_handler_t *handler = handler_for(tag);
+        size_t header_size = handler ? handler->header_size : 0;
+
+        offset += OTA_PARSER_TLV_SIZE;
+        if (length < header_size) {
+            result->fed = false;
+            result->error = "sub-element shorter than its header";
+            break;
+        }
+        if (size - offset < header_size) {
+            result->finished = false;
+            break;
+        }
+
+        length -= header_size;
+        size_t available = size - offset - header_size;
+        if (handler) {
+            event_t *event = add_event(result, tag, offset + header_size, length, &data[offset]);
+            ota_parser_action_t action = action_for(tag);
+            if (action == OTA_PARSER_ABORT) {
+                result->fed = false;
+                result->error = "sub-element rejected";
+                break;
+            }
+            if (action == OTA_PARSER_ACCEPT) {
+                event->received = length < available ? length : available;
+                event->ends = length <= available;
+            }
+        }
+
+        if (length > available) {
+            result->finished = false;
+            break;
+        }
+        offset += header_size + length;
+    }
+
+    if (!result->fed)
+        result->finished = false;
+    else if (!result->finished)
+        result->error = "file truncated";
+    result->offset = size;
+}
+
+// Feed in slices of the given size, or of random sizes when block is 0
+static void run(const uint8_t *data, size_t size, size_t block, uint32_t *seed, result_t *result)
+{
+    result_init(result, size);
+    recording = result;
+    payload = data;
+    current = NULL;
+    ota_parser_init(&parser, handlers, handler_count);
+
+    result->fed = true;
+    for (size_t offset = 0; offset < size && result->fed;) {
+        size_t slice = block;
+        if (!slice)
+            slice = test_random(seed) % 4 ? 1 + test_random(seed) % 600 : 1 + test_random(seed) % 8;
+        if (slice > size - offset)
+            slice = size - offset;
+
+        result->fed = ota_parser_feed(&parser, data + offset, slice);
+        offset += slice;
+    }
+
+    result->finished = result->fed && ota_parser_finish(&parser);
+    result->error = parser.error;
+    result->offset = parser.offset;
+}
+
+static void check_result(const result_t *expected, const result_t *result)
+{
+    CHECK_EQ(result->fed, expected->fed);
+    CHECK_EQ(result->finished, expected->finished);
+    CHECK((!result->error && !expected->error)
+        || (result->error && expected->error && !strcmp(result->error, expected->error)));
+    if (result->fed)
+        CHECK_EQ(result->offset, expected->offset);
+
+    CHECK_EQ(result->event_count, expected->event_count);
+    for (size_t i = 0; i < result->event_count && i < expected->event_count; i++) {
+        const event_t *a = &result->events[i], *b = &expected->events[i];
+        CHECK_EQ(a->tag, b->tag);
+        CHECK_EQ(a->offset, b->offset);
+        CHECK_EQ(a->length, b->length);
+        CHECK(!memcmp(a->header, b->header, handler_for(a->tag)->header_size));
+        CHECK_EQ(a->received, b->received);
+        CHECK_EQ(a->ends, b->ends);
+    }
+}
+
+static void check_run(const uint8_t *data, size_t size, size_t block, uint32_t *seed)
+{
+    result_t expected, result;
+
+    expect(data, size, &expected);
+    run(data, size, block, seed, &result);
+    check_result(&expected, &result);
+    free(expected.events);
+    free(result.events);
+}
+
+static size_t put_tlv(uint8_t *buf, size_t offset, uint16_t tag, uint32_t length, size_t data_size)
+{
+    buf[offset++] = tag;
+    buf[offset++] = tag >> 8;
+    for (int i = 0; i < 4; i++)
+        buf[offset++] = length >> (8 * i);
+    for (size_t i = 0; i < data_size; i++)
+        buf[offset++] = i;
+    return offset;
+}
+
+static void test_whole_files(const uint8_t *data, size_t size)
+{
+    result_t result;
+
+    reset_handlers();
+    check_run(data, size, size, NULL);
+
+    // Every create-ota.py file has an image and a hash sub-element
+    run(data, size, size, NULL, &result);
+    CHECK(result.finished);
+    CHECK(result.event_count >= 2);
+    free(result.events);
+}
+
+static void test_slice_boundaries(const uint8_t *data, size_t size)
+{
+    static const size_t blocks[] = { 1, 2, 3, 5, 6, 7, 10, 64, 79, 80, 81, 82, 223, 4096 };
+    uint32_t seed = 1;
+
+    reset_handlers();
+    for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++)
+        check_run(data, size, blocks[i], NULL);
+    for (int i = 0; i < 50; i++)
+        check_run(data, size, 0, &seed);
+}
+
+static void test_unknown_tags(const uint8_t *data, size_t size)
+{
+    uint32_t seed = 2;
+
+    // Only the legacy image is known, every other sub-element is skipped unbuffered
+    reset_handlers();
+    handler_count = 1;
+    check_run(data, size, 0, &seed);
+    check_run(data, size, 1, NULL);
+
+    uint8_t buf[256];
+    size_t len = put_tlv(buf, 0, TAG_UNKNOWN, 100, 100);
+    len = put_tlv(buf, len, TAG_UPGRADE_IMAGE, 10, 10);
+    len = put_tlv(buf, len, TAG_UNKNOWN, 3, 3);
+
+    result_t result;
+    run(buf, len, 7, NULL, &result);
+    CHECK(result.finished);
+    CHECK_EQ(result.event_count, 1);
+    CHECK_EQ(result.events[0].tag, TAG_UPGRADE_IMAGE);
+    CHECK_EQ(result.events[0].offset, 106 + 6);
+    CHECK_EQ(result.events[0].received, 10);
+    free(result.events);
+    reset_handlers();
+}
+
+static void test_skipped_tags(const uint8_t *data, size_t size)
+{
+    uint32_t seed = 3;
+
+    reset_handlers();
+    for (size_t i = 0; i < HANDLER_COUNT; i++) {
+        actions[i] = OTA_PARSER_SKIP;
+        check_run(data, size, 0, &seed);
+    }
+
+    // Skipped sub-elements get begin() only
+    result_t result;
+    run(data, size, 13, NULL, &result);
+    CHECK(result.finished);
+    for (size_t i = 0; i < result.event_count; i++) {
+        CHECK_EQ(result.events[i].received, 0);
+        CHECK_EQ(result.events[i].ends, 0);
+    }
+    free(result.events);
+    reset_handlers();
+}
+
+static void test_zero_length(void)
+{
+    uint8_t buf[64];
+    size_t len = 0;
+    result_t result;
+
+    reset_handlers();
+    len = put_tlv(buf, len, TAG_UNKNOWN, 0, 0);
+    len = put_tlv(buf, len, TAG_UPGRADE_IMAGE, 0, 0);
+    len = put_tlv(buf, len, TAG_COMPRESSED_IMAGE, 4, 4);     // fixed header only
+    len = put_tlv(buf, len, TAG_UPGRADE_IMAGE, 2, 2);
+    len = put_tlv(buf, len, TAG_UPGRADE_IMAGE, 0, 0);
+
+    for (size_t block = 1; block <= len; block++) {
+        run(buf, len, block, NULL, &result);
+        CHECK(result.finished);
+        CHECK_EQ(result.event_count, 4);
+        if (result.event_count == 4) {
+            CHECK_EQ(result.events[0].length, 0);
+            CHECK_EQ(result.events[0].ends, 1);
+            CHECK_EQ(result.events[1].tag, TAG_COMPRESSED_IMAGE);
+            CHECK_EQ(result.events[1].length, 0);
+            CHECK_EQ(result.events[1].header[3], 3);
+            CHECK_EQ(result.events[1].ends, 1);
+            CHECK_EQ(result.events[2].received, 2);
+            CHECK_EQ(result.events[3].length, 0);
+            CHECK_EQ(result.events[3].ends, 1);
+        }
+        free(result.events);
+        check_run(buf, len, block, NULL);
+    }
+
+    // A skipped empty sub-element has no end()
+    actions[0] = OTA_PARSER_SKIP;
+    run(buf, len, 1, NULL, &result);
+    CHECK(result.finished);
+    CHECK(result.event_count == 4 && result.events[0].ends == 0);
+    free(result.events);
+    reset_handlers();
+
+    // Too short for the fixed header of its handler
+    len = put_tlv(buf, 0, TAG_COMPRESSED_IMAGE, 0, 0);
+    len = put_tlv(buf, len, TAG_UPGRADE_IMAGE, 0, 0);
+    run(buf, len, 1, NULL, &result);
+    CHECK(!result.fed);
+    CHECK(result.error && !strcmp(result.error, "sub-element shorter than its header"));
+    CHECK_EQ(result.event_count, 0);
+    free(result.events);
+    check_run(buf, len, 1, NULL);
+}
+
+static void test_truncated(const uint8_t *data, size_t size)
+{
+    uint32_t seed = 4;
+    result_t result;
+
+    reset_handlers();
+    // In the first tag and length, in the first fixed header, in the data and at the end
+    const size_t cuts[] = { 1, 5, 6, 8, 60, size / 2, size - 1 };
+    for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+        run(data, cuts[i], 0, &seed, &result);
+        CHECK(result.fed);
+        CHECK(!result.finished);
+        CHECK(result.error && !strcmp(result.error, "file truncated"));
+        free(result.events);
+        check_run(data, cuts[i], 0, &seed);
+    }
+
+    // Everything up to a sub-element boundary is a valid file
+    size_t first = OTA_PARSER_TLV_SIZE + (data[2] | (data[3] << 8) | (data[4] << 16) | ((size_t)data[5] << 24));
+    run(data, first, 0, &seed, &result);
+    CHECK(result.finished);
+    free(result.events);
+}
+
+static void test_rejected(const uint8_t *data, size_t size)
+{
+    uint32_t seed = 5;
+
+    reset_handlers();
+    for (size_t i = 0; i < HANDLER_COUNT; i++) {
+        actions[i] = OTA_PARSER_ABORT;
+        check_run(data, size, 0, &seed);
+        actions[i] = OTA_PARSER_ACCEPT;
+    }
+}
+
+// Continue in an accepted sub-element from a checkpoint, the handler already has the data before it
+static void resume(const uint8_t *data, size_t size, const event_t *event, size_t consumed, size_t block,
+    result_t *result)
+{
+    result_init(result, size);
+    recording = result;
+    payload = data;
+    current = &result->events[result->event_count++];
+    *current = *event;
+    current->received = consumed;
+    current->ends = 0;
+    ota_parser_init(&parser, handlers, handler_count);
+
+    result->fed = ota_parser_resume(&parser, event->offset + consumed, event->tag, event->length - consumed);
+    for (size_t offset = parser.offset; offset < size && result->fed; offset += block) {
+        size_t slice = block < size - offset ? block : size - offset;
+        result->fed = ota_parser_feed(&parser, data + offset, slice);
+    }
+
+    result->finished = result->fed && ota_parser_finish(&parser);
+    result->error = parser.error;
+    result->offset = parser.offset;
+}
+
+static void test_resume(const uint8_t *data, size_t size)
+{
+    result_t expected, result;
+
+    reset_handlers();
+    expect(data, size, &expected);
+    for (size_t i = 0; i < expected.event_count; i++) {
+        const event_t *event = &expected.events[i];
+        if (event->tag == TAG_IMAGE_HASH)
+            continue;
+
+        // At the start, in the middle and after the last of the data
+        const size_t consumed[] = { 0, 1, event->length / 2, event->length - 1, event->length };
+        for (size_t j = 0; j < sizeof(consumed) / sizeof(consumed[0]); j++) {
+            if (consumed[j] > event->length)
+                continue;
+
+            resume(data, size, event, consumed[j], 64, &result);
+            CHECK(result.finished);
+            CHECK_EQ(result.offset, size);
+            CHECK_EQ(result.event_count, expected.event_count - i);
+            if (result.event_count) {
+                CHECK_EQ(result.events[0].received, event->length);
+                CHECK_EQ(result.events[0].ends, 1);
+            }
+            free(result.events);
+        }
+    }
+    free(expected.events);
+
+    // Nothing left to feed: the sub-element ends in the resume itself
+    uint8_t buf[32];
+    size_t len = put_tlv(buf, 0, TAG_UPGRADE_IMAGE, 10, 10);
+    event_t event = { .tag = TAG_UPGRADE_IMAGE, .offset = OTA_PARSER_TLV_SIZE, .length = 10 };
+    resume(buf, len, &event, 10, 1, &result);
+    CHECK(result.fed);
+    CHECK_EQ(result.events[0].ends, 1);
+    CHECK(current == NULL);
+    CHECK(result.finished);
+    free(result.events);
+
+    // Only tags with a handler can be resumed
+    ota_parser_init(&parser, handlers, handler_count);
+    CHECK(!ota_parser_resume(&parser, 0, TAG_UNKNOWN, 1));
+}
+
+// Corrupt files must fail cleanly, and the same way however they are sliced
+static void test_fuzz(const uint8_t *data, size_t size, uint32_t seed)
+{
+    uint8_t *buf = malloc(size);
+
+    reset_handlers();
+    for (int i = 0; i < FUZZ_ITERATIONS; i++) {
+        size_t len = size;
+        memcpy(buf, data, size);
+
+        int mutations = 1 + test_random(&seed) % 4;
+        for (int m = 0; m < mutations; m++) {
+            uint32_t r = test_random(&seed);
+            switch (r % 4) {
+            case 0:         // the tags and lengths are near the start and after the images
+                buf[test_random(&seed) % (len < 128 ? len : 128)] = test_random(&seed);
+                break;
+            case 1:
+                buf[len - 1 - test_random(&seed) % (len < 128 ? len : 128)] = test_random(&seed);
+                break;
+            case 2:
+                buf[test_random(&seed) % len] = test_random(&seed);
+                break;
+            default:
+                len = 1 + test_random(&seed) % len;
+                break;
+            }
+        }
+
+        check_run(buf, len, len, NULL);
+        check_run(buf, len, 0, &seed);
+    }
+    free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    RUN(test_zero_length);
+
+    for (int i = 1; i < argc; i++) {
+        size_t file_size, size;
+        uint8_t *file = test_load_file(argv[i], &file_size);
+        const uint8_t *data = test_ota_payload(file, file_size, &size);
+
+        printf("%s\n", argv[i]);
+        RUN(test_whole_files, data, size);
+        RUN(test_slice_boundaries, data, size);
+        RUN(test_unknown_tags, data, size);
+        RUN(test_skipped_tags, data, size);
+        RUN(test_truncated, data, size);
+        RUN(test_rejected, data, size);
+        RUN(test_resume, data, size);
+        RUN(test_fuzz, data, size, i);
+        free(file);
+    }
+
+    return test_result();
+}
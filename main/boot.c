@@ -0,0 +1,149 @@
+#include "boot.h"
+#include "diag.h"
+#include "light_curve.h"
+#include "light_driver.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "nvs_flash.h"
+
+#define BOOT_NAMESPACE          "storage"
+#define BOOT_KEY                "reset_gesture"
+#define BOOT_BOOTS_KEY          "diag_boots"
+#define BOOT_CRASHES_KEY        "diag_crashes"
+#define BOOT_MAGIC              0x424F4F55
+
+typedef enum {
+    BOOT_PHASE_STARTING,                // within the gesture window, the count is in flash
+    BOOT_PHASE_RUNNING,                 // past boot_success(), the count is 0
+} boot_phase_t;
+
+// Survives software resets but not a power cut, where it comes up as garbage
+typedef struct {
+    uint32_t magic;
+    uint8_t phase;
+    uint8_t count;
+    uint8_t counters_saved;             // flash has boots and crashes
+    uint32_t boots;
+    uint32_t crashes;
+    uint32_t crc;
+} boot_record_t;
+
+static RTC_NOINIT_ATTR boot_record_t boot_record;
+
+static uint32_t record_crc()
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)&boot_record, offsetof(boot_record_t, crc));
+}
+
+static bool record_valid()
+{
+    return boot_record.magic == BOOT_MAGIC && boot_record.crc == record_crc();
+}
+
+static void update_record()
+{
+    boot_record.magic = BOOT_MAGIC;
+    boot_record.crc = record_crc();
+}
+
+static bool is_crash(esp_reset_reason_t reason)
+{
+    switch (reason) {
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+    case ESP_RST_BROWNOUT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The gesture count and the counters share a single commit
+static void write_record(bool count, bool counters)
+{
+    if (count || counters) {
+        nvs_handle_t my_handle;
+        ESP_ERROR_CHECK(nvs_open(BOOT_NAMESPACE, NVS_READWRITE, &my_handle));
+        if (count)
+            ESP_ERROR_CHECK(nvs_set_u8(my_handle, BOOT_KEY, boot_record.count));
+        if (counters) {
+            ESP_ERROR_CHECK(nvs_set_u32(my_handle, BOOT_BOOTS_KEY, boot_record.boots));
+            ESP_ERROR_CHECK(nvs_set_u32(my_handle, BOOT_CRASHES_KEY, boot_record.crashes));
+            boot_record.counters_saved = true;
+        }
+        ESP_ERROR_CHECK(nvs_commit(my_handle));
+        nvs_close(my_handle);
+        diag_count(DIAG_NVS_COMMITS, 1);
+    }
+    update_record();
+}
+
+bool boot_count_power_cycle(void)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool crash = is_crash(reason);
+
+    // A brownout is a power cycle to the user, even if the RTC memory made it through.
+    // Anything else with an intact record happened while the power stayed on.
+    bool valid = record_valid();
+    bool power_cycle = !valid || reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT;
+
+    // The counters carry on in RTC memory, after a power cut from what flash has
+    if (!valid) {
+        boot_record = (boot_record_t) { .phase = BOOT_PHASE_STARTING };
+        nvs_handle_t my_handle;
+        if (nvs_open(BOOT_NAMESPACE, NVS_READONLY, &my_handle) == ESP_OK) {
+            nvs_get_u8(my_handle, BOOT_KEY, &boot_record.count);
+            nvs_get_u32(my_handle, BOOT_BOOTS_KEY, &boot_record.boots);
+            nvs_get_u32(my_handle, BOOT_CRASHES_KEY, &boot_record.crashes);
+            nvs_close(my_handle);
+        }
+    }
+
+    // Stored with the next gesture write, or now if this boot follows a crash that might repeat before then
+    boot_record.boots++;
+    boot_record.crashes += crash;
+    boot_record.counters_saved = false;
+
+    if (!power_cycle) {
+        ESP_LOGI(TAG, "Software reset (reason %d), not a power cycle", (int)reason);
+        write_record(false, crash);
+        return false;
+    }
+
+    // Written before the window starts, the power may be cut at any moment
+    bool reset = light_curve_count_boot(&boot_record.count);
+    boot_record.phase = BOOT_PHASE_STARTING;
+    write_record(true, crash);
+
+    ESP_LOGI(TAG, "Power cycle number %d", (int)boot_record.count);
+    return reset;
+}
+
+void boot_success(void)
+{
+    // After a software reset the counters stay in RTC memory, for the next
+    // crash or power cycle write to take along
+    if (boot_record.phase == BOOT_PHASE_RUNNING) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Successful boot, reset counter");
+    boot_record.phase = BOOT_PHASE_RUNNING;
+    boot_record.count = 0;
+    write_record(true, !boot_record.counters_saved);
+}
+
+void boot_get_counters(uint32_t *boots, uint32_t *crashes)
+{
+    *boots = boot_record.boots;
+    *crashes = boot_record.crashes;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Power-cycle reset gesture: LIGHT_RESET_REBOOT_COUNT power-ons, each cut
+ * before boot_success(), ask for a factory reset. Software resets (OTA,
+ * panic, watchdog) are told apart through a record in RTC memory and are
+ * not counted.
+ *
+ * The record also carries the boot and crash counters of the diagnostics.
+ * Flash catches up with them in the writes the gesture makes anyway, and
+ * right away after a crash, which might repeat before boot_success(). A
+ * software reset writes nothing, its boot is lost if the power goes before
+ * the next of those writes.
+ */
+
+/* Count this boot, call once after nvs_flash_init(). Returns true if the gesture is complete. */
+bool boot_count_power_cycle(void);
+
+/* The boot survived the gesture window, clear the count and store the counters with it.
+ * Writes nothing after a software reset. */
+void boot_success(void);
+
+/* Boots, and boots after a panic, watchdog or brownout, including this one */
+void boot_get_counters(uint32_t *boots, uint32_t *crashes);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
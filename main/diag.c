@@ -0,0 +1,165 @@
+#include "boot.h"
+#include "diag.h"
+#include "light_control.h"
+#include "light_driver.h"
+#include "power.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define DIAG_REFRESH_MS         10000
+
+// Hot path: relaxed atomic increments only, everything else happens on refresh
+static atomic_uint_least32_t counters[DIAG_COUNTER_MAX];
+static atomic_uint_least32_t latency[DIAG_LATENCY_BUCKETS];
+
+static uint8_t reset_reason = ESP_RST_UNKNOWN;
+static uint32_t boots = 0;
+static uint32_t crashes = 0;
+static uint32_t light_on_ms = 0;
+static uint32_t join_ms = 0;
+static uint32_t join_attempts = 0;
+static uint32_t ota_max_stall_us = 0;
+static uint32_t ota_throughput = 0;
+
+static uint32_t ota_bytes_last = 0;
+static int64_t ota_refresh_us = 0;
+
+void diag_count(diag_counter_t counter, uint32_t value)
+{
+    atomic_fetch_add_explicit(&counters[counter], value, memory_order_relaxed);
+}
+
+void diag_latency(uint32_t latency_us)
+{
+    uint32_t ms = latency_us / 1000;
+    int bucket = ms ? 32 - __builtin_clz(ms) : 0;
+
+    if (bucket >= DIAG_LATENCY_BUCKETS)
+        bucket = DIAG_LATENCY_BUCKETS - 1;
+    atomic_fetch_add_explicit(&latency[bucket], 1, memory_order_relaxed);
+}
+
+void diag_light_on(uint32_t ms)
+{
+    light_on_ms = ms;
+}
+
+void diag_ota_progress(uint32_t max_stall_us, uint32_t bytes_per_s)
+{
+    ota_max_stall_us = max_stall_us;
+    ota_throughput = bytes_per_s;
+}
+
+void diag_network_joined(uint32_t ms, uint32_t attempts)
+{
+    join_ms = ms;
+    join_attempts = attempts;
+}
+
+void diag_init(void)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+    reset_reason = reason;
+
+    // Counted by the reset gesture, which keeps them in RTC memory
+    boot_get_counters(&boots, &crashes);
+
+    ESP_LOGI(TAG, "Boot %" PRIu32 ", reset reason %d, %" PRIu32 " crashes", boots, (int)reason, crashes);
+}
+
+esp_zb_attribute_list_t *diag_cluster_create(void)
+{
+    esp_zb_attribute_list_t *cluster = esp_zb_zcl_attr_list_create(DIAG_CLUSTER_ID);
+    uint32_t zero = 0;
+
+    for (uint16_t id = DIAG_ATTR_COMMANDS_ID; id <= DIAG_ATTR_JOIN_ATTEMPTS_ID; id++) {
+        if (id == DIAG_ATTR_RESET_REASON_ID) {
+            esp_zb_custom_cluster_add_custom_attr(cluster, id, ESP_ZB_ZCL_ATTR_TYPE_8BIT_ENUM,
+                ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &reset_reason);
+            continue;
+        }
+        esp_zb_custom_cluster_add_custom_attr(cluster, id, ESP_ZB_ZCL_ATTR_TYPE_U32,
+            ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero);
+    }
+    for (uint16_t i = 0; i < DIAG_LATENCY_BUCKETS; i++) {
+        esp_zb_custom_cluster_add_custom_attr(cluster, DIAG_ATTR_LATENCY_ID + i, ESP_ZB_ZCL_ATTR_TYPE_U32,
+            ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero);
+    }
+    for (uint16_t id = DIAG_ATTR_OTA_STACK_ID; id <= DIAG_ATTR_TIME_MIN_FREQ_ID; id++) {
+        esp_zb_custom_cluster_add_custom_attr(cluster, id, ESP_ZB_ZCL_ATTR_TYPE_U32,
+            ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero);
+    }
+    return cluster;
+}
+
+static void set_attribute(uint16_t attr_id, uint32_t value)
+{
+    esp_zb_zcl_set_attribute_val(HA_ESP_LIGHT_ENDPOINT, DIAG_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, attr_id, &value, false);
+}
+
+static uint32_t stack_high_water_mark(const char *name)
+{
+    TaskHandle_t task = xTaskGetHandle(name);
+    return task ? uxTaskGetStackHighWaterMark(task) : 0;
+}
+
+static void diag_refresh(uint8_t param)
+{
+    int64_t now_us = esp_timer_get_time();
+    light_control_stats_t light_stats;
+    power_stats_t power_stats;
+    uint32_t ota_bytes = atomic_load_explicit(&counters[DIAG_OTA_BYTES], memory_order_relaxed);
+    uint32_t ota_rate = ota_refresh_us ? (uint64_t)(ota_bytes - ota_bytes_last) * 1000000 / (now_us - ota_refresh_us) : 0;
+
+    ota_bytes_last = ota_bytes;
+    ota_refresh_us = now_us;
+
+    // Runs in the Zigbee task, no lock needed
+    set_attribute(DIAG_ATTR_COMMANDS_ID, atomic_load_explicit(&counters[DIAG_COMMANDS], memory_order_relaxed));
+    set_attribute(DIAG_ATTR_NVS_COMMITS_ID, atomic_load_explicit(&counters[DIAG_NVS_COMMITS], memory_order_relaxed));
+    set_attribute(DIAG_ATTR_REPORTS_ID, atomic_load_explicit(&counters[DIAG_REPORTS], memory_order_relaxed));
+    set_attribute(DIAG_ATTR_OTA_RATE_ID, ota_rate);
+    set_attribute(DIAG_ATTR_MIN_FREE_HEAP_ID, esp_get_minimum_free_heap_size());
+    set_attribute(DIAG_ATTR_ZIGBEE_STACK_ID, stack_high_water_mark("Zigbee_main"));
+    set_attribute(DIAG_ATTR_LIGHT_STACK_ID, stack_high_water_mark("Light_control"));
+    set_attribute(DIAG_ATTR_BOOTS_ID, boots);
+    set_attribute(DIAG_ATTR_CRASHES_ID, crashes);
+    set_attribute(DIAG_ATTR_CHANGES_TO_DEVICES_ID, atomic_load_explicit(&counters[DIAG_CHANGES_TO_DEVICES], memory_order_relaxed));
+    set_attribute(DIAG_ATTR_CHANGES_TO_GROUPS_ID, atomic_load_explicit(&counters[DIAG_CHANGES_TO_GROUPS], memory_order_relaxed));
+    set_attribute(DIAG_ATTR_CHANGES_TO_COORDINATOR_ID, atomic_load_explicit(&counters[DIAG_CHANGES_TO_COORDINATOR], memory_order_relaxed));
+    set_attribute(DIAG_ATTR_LIGHT_ON_ID, light_on_ms);
+    set_attribute(DIAG_ATTR_JOIN_TIME_ID, join_ms);
+    set_attribute(DIAG_ATTR_JOIN_ATTEMPTS_ID, join_attempts);
+    for (uint16_t i = 0; i < DIAG_LATENCY_BUCKETS; i++)
+        set_attribute(DIAG_ATTR_LATENCY_ID + i, atomic_load_explicit(&latency[i], memory_order_relaxed));
+    set_attribute(DIAG_ATTR_OTA_STACK_ID, stack_high_water_mark("OTA_writer"));
+    set_attribute(DIAG_ATTR_STATE_WRITES_AVOIDED_ID, atomic_load_explicit(&counters[DIAG_STATE_WRITES_AVOIDED], memory_order_relaxed));
+    set_attribute(DIAG_ATTR_STATE_BYTES_ID, atomic_load_explicit(&counters[DIAG_STATE_BYTES_WRITTEN], memory_order_relaxed));
+
+    light_control_get_stats(&light_stats);
+    set_attribute(DIAG_ATTR_QUEUE_DEPTH_ID, light_stats.queue_depth);
+    set_attribute(DIAG_ATTR_QUEUE_DEPTH_MAX_ID, light_stats.queue_depth_max);
+    set_attribute(DIAG_ATTR_COALESCED_ID, light_stats.coalesced);
+    set_attribute(DIAG_ATTR_DROPPED_ID, light_stats.dropped);
+    set_attribute(DIAG_ATTR_OTA_STALL_MAX_ID, ota_max_stall_us);
+    set_attribute(DIAG_ATTR_OTA_THROUGHPUT_ID, ota_throughput);
+
+    power_get_stats(&power_stats);
+    set_attribute(DIAG_ATTR_TIME_MAX_FREQ_ID, power_stats.time_max_us / 1000000);
+    set_attribute(DIAG_ATTR_TIME_MIN_FREQ_ID, power_stats.time_min_us / 1000000);
+
+    esp_zb_scheduler_alarm(diag_refresh, 0, DIAG_REFRESH_MS);
+}
+
+void diag_start(void)
+{
+    esp_zb_scheduler_alarm_cancel(diag_refresh, 0);
+    diag_refresh(0);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <ha/esp_zigbee_ha_standard.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Manufacturer-specific diagnostics cluster on HA_ESP_LIGHT_ENDPOINT, all attributes read-only */
+#define DIAG_CLUSTER_ID                 0xFC00
+
+#define DIAG_ATTR_COMMANDS_ID           0x0000  // u32, attribute writes handled
+#define DIAG_ATTR_NVS_COMMITS_ID        0x0001  // u32
+#define DIAG_ATTR_REPORTS_ID            0x0002  // u32, changes of reported attributes
+#define DIAG_ATTR_OTA_RATE_ID           0x0003  // u32, OTA bytes/s over the last refresh interval
+#define DIAG_ATTR_MIN_FREE_HEAP_ID      0x0004  // u32, bytes
+#define DIAG_ATTR_ZIGBEE_STACK_ID       0x0005  // u32, stack high-water mark of Zigbee_main, bytes
+#define DIAG_ATTR_LIGHT_STACK_ID        0x0006  // u32, stack high-water mark of Light_control, bytes
+#define DIAG_ATTR_RESET_REASON_ID       0x0007  // 8-bit enum, esp_reset_reason_t of this boot
+#define DIAG_ATTR_BOOTS_ID              0x0008  // u32, since the counters were created
+#define DIAG_ATTR_CRASHES_ID            0x0009  // u32, boots after a panic, watchdog or brownout
+// The reporting engine doesn't tell what it sends, these count what it is handed:
+// reported attribute changes times the bindings of their cluster at the time
+#define DIAG_ATTR_CHANGES_TO_DEVICES_ID 0x000A  // u32, changes x bound devices
+#define DIAG_ATTR_CHANGES_TO_GROUPS_ID  0x000B  // u32, changes x bound groups
+#define DIAG_ATTR_CHANGES_TO_COORDINATOR_ID 0x000C // u32, changes of clusters nobody is bound to
+#define DIAG_ATTR_LIGHT_ON_ID           0x000D  // u32, power-on to PWM output of this boot, ms
+#define DIAG_ATTR_JOIN_TIME_ID          0x000E  // u32, boot or leave to the last (re)join, ms
+#define DIAG_ATTR_JOIN_ATTEMPTS_ID      0x000F  // u32, failed commissioning attempts before it
+#define DIAG_ATTR_LATENCY_ID            0x0010  // u32 each, command to PWM latency histogram:
+#define DIAG_LATENCY_BUCKETS            8       // < 1 ms, < 2 ms, ... < 64 ms, longer
+#define DIAG_ATTR_OTA_STACK_ID          0x0018  // u32, stack high-water mark of OTA_writer, bytes, 0 before the first OTA
+#define DIAG_ATTR_STATE_WRITES_AVOIDED_ID 0x0019 // u32, light state changes merged into a pending write
+#define DIAG_ATTR_STATE_BYTES_ID        0x001A  // u32, light state bytes written to NVS
+#define DIAG_ATTR_QUEUE_DEPTH_ID        0x001B  // u32, light commands waiting at the refresh
+#define DIAG_ATTR_QUEUE_DEPTH_MAX_ID    0x001C  // u32, most light commands waiting at once
+#define DIAG_ATTR_COALESCED_ID          0x001D  // u32, light commands superseded by a newer one
+#define DIAG_ATTR_DROPPED_ID            0x001E  // u32, scene commands lost to a full queue
+#define DIAG_ATTR_OTA_STALL_MAX_ID      0x001F  // u32, longest OTA block callback of the last download, us
+#define DIAG_ATTR_OTA_THROUGHPUT_ID     0x0020  // u32, OTA bytes/s of the last download, from its start
+#define DIAG_ATTR_TIME_MAX_FREQ_ID      0x0021  // u32, time at the maximum CPU frequency since boot, s
+#define DIAG_ATTR_TIME_MIN_FREQ_ID      0x0022  // u32, time at the minimum CPU frequency since boot, s
+
+typedef enum {
+    DIAG_COMMANDS,
+    DIAG_NVS_COMMITS,
+    DIAG_STATE_WRITES_AVOIDED,
+    DIAG_STATE_BYTES_WRITTEN,
+    DIAG_REPORTS,
+    DIAG_OTA_BYTES,
+    DIAG_CHANGES_TO_DEVICES,
+    DIAG_CHANGES_TO_GROUPS,
+    DIAG_CHANGES_TO_COORDINATOR,
+    DIAG_COUNTER_MAX,
+} diag_counter_t;
+
+/* Take the boot counters and the reset reason, call after light_restore_state() */
+void diag_init(void);
+
+/* Lock-free, safe to call from any task */
+void diag_count(diag_counter_t counter, uint32_t value);
+
+void diag_latency(uint32_t latency_us);
+
+/* Record how long after power-on the light came on */
+void diag_light_on(uint32_t light_on_ms);
+
+/* Record the longest OTA block callback and the download rate so far, in the Zigbee task */
+void diag_ota_progress(uint32_t max_stall_us, uint32_t bytes_per_s);
+
+/* Record how long joining or rejoining the network took */
+void diag_network_joined(uint32_t join_ms, uint32_t attempts);
+
+/* Create the cluster attributes, in the Zigbee task */
+esp_zb_attribute_list_t *diag_cluster_create(void);
+
+/* Refresh the attributes periodically, in the Zigbee task once the device is on a network.
+ * Restarts a running refresh. */
+void diag_start(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,158 @@
+#include "effect.h"
+#include "light_control.h"
+#include "light_driver.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define EFFECT_HIGH_LEVEL       254
+#define EFFECT_LOW_LEVEL        1
+
+typedef struct {
+    uint8_t level;              // 0 is off
+    uint16_t fade_ms;           // hardware fade to the level
+    uint16_t duration_ms;       // until the next segment, including the fade
+} effect_segment_t;
+
+typedef struct {
+    uint8_t id;
+    const effect_segment_t *segments;
+    uint8_t count;
+    uint8_t cycles;             // 0 repeats until stopped
+} effect_t;
+
+static const effect_segment_t blink_segments[] = {
+    { EFFECT_HIGH_LEVEL, 0, 500 },
+    { 0, 0, 500 },
+};
+
+static const effect_segment_t breathe_segments[] = {
+    { EFFECT_HIGH_LEVEL, 1000, 1000 },
+    { 0, 1000, 1000 },
+};
+
+static const effect_segment_t okay_segments[] = {
+    { EFFECT_HIGH_LEVEL, 0, 250 },
+    { 0, 0, 250 },
+};
+
+// No orange on a CW/WW light: high for 0.5 s, then low for 7.5 s
+static const effect_segment_t channel_change_segments[] = {
+    { EFFECT_HIGH_LEVEL, 0, 500 },
+    { EFFECT_LOW_LEVEL, 0, 7500 },
+};
+
+#define SEGMENTS(segments)      segments, sizeof(segments) / sizeof(segments[0])
+
+static const effect_t effects[] = {
+    { EFFECT_BLINK, SEGMENTS(blink_segments), 1 },
+    { EFFECT_BREATHE, SEGMENTS(breathe_segments), 15 },
+    { EFFECT_OKAY, SEGMENTS(okay_segments), 2 },
+    { EFFECT_CHANNEL_CHANGE, SEGMENTS(channel_change_segments), 1 },
+    { EFFECT_IDENTIFY, SEGMENTS(blink_segments), 0 },
+};
+
+typedef struct {
+    esp_timer_handle_t timer;
+    const effect_t *current;
+    uint8_t segment;
+    uint8_t cycle;
+    bool finishing;
+    int64_t next_segment_us;
+} effect_state_t;
+
+static effect_state_t states[LIGHT_ZONES];
+
+static void effect_timer_callback(void *arg)
+{
+    light_control_wake_effect((uintptr_t)arg);
+}
+
+static void play_segment(uint8_t zone)
+{
+    effect_state_t *state = &states[zone];
+    const effect_segment_t *s = &state->current->segments[state->segment];
+
+    light_effect_output(zone, s->level, s->fade_ms);
+    state->next_segment_us = esp_timer_get_time() + s->duration_ms * 1000;
+    ESP_ERROR_CHECK(esp_timer_start_once(state->timer, s->duration_ms * 1000));
+}
+
+static void end_effect(uint8_t zone)
+{
+    effect_state_t *state = &states[zone];
+
+    esp_timer_stop(state->timer);
+    ESP_LOGI(TAG, "Zone %d effect 0x%02x ended", (int)zone, state->current->id);
+    state->current = NULL;
+    light_effect_restore(zone);
+}
+
+void effect_init(void)
+{
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        esp_timer_create_args_t timer_cfg = {
+            .callback = effect_timer_callback,
+            .arg = (void *)(uintptr_t)zone,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "Effect timer",
+            .skip_unhandled_events = true
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_cfg, &states[zone].timer));
+    }
+}
+
+void effect_trigger(uint8_t zone, uint8_t effect_id)
+{
+    effect_state_t *state = &states[zone];
+
+    if (effect_id == EFFECT_FINISH) {
+        state->finishing = true;
+        return;
+    }
+    if (effect_id == EFFECT_STOP) {
+        if (state->current)
+            end_effect(zone);
+        return;
+    }
+
+    const effect_t *effect = NULL;
+    for (size_t i = 0; i < sizeof(effects) / sizeof(effects[0]); i++) {
+        if (effects[i].id == effect_id)
+            effect = &effects[i];
+    }
+    if (!effect) {
+        ESP_LOGW(TAG, "Effect 0x%02x not supported", effect_id);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Zone %d effect 0x%02x started", (int)zone, effect_id);
+    esp_timer_stop(state->timer);
+    state->current = effect;
+    state->segment = 0;
+    state->cycle = 0;
+    state->finishing = false;
+    play_segment(zone);
+}
+
+void effect_step(uint8_t zone)
+{
+    effect_state_t *state = &states[zone];
+
+    // A wakeup from the timer of an effect that has been replaced since
+    if (!state->current || esp_timer_get_time() < state->next_segment_us)
+        return;
+
+    if (++state->segment == state->current->count) {
+        state->segment = 0;
+        if (state->finishing || (state->current->cycles && ++state->cycle == state->current->cycles)) {
+            end_effect(zone);
+            return;
+        }
+    }
+    play_segment(zone);
+}
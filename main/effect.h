@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Identify and Trigger Effect sequences, played as LEDC hardware fade segments.
+ * Runs in the light-control task, a timer only wakes it for the next segment.
+ * The light state is left untouched and shown again when the effect ends.
+ * Each zone plays its own effect, as Identify and Trigger Effect are per endpoint.
+ */
+
+/* Trigger Effect identifiers */
+#define EFFECT_BLINK                    0x00
+#define EFFECT_BREATHE                  0x01
+#define EFFECT_OKAY                     0x02
+#define EFFECT_CHANNEL_CHANGE           0x0B
+#define EFFECT_FINISH                   0xFE    // end after the current cycle
+#define EFFECT_STOP                     0xFF    // end now
+
+/* Not on air: blink until stopped, while IdentifyTime counts down */
+#define EFFECT_IDENTIFY                 0x80
+
+void effect_init(void);
+
+/* Start, finish or stop the effect of a zone. Light-control task only. */
+void effect_trigger(uint8_t zone, uint8_t effect_id);
+
+/* Play the next segment of the zone once the current one is over. Light-control task only. */
+void effect_step(uint8_t zone);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
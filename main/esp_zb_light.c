@@ -7,13 +7,20 @@
 #include "driver/gpio.h"
 #include "zboss_api.h"
 
+#include "diag.h"
+#include "effect.h"
+#include "light_control.h"
 #include "light_driver.h"
+#include "network.h"
 #include "ota.h"
+#include "power.h"
+#include "report.h"
 
 /* Zigbee configuration */
 #define INSTALLCODE_POLICY_ENABLE       false   /* enable the install code policy for security */
-#define ESP_ZB_PRIMARY_CHANNEL_MASK     ESP_ZB_TRANSCEIVER_ALL_CHANNELS_MASK  /* Zigbee primary channel mask use in the example */
 #define MAX_CHILDREN                    10      /* the max amount of connected devices */
+#define ZIGBEE_TASK_STACK_SIZE          4096
+#define ZIGBEE_TASK_PRIORITY            5
 
 #define OTA_UPGRADE_MANUFACTURER        0x1001                                /* The attribute indicates the file version of the downloaded image on the device*/
 #define OTA_UPGRADE_IMAGE_TYPE          0x1011                                /* The attribute indicates the value for the manufacturer of the device */
@@ -31,18 +38,14 @@ static char firmware_version[16];
 
 esp_timer_handle_t timer_handle;
 
-static bool connected = false;
+static StackType_t zigbee_task_stack[ZIGBEE_TASK_STACK_SIZE];
+static StaticTask_t zigbee_task_tcb;
 
 #define LED_COMMISSION GPIO_NUM_8
 
-static void esp_error_blink(void *pvParameters) {
-    for (int i = 0; i < 5; i++) {
-        gpio_set_level(LED_COMMISSION, 1);
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
-        gpio_set_level(LED_COMMISSION, 0);
-    }
-    esp_restart();
-}
+#define ZDO_PROFILE_ID                  0x0000
+#define ZDO_BIND_REQ_CLUSTER_ID         0x0021
+#define ZDO_UNBIND_REQ_CLUSTER_ID       0x0022
 
 static void bdb_start_top_level_commissioning_cb(uint8_t mode_mask)
 {
@@ -66,7 +69,11 @@ void esp_zb_app_signal_handler(esp_zb_app_signal_t *signal_struct)
         leave_params = (esp_zb_zdo_signal_leave_params_t *)esp_zb_app_signal_get_params(p_sg_p);
         if (leave_params->leave_type == ESP_ZB_NWK_LEAVE_TYPE_RESET) {
             ESP_LOGI(TAG, "Reset device");
-            esp_zb_factory_reset();
+            network_left();
+            report_stop();
+            // The light-control task forgets the scenes first, it owns them
+            if (!light_control_post(0, LIGHT_CMD_FACTORY_RESET, 0, 0))
+                esp_zb_factory_reset();
         }
         break;
 
@@ -76,20 +83,22 @@ void esp_zb_app_signal_handler(esp_zb_app_signal_t *signal_struct)
         if (err_status == ESP_OK) {
             ESP_LOGI(TAG, "Device started up in %s factory-reset mode", esp_zb_bdb_is_factory_new() ? "" : "non");
             if (esp_zb_bdb_is_factory_new()) {
-                light_set_defaults();
+                light_control_post(0, LIGHT_CMD_SET_DEFAULTS, 0, 0);
                 ESP_LOGI(TAG, "Start network steering");
                 esp_zb_bdb_start_top_level_commissioning(ESP_ZB_BDB_MODE_NETWORK_STEERING);
             } else {
                 gpio_set_level(LED_COMMISSION, 1);
-                light_load_settings();
+                light_control_post(0, LIGHT_CMD_LOAD_SETTINGS, 0, 0);
                 ESP_LOGI(TAG, "Device rebooted");
+                network_joined();
+                diag_start();
+                report_start();
             }
-            connected = true;
         } else {
             /* commissioning failed */
             ESP_LOGW(TAG, "Failed to initialize Zigbee stack (status: %s)", esp_err_to_name(err_status));
-            xTaskCreate(esp_error_blink, "error task", 4096, NULL, 5, NULL);
-            connected = false;
+            esp_zb_scheduler_alarm((esp_zb_callback_t)bdb_start_top_level_commissioning_cb, ESP_ZB_BDB_MODE_INITIALIZATION,
+                network_retry_delay_ms());
         }
         break;
 
@@ -102,11 +111,13 @@ void esp_zb_app_signal_handler(esp_zb_app_signal_t *signal_struct)
                 extended_pan_id[7], extended_pan_id[6], extended_pan_id[5], extended_pan_id[4],
                 extended_pan_id[3], extended_pan_id[2], extended_pan_id[1], extended_pan_id[0],
                 esp_zb_get_pan_id(), esp_zb_get_current_channel(), esp_zb_get_short_address());
-            connected = true;
+            network_joined();
+            diag_start();
+            report_start();
         } else {
             ESP_LOGI(TAG, "Network steering was not successful (status: %s)", esp_err_to_name(err_status));
-            esp_zb_scheduler_alarm((esp_zb_callback_t)bdb_start_top_level_commissioning_cb, ESP_ZB_BDB_MODE_NETWORK_STEERING, 1000);
-            connected = false;
+            esp_zb_scheduler_alarm((esp_zb_callback_t)bdb_start_top_level_commissioning_cb, ESP_ZB_BDB_MODE_NETWORK_STEERING,
+                network_retry_delay_ms());
         }
         break;
 
@@ -124,44 +135,61 @@ static esp_err_t zb_attribute_handler(const esp_zb_zcl_set_attr_value_message_t
     ESP_RETURN_ON_FALSE(message, ESP_FAIL, TAG, "Empty message");
     ESP_RETURN_ON_FALSE(message->info.status == ESP_ZB_ZCL_STATUS_SUCCESS, ESP_ERR_INVALID_ARG, TAG, "Received message: error status(%d)",
                         message->info.status);
+    diag_count(DIAG_COMMANDS, 1);
     ESP_LOGI(TAG, "Received message: endpoint(%d), cluster(0x%x), attribute(0x%x), data size(%d), data type(%d)", message->info.dst_endpoint,
         message->info.cluster, message->attribute.id, message->attribute.data.size, message->attribute.data.type);
 
-    if (message->info.dst_endpoint == HA_ESP_LIGHT_ENDPOINT) {
+    int zone = light_zone_from_endpoint(message->info.dst_endpoint);
+    if (zone >= 0) {
         switch (message->info.cluster) {
-        case ESP_ZB_ZCL_CLUSTER_ID_IDENTIFY:
-            ESP_LOGI(TAG, "Identify pressed");
+        case ESP_ZB_ZCL_CLUSTER_ID_BASIC:
+            if (message->attribute.id == POWER_ATTR_PROFILE_ID
+                && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_8BIT_ENUM
+                && message->attribute.data.value != NULL)
+                    power_set_profile(*(uint8_t *)message->attribute.data.value);
             break;
 
         case ESP_ZB_ZCL_CLUSTER_ID_ON_OFF:
             if (message->attribute.id == ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID
                 && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_BOOL
                 && message->attribute.data.value != NULL)
-                    light_set_on_off(*(bool *)message->attribute.data.value);
+                    light_control_post(zone, LIGHT_CMD_ON_OFF, *(bool *)message->attribute.data.value, 0);
 
             if (message->attribute.id == ESP_ZB_ZCL_ATTR_ON_OFF_START_UP_ON_OFF
                 && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_8BIT_ENUM
                 && message->attribute.data.value != NULL)
-                    light_set_startup_on_off(*(uint8_t *)message->attribute.data.value);
+                    light_control_post(zone, LIGHT_CMD_STARTUP_ON_OFF, *(uint8_t *)message->attribute.data.value, 0);
             break;
 
         case ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL:
             if (message->attribute.id == ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_CURRENT_LEVEL_ID
                 && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_U8
                 && message->attribute.data.value != NULL)
-                    light_set_level(*(uint8_t *)message->attribute.data.value);
+                    light_control_post(zone, LIGHT_CMD_LEVEL, *(uint8_t *)message->attribute.data.value, 0);
+
+            if (message->attribute.id == ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_ON_OFF_TRANSITION_TIME_ID
+                && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_U16
+                && message->attribute.data.value != NULL)
+                    light_control_post(zone, LIGHT_CMD_ON_OFF_TRANSITION_TIME, *(uint16_t *)message->attribute.data.value, 0);
             break;
 
         case ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL:
             if (message->attribute.id == ESP_ZB_ZCL_ATTR_COLOR_CONTROL_COLOR_TEMPERATURE_ID
                 && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_U16
                 && message->attribute.data.value != NULL)
-                    light_set_temperature(*(uint16_t *)message->attribute.data.value);
+                    light_control_post(zone, LIGHT_CMD_TEMPERATURE, *(uint16_t *)message->attribute.data.value, 0);
 
             if (message->attribute.id == ESP_ZB_ZCL_ATTR_COLOR_CONTROL_START_UP_COLOR_TEMPERATURE_MIREDS_ID
                 && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_U16
                 && message->attribute.data.value != NULL)
-                    light_set_startup_temperature(*(uint16_t *)message->attribute.data.value);
+                    light_control_post(zone, LIGHT_CMD_STARTUP_TEMPERATURE, *(uint16_t *)message->attribute.data.value, 0);
+
+            if (message->attribute.id == LIGHT_ATTR_CALIBRATION_ID
+                && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING
+                && message->attribute.data.value != NULL) {
+                    const uint8_t *value = message->attribute.data.value;
+                    light_control_post_calibration(value + 1, value[0]);
+            }
             break;
         }
     }
@@ -169,6 +197,157 @@ static esp_err_t zb_attribute_handler(const esp_zb_zcl_set_attr_value_message_t
     return ret;
 }
 
+static uint16_t get_u16(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+// Transition time of the Recall Scene being processed by the stack, 0xFFFF for the scene's own
+static uint16_t recall_transition_time[LIGHT_ZONES] = { [0 ... LIGHT_ZONES - 1] = 0xFFFF };
+
+// The stack rejects scene commands for groups the endpoint is not a member of
+static bool scene_group_valid(uint16_t group_id, uint8_t endpoint)
+{
+    return group_id == 0 || zb_aps_is_endpoint_in_group(group_id, endpoint);
+}
+
+// Add Scene: group ID, scene ID, transition time, name, then extension field sets
+// of cluster ID, length and the attribute values in the order of the cluster
+static bool parse_add_scene(const uint8_t *payload, uint32_t size, light_scene_fields_t *fields)
+{
+    if (size < 6 || 6 + payload[5] > size)
+        return false;
+
+    *fields = (light_scene_fields_t) { 0 };
+    for (uint32_t offset = 6 + payload[5]; offset < size; ) {
+        if (offset + 3 > size || offset + 3 + payload[offset + 2] > size)
+            return false;
+
+        uint16_t cluster_id = get_u16(payload + offset);
+        uint8_t length = payload[offset + 2];
+        const uint8_t *values = payload + offset + 3;
+        switch (cluster_id) {
+        case ESP_ZB_ZCL_CLUSTER_ID_ON_OFF:
+            if (length >= 1) {
+                fields->has_power = true;
+                fields->power = values[0] != 0;
+            }
+            break;
+        case ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL:
+            if (length >= 1) {
+                fields->has_level = true;
+                fields->level = values[0];
+            }
+            break;
+        case ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL:
+            // After CurrentX, CurrentY, EnhancedCurrentHue, CurrentSaturation and the colour loop
+            if (length >= 13) {
+                fields->has_temperature = true;
+                fields->temperature = get_u16(values + 11);
+            }
+            break;
+        }
+        offset += 3 + length;
+    }
+    return true;
+}
+
+static bool zb_raw_command_handler(uint8_t bufid)
+{
+    zb_zcl_parsed_hdr_t *cmd_info = ZB_BUF_GET_PARAM(bufid, zb_zcl_parsed_hdr_t);
+    const uint8_t *payload = zb_buf_begin(bufid);
+    uint32_t payload_size = zb_buf_len(bufid);
+
+    uint8_t endpoint = ZB_ZCL_PARSED_HDR_SHORT_DATA(cmd_info).dst_endpoint;
+    int zone = light_zone_from_endpoint(endpoint);
+    if (cmd_info->is_common_command || zone < 0)
+        return false;
+
+    // Only peek at the transition time, the stack still processes the command
+    switch (cmd_info->cluster_id) {
+    case ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL:
+        if ((cmd_info->cmd_id == ZB_ZCL_CMD_LEVEL_CONTROL_MOVE_TO_LEVEL
+                || cmd_info->cmd_id == ZB_ZCL_CMD_LEVEL_CONTROL_MOVE_TO_LEVEL_WITH_ON_OFF)
+                && payload_size >= 3 && payload[0] != 0xFF)     // 0xFF is not a valid level
+            light_control_post(zone, LIGHT_CMD_MOVE_TO_LEVEL, payload[0], get_u16(payload + 1));
+        break;
+
+    case ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL:
+        if (cmd_info->cmd_id == ZB_ZCL_CMD_COLOR_CONTROL_MOVE_TO_COLOR_TEMPERATURE
+                && payload_size >= 4)
+            light_control_post(zone, LIGHT_CMD_MOVE_TO_TEMPERATURE, get_u16(payload), get_u16(payload + 2));
+        break;
+
+    // The stack keeps the scene table and answers, the driver keeps a snapshot of the light.
+    // Store and Recall are acted on from their callbacks, once the stack accepted them.
+    case ESP_ZB_ZCL_CLUSTER_ID_SCENES:
+        switch (cmd_info->cmd_id) {
+        case ZB_ZCL_CMD_SCENES_RECALL_SCENE:
+            // The transition time is optional, 0xFFFF uses the scene's own
+            recall_transition_time[zone] = payload_size >= 5 ? get_u16(payload + 3) : 0xFFFF;
+            break;
+        case ZB_ZCL_CMD_SCENES_ADD_SCENE:
+        case ZB_ZCL_CMD_SCENES_ENHANCED_ADD_SCENE: {
+            // The snapshot is made from the extension fields, with the scene's own transition
+            // time: seconds for Add Scene, 1/10 s for Enhanced Add Scene
+            light_scene_fields_t fields;
+            if (parse_add_scene(payload, payload_size, &fields) && scene_group_valid(get_u16(payload), endpoint)) {
+                uint32_t transition_time = get_u16(payload + 3);
+                if (cmd_info->cmd_id == ZB_ZCL_CMD_SCENES_ADD_SCENE)
+                    transition_time = transition_time * 10 < 0xFFFF ? transition_time * 10 : 0xFFFE;
+                light_control_post_add_scene(zone, get_u16(payload), payload[2], &fields, transition_time);
+            }
+            break;
+        }
+        case ZB_ZCL_CMD_SCENES_REMOVE_SCENE:
+            if (payload_size >= 3 && scene_group_valid(get_u16(payload), endpoint))
+                light_control_post_scene(zone, LIGHT_CMD_REMOVE_SCENE, get_u16(payload), payload[2], 0);
+            break;
+        case ZB_ZCL_CMD_SCENES_REMOVE_ALL_SCENES:
+            if (payload_size >= 2 && scene_group_valid(get_u16(payload), endpoint))
+                light_control_post_scene(zone, LIGHT_CMD_REMOVE_GROUP_SCENES, get_u16(payload), 0, 0);
+            break;
+        }
+        break;
+    }
+
+    return false;
+}
+
+// Only peek at binding changes, the stack still handles the request
+static bool zb_aps_data_indication_handler(esp_zb_apsde_data_ind_t ind)
+{
+    if (ind.profile_id == ZDO_PROFILE_ID
+            && (ind.cluster_id == ZDO_BIND_REQ_CLUSTER_ID || ind.cluster_id == ZDO_UNBIND_REQ_CLUSTER_ID))
+        report_bindings_changed();
+    return false;
+}
+
+static void identify_zone(uint8_t zone, uint8_t identify_on)
+{
+    ESP_LOGI(TAG, "Zone %d identify %s", (int)zone, identify_on ? "started" : "stopped");
+    light_control_post(zone, LIGHT_CMD_EFFECT, identify_on ? EFFECT_IDENTIFY : EFFECT_STOP, 0);
+}
+
+// The identify notification doesn't say which endpoint it is for
+static void zb_identify_handler_1(uint8_t identify_on) { identify_zone(0, identify_on); }
+#if LIGHT_ZONES > 1
+static void zb_identify_handler_2(uint8_t identify_on) { identify_zone(1, identify_on); }
+#endif
+#if LIGHT_ZONES > 2
+static void zb_identify_handler_3(uint8_t identify_on) { identify_zone(2, identify_on); }
+#endif
+
+static const esp_zb_identify_notify_callback_t identify_handlers[LIGHT_ZONES] = {
+    zb_identify_handler_1,
+#if LIGHT_ZONES > 1
+    zb_identify_handler_2,
+#endif
+#if LIGHT_ZONES > 2
+    zb_identify_handler_3,
+#endif
+};
+
 static esp_err_t zb_action_handler(esp_zb_core_action_callback_id_t callback_id, const void *message)
 {
     esp_err_t ret = ESP_OK;
@@ -177,6 +356,35 @@ static esp_err_t zb_action_handler(esp_zb_core_action_callback_id_t callback_id,
         ret = zb_attribute_handler((esp_zb_zcl_set_attr_value_message_t *)message);
         break;
 
+    case ESP_ZB_CORE_SCENES_STORE_SCENE_CB_ID: {
+        const esp_zb_zcl_store_scene_message_t *store = message;
+        int zone = light_zone_from_endpoint(store->info.dst_endpoint);
+        if (zone >= 0 && store->info.status == ESP_ZB_ZCL_STATUS_SUCCESS)
+            light_control_post_scene(zone, LIGHT_CMD_STORE_SCENE, store->group_id, store->scene_id, 0);
+        break;
+    }
+
+    case ESP_ZB_CORE_SCENES_RECALL_SCENE_CB_ID: {
+        const esp_zb_zcl_recall_scene_message_t *recall = message;
+        int zone = light_zone_from_endpoint(recall->info.dst_endpoint);
+        if (zone >= 0 && recall->info.status == ESP_ZB_ZCL_STATUS_SUCCESS) {
+            light_control_post_scene(zone, LIGHT_CMD_RECALL_SCENE, recall->group_id, recall->scene_id,
+                recall_transition_time[zone]);
+            recall_transition_time[zone] = 0xFFFF;
+        }
+        break;
+    }
+
+    case ESP_ZB_CORE_IDENTIFY_EFFECT_CB_ID: {
+        const esp_zb_zcl_identify_effect_message_t *effect = message;
+        int zone = light_zone_from_endpoint(effect->info.dst_endpoint);
+        ESP_LOGI(TAG, "Trigger effect 0x%02x, variant %d on endpoint %d", effect->effect_id, (int)effect->effect_variant,
+            effect->info.dst_endpoint);
+        if (zone >= 0)
+            light_control_post(zone, LIGHT_CMD_EFFECT, effect->effect_id, 0);
+        break;
+    }
+
     case ESP_ZB_CORE_CMD_DEFAULT_RESP_CB_ID:
         esp_zb_zcl_cmd_default_resp_message_t *msg = (esp_zb_zcl_cmd_default_resp_message_t *)message;
         if (msg->status_code != ESP_ZB_ZCL_STATUS_SUCCESS)
@@ -199,27 +407,24 @@ static void set_zcl_string(char *buffer, char *value) {
     memcpy(buffer + 1, value, buffer[0]);
 }
 
-static void esp_zb_task(void *pvParameters)
+/* The clusters of a light endpoint. The first one also carries what exists once
+ * per device: the power profile, the calibration, the OTA client and diagnostics. */
+static esp_zb_cluster_list_t *create_light_clusters(uint8_t zone)
 {
-    esp_zb_cfg_t zb_nwk_cfg = {
-        .esp_zb_role = ESP_ZB_DEVICE_TYPE_ROUTER,
-        .install_code_policy = INSTALLCODE_POLICY_ENABLE,
-        .nwk_cfg.zczr_cfg = { .max_children = MAX_CHILDREN }
-    };
-    esp_zb_init(&zb_nwk_cfg);
-
     esp_zb_color_dimmable_light_cfg_t light_cfg = ESP_ZB_DEFAULT_COLOR_DIMMABLE_LIGHT_CONFIG();
     light_cfg.basic_cfg.power_source = ZB_ZCL_BASIC_POWER_SOURCE_DC_SOURCE;
     light_cfg.color_cfg.color_mode = ZB_ZCL_COLOR_CONTROL_COLOR_MODE_TEMPERATURE;
     light_cfg.color_cfg.color_capabilities = ZB_ZCL_COLOR_CONTROL_CAPABILITIES_COLOR_TEMP;
 
     esp_zb_attribute_list_t *esp_zb_basic_cluster = esp_zb_basic_cluster_create(&light_cfg.basic_cfg);
-    set_zcl_string(model_id, MODEL_NAME);
-    set_zcl_string(manufacturer_name, MANUFACTURER_NAME);
-    set_zcl_string(firmware_version, FIRMWARE_VERSION);
     esp_zb_basic_cluster_add_attr(esp_zb_basic_cluster, ESP_ZB_ZCL_ATTR_BASIC_MODEL_IDENTIFIER_ID, model_id);
     esp_zb_basic_cluster_add_attr(esp_zb_basic_cluster, ESP_ZB_ZCL_ATTR_BASIC_MANUFACTURER_NAME_ID, manufacturer_name);
     esp_zb_basic_cluster_add_attr(esp_zb_basic_cluster, ESP_ZB_ZCL_ATTR_BASIC_SW_BUILD_ID, firmware_version);
+    if (zone == 0) {
+        uint8_t power_profile = power_get_profile();
+        esp_zb_cluster_add_manufacturer_attr(esp_zb_basic_cluster, ESP_ZB_ZCL_CLUSTER_ID_BASIC, POWER_ATTR_PROFILE_ID,
+            LIGHT_MANUFACTURER_CODE, ESP_ZB_ZCL_ATTR_TYPE_8BIT_ENUM, ESP_ZB_ZCL_ATTR_ACCESS_READ_WRITE, &power_profile);
+    }
 
     esp_zb_attribute_list_t *esp_zb_identify_cluster = esp_zb_identify_cluster_create(&light_cfg.identify_cfg);
     esp_zb_attribute_list_t *esp_zb_ep_groups_cluster = esp_zb_groups_cluster_create(&light_cfg.groups_cfg);
@@ -229,7 +434,9 @@ static void esp_zb_task(void *pvParameters)
     esp_zb_attribute_list_t *esp_zb_ep_on_off_cluster = esp_zb_on_off_cluster_create(&light_cfg.on_off_cfg);
     esp_zb_on_off_cluster_add_attr(esp_zb_ep_on_off_cluster, ESP_ZB_ZCL_ATTR_ON_OFF_START_UP_ON_OFF, &default_on_off);
 
+    uint16_t default_on_off_transition_time = 0;
     esp_zb_attribute_list_t *esp_zb_ep_level_cluster = esp_zb_level_cluster_create(&light_cfg.level_cfg);
+    esp_zb_level_cluster_add_attr(esp_zb_ep_level_cluster, ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_ON_OFF_TRANSITION_TIME_ID, &default_on_off_transition_time);
 
     uint16_t default_color_temp = ESP_ZB_ZCL_COLOR_CONTROL_COLOR_TEMPERATURE_DEF_VALUE;
     uint16_t min_color_temp = 150;
@@ -239,6 +446,24 @@ static void esp_zb_task(void *pvParameters)
     esp_zb_color_control_cluster_add_attr(esp_zb_ep_color_cluster, ESP_ZB_ZCL_ATTR_COLOR_CONTROL_START_UP_COLOR_TEMPERATURE_MIREDS_ID, &default_color_temp);
     esp_zb_color_control_cluster_add_attr(esp_zb_ep_color_cluster, ESP_ZB_ZCL_ATTR_COLOR_CONTROL_COLOR_TEMP_PHYSICAL_MIN_MIREDS_ID, &min_color_temp);
     esp_zb_color_control_cluster_add_attr(esp_zb_ep_color_cluster, ESP_ZB_ZCL_ATTR_COLOR_CONTROL_COLOR_TEMP_PHYSICAL_MAX_MIREDS_ID, &max_color_temp);
+    if (zone == 0) {
+        // Sized for the largest table, the driver publishes the real one once settings are loaded
+        uint8_t calibration[1 + LIGHT_CALIBRATION_MAX_POINTS * LIGHT_CALIBRATION_POINT_SIZE] = { sizeof(calibration) - 1 };
+        esp_zb_cluster_add_manufacturer_attr(esp_zb_ep_color_cluster, ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL, LIGHT_ATTR_CALIBRATION_ID,
+            LIGHT_MANUFACTURER_CODE, ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING, ESP_ZB_ZCL_ATTR_ACCESS_READ_WRITE, calibration);
+    }
+
+    esp_zb_cluster_list_t *esp_zb_zcl_cluster_list = esp_zb_zcl_cluster_list_create();
+    esp_zb_cluster_list_add_basic_cluster(esp_zb_zcl_cluster_list, esp_zb_basic_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    esp_zb_cluster_list_add_identify_cluster(esp_zb_zcl_cluster_list, esp_zb_identify_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    esp_zb_cluster_list_add_groups_cluster(esp_zb_zcl_cluster_list, esp_zb_ep_groups_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    esp_zb_cluster_list_add_scenes_cluster(esp_zb_zcl_cluster_list, esp_zb_ep_scenes_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    esp_zb_cluster_list_add_on_off_cluster(esp_zb_zcl_cluster_list, esp_zb_ep_on_off_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    esp_zb_cluster_list_add_level_cluster(esp_zb_zcl_cluster_list, esp_zb_ep_level_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    esp_zb_cluster_list_add_color_control_cluster(esp_zb_zcl_cluster_list, esp_zb_ep_color_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+
+    if (zone != 0)
+        return esp_zb_zcl_cluster_list;
 
     /** Create ota client cluster with attributes.
      *  Manufacturer code, image type and file version should match with configured values for server.
@@ -260,48 +485,53 @@ static void esp_zb_task(void *pvParameters)
     };
     esp_zb_ota_cluster_add_attr(esp_zb_ota_client_cluster, ESP_ZB_ZCL_ATTR_OTA_UPGRADE_CLIENT_DATA_ID, &ota_variable_config);
 
-    esp_zb_cluster_list_t *esp_zb_zcl_cluster_list = esp_zb_zcl_cluster_list_create();
-    esp_zb_cluster_list_add_basic_cluster(esp_zb_zcl_cluster_list, esp_zb_basic_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
-    esp_zb_cluster_list_add_identify_cluster(esp_zb_zcl_cluster_list, esp_zb_identify_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
-    esp_zb_cluster_list_add_groups_cluster(esp_zb_zcl_cluster_list, esp_zb_ep_groups_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
-    esp_zb_cluster_list_add_scenes_cluster(esp_zb_zcl_cluster_list, esp_zb_ep_scenes_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
-    esp_zb_cluster_list_add_on_off_cluster(esp_zb_zcl_cluster_list, esp_zb_ep_on_off_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
-    esp_zb_cluster_list_add_level_cluster(esp_zb_zcl_cluster_list, esp_zb_ep_level_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
-    esp_zb_cluster_list_add_color_control_cluster(esp_zb_zcl_cluster_list, esp_zb_ep_color_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
     esp_zb_cluster_list_add_ota_cluster(esp_zb_zcl_cluster_list, esp_zb_ota_client_cluster, ESP_ZB_ZCL_CLUSTER_CLIENT_ROLE);
+    esp_zb_cluster_list_add_custom_cluster(esp_zb_zcl_cluster_list, diag_cluster_create(), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    return esp_zb_zcl_cluster_list;
+}
 
-    esp_zb_endpoint_config_t endpoint_config = {
-        .endpoint = HA_ESP_LIGHT_ENDPOINT,
-        .app_profile_id = ESP_ZB_AF_HA_PROFILE_ID,
-        .app_device_id = ESP_ZB_HA_COLOR_DIMMABLE_LIGHT_DEVICE_ID
+static void esp_zb_task(void *pvParameters)
+{
+    esp_zb_cfg_t zb_nwk_cfg = {
+        .esp_zb_role = ESP_ZB_DEVICE_TYPE_ROUTER,
+        .install_code_policy = INSTALLCODE_POLICY_ENABLE,
+        .nwk_cfg.zczr_cfg = { .max_children = MAX_CHILDREN }
     };
+    esp_zb_init(&zb_nwk_cfg);
 
+    set_zcl_string(model_id, MODEL_NAME);
+    set_zcl_string(manufacturer_name, MANUFACTURER_NAME);
+    set_zcl_string(firmware_version, FIRMWARE_VERSION);
+
+    // One endpoint per zone of the driver
     esp_zb_ep_list_t *esp_zb_ep_list = esp_zb_ep_list_create();
-    esp_zb_ep_list_add_ep(esp_zb_ep_list, esp_zb_zcl_cluster_list, endpoint_config);
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        esp_zb_endpoint_config_t endpoint_config = {
+            .endpoint = light_zone_endpoint(zone),
+            .app_profile_id = ESP_ZB_AF_HA_PROFILE_ID,
+            .app_device_id = ESP_ZB_HA_COLOR_DIMMABLE_LIGHT_DEVICE_ID
+        };
+        esp_zb_ep_list_add_ep(esp_zb_ep_list, create_light_clusters(zone), endpoint_config);
+    }
 
     esp_zb_device_register(esp_zb_ep_list);
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++)
+        esp_zb_identify_notify_handler_register(light_zone_endpoint(zone), identify_handlers[zone]);
+    light_configure_reporting();
     esp_zb_core_action_handler_register(zb_action_handler);
-    esp_zb_set_primary_network_channel_set(ESP_ZB_PRIMARY_CHANNEL_MASK);
+    esp_zb_raw_command_handler_register(zb_raw_command_handler);
+    esp_zb_aps_data_indication_handler_register(zb_aps_data_indication_handler);
+    network_init();
     ESP_ERROR_CHECK(esp_zb_start(false));
     esp_zb_main_loop_iteration();
 }
 
 void timer_callback(void *arg)
 {
-    light_boot_success();
+    light_control_boot_success();
     ESP_ERROR_CHECK(esp_timer_delete(timer_handle));
 }
 
-void update_attribute()
-{
-    while(1)
-    {
-        if (connected)
-            light_publish_state();
-        vTaskDelay(10000 / portTICK_PERIOD_MS);
-    }
-}
-
 void app_main(void)
 {
     esp_zb_platform_config_t config = {
@@ -309,6 +539,13 @@ void app_main(void)
         .host_config = { .host_connection_mode = ZB_HOST_CONNECTION_MODE_NONE },
     };
     ESP_ERROR_CHECK(nvs_flash_init());
+
+    // Light first, everything else can wait until the room is lit
+    light_init();
+    light_restore_state();
+
+    power_init();
+    diag_init();
     ESP_ERROR_CHECK(esp_zb_platform_config(&config));
 
     gpio_config_t gpio_output_config = {
@@ -320,7 +557,7 @@ void app_main(void)
     ESP_ERROR_CHECK(gpio_config(&gpio_output_config));
     gpio_set_level(LED_COMMISSION, 1);
 
-    light_init();
+    light_control_start();
 
     esp_timer_create_args_t timer_cfg = {
         .callback = timer_callback,
@@ -332,6 +569,6 @@ void app_main(void)
     ESP_ERROR_CHECK(esp_timer_create(&timer_cfg, &timer_handle));
     ESP_ERROR_CHECK(esp_timer_start_once(timer_handle, 5000000));
 
-    xTaskCreate(update_attribute, "Update_attribute_value", 4096, NULL, 5, NULL);
-    xTaskCreate(esp_zb_task, "Zigbee_main", 4096, NULL, 5, NULL);
+    xTaskCreateStatic(esp_zb_task, "Zigbee_main", ZIGBEE_TASK_STACK_SIZE, NULL, ZIGBEE_TASK_PRIORITY,
+        zigbee_task_stack, &zigbee_task_tcb);
 }
@@ -0,0 +1,395 @@
+#include "light_control.h"
+#include "diag.h"
+#include "effect.h"
+#include "light_driver.h"
+
+#include <stdatomic.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define LIGHT_QUEUE_SIZE        32      // power of two
+#define LIGHT_TASK_STACK_SIZE   4096
+#define LIGHT_TASK_PRIORITY     5       // same as Zigbee_main, so a burst is queued before it is handled
+
+typedef struct {
+    light_command_type_t type;
+    uint8_t zone;
+    uint16_t value;
+    uint16_t transition_time;
+    uint8_t scene_id;
+    light_scene_fields_t scene_fields;      // LIGHT_CMD_ADD_SCENE
+    int64_t received_us;
+} light_command_t;
+
+// Lock-free single-producer (Zigbee task) single-consumer (light task) ring
+static light_command_t queue[LIGHT_QUEUE_SIZE];
+static atomic_uint queue_head = 0;
+static atomic_uint queue_tail = 0;
+
+// With the ring full, the newest command of each zone and type waits here. Until the light task
+// has taken them, or they fit into the ring again, later commands go here too or are dropped, so
+// they stay queued after everything in the ring.
+static light_command_t overflow[LIGHT_ZONES][LIGHT_CMD_STORE_SCENE];
+static uint32_t overflow_present[LIGHT_ZONES];
+static atomic_bool overflow_pending = false;        // only set by the producer
+static portMUX_TYPE overflow_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Too large for the ring, only the newest one is kept
+static light_calibration_t pending_calibration;
+static portMUX_TYPE calibration_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static StackType_t light_task_stack[LIGHT_TASK_STACK_SIZE];
+static StaticTask_t light_task_tcb;
+static TaskHandle_t light_task_handle = NULL;
+static atomic_bool boot_success = false;
+static atomic_uint effect_due = 0;       // bit per zone
+
+// Written by both tasks and read by the Zigbee task, relaxed atomics like the diagnostics counters
+static atomic_uint_least32_t stats_depth_max;
+static atomic_uint_least32_t stats_commands;
+static atomic_uint_least32_t stats_coalesced;
+static atomic_uint_least32_t stats_dropped;
+static atomic_uint_least32_t stats_latency_us_last;
+static atomic_uint_least32_t stats_latency_us_max;
+static atomic_uint_least32_t stats_latency_us_avg;
+static uint64_t latency_us_total = 0;
+static uint32_t latency_samples = 0;
+
+static void count(atomic_uint_least32_t *counter)
+{
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+// Producer only
+static void push(const light_command_t *command)
+{
+    unsigned int head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+
+    queue[head % LIGHT_QUEUE_SIZE] = *command;
+    atomic_store_explicit(&queue_head, head + 1, memory_order_release);
+
+    if (head + 1 - tail > atomic_load_explicit(&stats_depth_max, memory_order_relaxed))
+        atomic_store_explicit(&stats_depth_max, head + 1 - tail, memory_order_relaxed);
+}
+
+static unsigned int queue_free()
+{
+    unsigned int head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&queue_tail, memory_order_acquire);
+    return LIGHT_QUEUE_SIZE - (head - tail);
+}
+
+// Under overflow_lock
+static unsigned int overflow_count()
+{
+    unsigned int n = 0;
+    for (int zone = 0; zone < LIGHT_ZONES; zone++)
+        n += __builtin_popcount(overflow_present[zone]);
+    return n;
+}
+
+// Under overflow_lock, the ring has room for all of them
+static void push_overflow()
+{
+    for (int type = 0; type < LIGHT_CMD_STORE_SCENE; type++) {
+        for (int zone = 0; zone < LIGHT_ZONES; zone++) {
+            if (overflow_present[zone] & (1 << type))
+                push(&overflow[zone][type]);
+        }
+    }
+    for (int zone = 0; zone < LIGHT_ZONES; zone++)
+        overflow_present[zone] = 0;
+    atomic_store_explicit(&overflow_pending, false, memory_order_relaxed);
+}
+
+static bool post_command(uint8_t zone, light_command_type_t type, uint16_t value, uint8_t scene_id, uint16_t transition_time,
+    const light_scene_fields_t *scene_fields)
+{
+    light_command_t command = {
+        .type = type,
+        .zone = zone,
+        .value = value,
+        .transition_time = transition_time,
+        .scene_id = scene_id,
+        .received_us = esp_timer_get_time(),
+    };
+    if (scene_fields)
+        command.scene_fields = *scene_fields;
+
+    // Level 0 and 0xFF only switch the light, the stored level is kept
+    if (command.type == LIGHT_CMD_LEVEL && (command.value == 0 || command.value == 0xFF)) {
+        command.type = LIGHT_CMD_ON_OFF;
+        command.value = command.value != 0;
+    }
+
+    if (!atomic_load_explicit(&overflow_pending, memory_order_relaxed) && queue_free() > 0) {
+        push(&command);
+        xTaskNotifyGive(light_task_handle);
+        return true;
+    }
+
+    bool coalescable = command.type < LIGHT_CMD_STORE_SCENE;
+    bool queued = true;
+    portENTER_CRITICAL(&overflow_lock);
+    if (queue_free() > overflow_count()) {
+        push_overflow();
+        push(&command);
+    } else if (coalescable) {
+        // Supersedes the waiting command of its kind, the final target of a burst is never lost
+        if (overflow_present[zone] & (1 << command.type))
+            count(&stats_coalesced);
+        overflow[zone][command.type] = command;
+        overflow_present[zone] |= 1 << command.type;
+        atomic_store_explicit(&overflow_pending, true, memory_order_relaxed);
+    } else {
+        queued = false;
+    }
+    portEXIT_CRITICAL(&overflow_lock);
+
+    if (!queued) {
+        count(&stats_dropped);
+        ESP_LOGW(TAG, "Light command queue full, dropping command %d", (int)type);
+        return false;
+    }
+    xTaskNotifyGive(light_task_handle);
+    return true;
+}
+
+bool light_control_post(uint8_t zone, light_command_type_t type, uint16_t value, uint16_t transition_time)
+{
+    return post_command(zone, type, value, 0, transition_time, NULL);
+}
+
+bool light_control_post_scene(uint8_t zone, light_command_type_t type, uint16_t group_id, uint8_t scene_id, uint16_t transition_time)
+{
+    return post_command(zone, type, group_id, scene_id, transition_time, NULL);
+}
+
+bool light_control_post_add_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id, const light_scene_fields_t *fields,
+    uint16_t transition_time)
+{
+    return post_command(zone, LIGHT_CMD_ADD_SCENE, group_id, scene_id, transition_time, fields);
+}
+
+bool light_control_post_calibration(const uint8_t *data, size_t size)
+{
+    light_calibration_t calibration;
+
+    if (!light_curve_parse_calibration(data, size, &calibration)) {
+        ESP_LOGW(TAG, "Invalid calibration (%d bytes), ignoring it", (int)size);
+        return false;
+    }
+
+    portENTER_CRITICAL(&calibration_lock);
+    pending_calibration = calibration;
+    portEXIT_CRITICAL(&calibration_lock);
+    return light_control_post(0, LIGHT_CMD_CALIBRATION, 0, 0);
+}
+
+void light_control_boot_success(void)
+{
+    atomic_store(&boot_success, true);
+    xTaskNotifyGive(light_task_handle);
+}
+
+void light_control_wake_effect(uint8_t zone)
+{
+    atomic_fetch_or(&effect_due, 1U << zone);
+    xTaskNotifyGive(light_task_handle);
+}
+
+static void apply_command(const light_command_t *command)
+{
+    switch (command->type) {
+    case LIGHT_CMD_FACTORY_RESET:
+        light_factory_reset();
+        break;
+    case LIGHT_CMD_SET_DEFAULTS:
+        light_set_defaults();
+        break;
+    case LIGHT_CMD_LOAD_SETTINGS:
+        light_load_settings();
+        break;
+    case LIGHT_CMD_STARTUP_ON_OFF:
+        light_set_startup_on_off(command->zone, command->value);
+        break;
+    case LIGHT_CMD_STARTUP_TEMPERATURE:
+        light_set_startup_temperature(command->zone, command->value);
+        break;
+    case LIGHT_CMD_ON_OFF_TRANSITION_TIME:
+        light_set_on_off_transition_time(command->zone, command->value);
+        break;
+    case LIGHT_CMD_CALIBRATION: {
+        light_calibration_t calibration;
+        portENTER_CRITICAL(&calibration_lock);
+        calibration = pending_calibration;
+        portEXIT_CRITICAL(&calibration_lock);
+        light_set_calibration(&calibration);
+        break;
+    }
+    case LIGHT_CMD_MOVE_TO_LEVEL:
+        light_move_to_level(command->zone, command->value, command->transition_time);
+        break;
+    case LIGHT_CMD_MOVE_TO_TEMPERATURE:
+        light_move_to_temperature(command->zone, command->value, command->transition_time);
+        break;
+    case LIGHT_CMD_ON_OFF:
+        light_set_on_off(command->zone, command->value);
+        break;
+    case LIGHT_CMD_LEVEL:
+        light_set_level(command->zone, command->value);
+        break;
+    case LIGHT_CMD_TEMPERATURE:
+        light_set_temperature(command->zone, command->value);
+        break;
+    case LIGHT_CMD_EFFECT:
+        effect_trigger(command->zone, command->value);
+        break;
+    case LIGHT_CMD_STORE_SCENE:
+        light_store_scene(command->zone, command->value, command->scene_id);
+        break;
+    case LIGHT_CMD_ADD_SCENE:
+        light_add_scene(command->zone, command->value, command->scene_id, &command->scene_fields, command->transition_time);
+        break;
+    case LIGHT_CMD_RECALL_SCENE:
+        light_recall_scene(command->zone, command->value, command->scene_id, command->transition_time);
+        break;
+    case LIGHT_CMD_REMOVE_SCENE:
+        light_remove_scene(command->zone, command->value, command->scene_id);
+        break;
+    case LIGHT_CMD_REMOVE_GROUP_SCENES:
+        light_remove_group_scenes(command->zone, command->value);
+        break;
+    default:
+        break;
+    }
+}
+
+// Type by type, so that e.g. the transition times of all zones are known before any level
+static void apply_batch(light_command_t latest[][LIGHT_CMD_MAX], uint32_t *present)
+{
+    for (int type = 0; type < LIGHT_CMD_MAX; type++) {
+        for (int zone = 0; zone < LIGHT_ZONES; zone++) {
+            if (present[zone] & (1 << type))
+                apply_command(&latest[zone][type]);
+        }
+    }
+    for (int zone = 0; zone < LIGHT_ZONES; zone++)
+        present[zone] = 0;
+}
+
+static void light_task(void *pvParameters)
+{
+    static light_command_t latest[LIGHT_ZONES][LIGHT_CMD_MAX];
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if (atomic_exchange(&boot_success, false))
+            light_boot_success();
+
+        unsigned int effects = atomic_exchange(&effect_due, 0);
+        for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+            if (effects & (1U << zone))
+                effect_step(zone);
+        }
+
+        unsigned int tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+        if (tail == atomic_load_explicit(&queue_head, memory_order_acquire)
+                && !atomic_load_explicit(&overflow_pending, memory_order_relaxed))
+            continue;
+
+        // Keep only the newest command of each type for each zone
+        uint32_t present[LIGHT_ZONES] = { 0 };
+        int64_t oldest_us = 0;
+        light_begin_update();
+        while (1) {
+            unsigned int head = atomic_load_explicit(&queue_head, memory_order_acquire);
+            for (; tail != head; tail++) {
+                light_command_t command = queue[tail % LIGHT_QUEUE_SIZE];
+                count(&stats_commands);
+                if (!oldest_us || command.received_us < oldest_us)
+                    oldest_us = command.received_us;
+
+                // Scene commands see the state left by the commands queued before them
+                if (command.type >= LIGHT_CMD_STORE_SCENE) {
+                    apply_batch(latest, present);
+                    apply_command(&command);
+                    continue;
+                }
+
+                if (present[command.zone] & (1 << command.type))
+                    count(&stats_coalesced);
+                present[command.zone] |= 1 << command.type;
+                latest[command.zone][command.type] = command;
+            }
+            atomic_store_explicit(&queue_tail, tail, memory_order_release);
+
+            // The overflow follows the ring, take it once nothing is left in between
+            portENTER_CRITICAL(&overflow_lock);
+            bool drained = tail == atomic_load_explicit(&queue_head, memory_order_acquire);
+            if (drained) {
+                for (int zone = 0; zone < LIGHT_ZONES; zone++) {
+                    for (int type = 0; type < LIGHT_CMD_STORE_SCENE; type++) {
+                        if (!(overflow_present[zone] & (1 << type)))
+                            continue;
+                        const light_command_t *command = &overflow[zone][type];
+                        count(&stats_commands);
+                        if (!oldest_us || command->received_us < oldest_us)
+                            oldest_us = command->received_us;
+                        if (present[zone] & (1 << type))
+                            count(&stats_coalesced);
+                        present[zone] |= 1 << type;
+                        latest[zone][type] = *command;
+                    }
+                    overflow_present[zone] = 0;
+                }
+                atomic_store_explicit(&overflow_pending, false, memory_order_relaxed);
+            }
+            portEXIT_CRITICAL(&overflow_lock);
+            if (drained)
+                break;
+        }
+
+        apply_batch(latest, present);
+
+        if (light_end_update()) {
+            uint32_t latency_us = esp_timer_get_time() - oldest_us;
+            atomic_store_explicit(&stats_latency_us_last, latency_us, memory_order_relaxed);
+            if (latency_us > atomic_load_explicit(&stats_latency_us_max, memory_order_relaxed))
+                atomic_store_explicit(&stats_latency_us_max, latency_us, memory_order_relaxed);
+            latency_us_total += latency_us;
+            latency_samples++;
+            atomic_store_explicit(&stats_latency_us_avg, latency_us_total / latency_samples, memory_order_relaxed);
+            diag_latency(latency_us);
+        }
+    }
+}
+
+void light_control_start(void)
+{
+    effect_init();
+    light_task_handle = xTaskCreateStatic(light_task, "Light_control", LIGHT_TASK_STACK_SIZE, NULL, LIGHT_TASK_PRIORITY,
+        light_task_stack, &light_task_tcb);
+}
+
+void light_control_get_stats(light_control_stats_t *stats)
+{
+    unsigned int head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+
+    *stats = (light_control_stats_t) {
+        .queue_depth = head - tail,
+        .queue_depth_max = atomic_load_explicit(&stats_depth_max, memory_order_relaxed),
+        .commands = atomic_load_explicit(&stats_commands, memory_order_relaxed),
+        .coalesced = atomic_load_explicit(&stats_coalesced, memory_order_relaxed),
+        .dropped = atomic_load_explicit(&stats_dropped, memory_order_relaxed),
+        .latency_us_last = atomic_load_explicit(&stats_latency_us_last, memory_order_relaxed),
+        .latency_us_max = atomic_load_explicit(&stats_latency_us_max, memory_order_relaxed),
+        .latency_us_avg = atomic_load_explicit(&stats_latency_us_avg, memory_order_relaxed),
+    };
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "light_driver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* In the order a coalesced batch is applied */
+typedef enum {
+    LIGHT_CMD_FACTORY_RESET,
+    LIGHT_CMD_SET_DEFAULTS,
+    LIGHT_CMD_LOAD_SETTINGS,
+    LIGHT_CMD_STARTUP_ON_OFF,
+    LIGHT_CMD_STARTUP_TEMPERATURE,
+    LIGHT_CMD_ON_OFF_TRANSITION_TIME,
+    LIGHT_CMD_CALIBRATION,
+    LIGHT_CMD_MOVE_TO_LEVEL,
+    LIGHT_CMD_MOVE_TO_TEMPERATURE,
+    LIGHT_CMD_ON_OFF,
+    LIGHT_CMD_LEVEL,
+    LIGHT_CMD_TEMPERATURE,
+    LIGHT_CMD_EFFECT,
+    // Not coalesced, applied in queue order
+    LIGHT_CMD_STORE_SCENE,
+    LIGHT_CMD_ADD_SCENE,
+    LIGHT_CMD_RECALL_SCENE,
+    LIGHT_CMD_REMOVE_SCENE,
+    LIGHT_CMD_REMOVE_GROUP_SCENES,
+    LIGHT_CMD_MAX,
+} light_command_type_t;
+
+typedef struct {
+    uint32_t queue_depth;       // commands waiting right now
+    uint32_t queue_depth_max;
+    uint32_t commands;          // commands received
+    uint32_t coalesced;         // commands superseded by a newer one before they were applied
+    uint32_t dropped;           // scene commands lost because the queue was full
+    uint32_t latency_us_last;   // oldest command in a batch to PWM update
+    uint32_t latency_us_max;
+    uint32_t latency_us_avg;
+} light_control_stats_t;
+
+/* Start the light-control task, call after light_init() */
+void light_control_start(void);
+
+/* Queue a command for a zone of the light-control task, fixture-wide commands take zone 0.
+ * With the queue full a command replaces the waiting one of its zone and type, only scene
+ * commands are dropped. Single producer: only call from the Zigbee task. */
+bool light_control_post(uint8_t zone, light_command_type_t type, uint16_t value, uint16_t transition_time);
+
+/* Queue a scene command, value is the group ID */
+bool light_control_post_scene(uint8_t zone, light_command_type_t type, uint16_t group_id, uint8_t scene_id, uint16_t transition_time);
+
+/* Queue an Add Scene with the values of its extension fields, transition_time in 1/10 s */
+bool light_control_post_add_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id, const light_scene_fields_t *fields,
+    uint16_t transition_time);
+
+/* Queue a serialized calibration (see light_curve.h), validated before it is queued.
+ * Same single producer as light_control_post(). */
+bool light_control_post_calibration(const uint8_t *data, size_t size);
+
+/* Reset the reboot counter, safe to call from any task */
+void light_control_boot_success(void);
+
+/* Let the light-control task play the next effect segment of a zone, safe to call from any task */
+void light_control_wake_effect(uint8_t zone);
+
+void light_control_get_stats(light_control_stats_t *stats);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
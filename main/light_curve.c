@@ -0,0 +1,190 @@
+#include "light_curve.h"
+#include "dimming_lut.h"
+
+_Static_assert(DIMMING_LUT_RESOLUTION == LIGHT_DUTY_RESOLUTION, "dimming_lut.h is generated for a different duty resolution");
+_Static_assert(LIGHT_DUTY_RESOLUTION <= 15, "the mix table holds full duty in 16 bits");
+
+#define MIX_SIZE                (LIGHT_MIREDS_MAX - LIGHT_MIREDS_MIN + 1)
+
+// The original hand-tuned mix of the first fixtures, assuming both LED strings
+// are equally efficient. gen-dimming-lut.py --compare reads it from here.
+const light_calibration_t light_calibration_default = {
+    .count = 5,
+    .points = {
+        { 150, 1000,    0, 1000 },
+        { 250, 1000,  500, 1500 },
+        { 370, 1000, 1000, 2000 },
+        { 454,  500, 1000, 1500 },
+        { 500,    0, 1000, 1000 },
+    },
+};
+
+// Duty at full brightness for every temperature, brightness-compensated
+static uint16_t mix_cw[MIX_SIZE];
+static uint16_t mix_ww[MIX_SIZE];
+
+static uint16_t get_u16(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+static void put_u16(uint8_t *data, uint16_t value)
+{
+    data[0] = value & 0xFF;
+    data[1] = value >> 8;
+}
+
+static bool calibration_valid(const light_calibration_t *calibration)
+{
+    if (calibration->count < 2 || calibration->count > LIGHT_CALIBRATION_MAX_POINTS)
+        return false;
+
+    for (size_t i = 0; i < calibration->count; i++) {
+        const light_calibration_point_t *point = &calibration->points[i];
+        if (point->cw > LIGHT_CALIBRATION_SCALE || point->ww > LIGHT_CALIBRATION_SCALE || point->lumen == 0)
+            return false;
+        if (i > 0 && point->mireds <= calibration->points[i - 1].mireds)
+            return false;
+    }
+    return true;
+}
+
+typedef struct {
+    const light_calibration_point_t *a;
+    const light_calibration_point_t *b;
+    uint32_t position;
+    uint32_t span;
+} segment_t;
+
+// The calibration points around `mireds`, outside them the end point is used as is
+static segment_t find_segment(const light_calibration_t *calibration, uint16_t mireds)
+{
+    const light_calibration_point_t *points = calibration->points;
+    size_t last = calibration->count - 1;
+
+    if (mireds <= points[0].mireds)
+        return (segment_t) { &points[0], &points[0], 0, 1 };
+    if (mireds >= points[last].mireds)
+        return (segment_t) { &points[last], &points[last], 0, 1 };
+
+    size_t i = 0;
+    while (mireds > points[i + 1].mireds)
+        i++;
+    return (segment_t) { &points[i], &points[i + 1], mireds - points[i].mireds, points[i + 1].mireds - points[i].mireds };
+}
+
+static uint64_t interpolate(const segment_t *segment, uint16_t a, uint16_t b, uint32_t scale)
+{
+    uint64_t value = (uint64_t)a * (segment->span - segment->position) + (uint64_t)b * segment->position;
+    return (value * scale + segment->span / 2) / segment->span;
+}
+
+bool light_curve_set_calibration(const light_calibration_t *calibration)
+{
+    if (!calibration_valid(calibration))
+        return false;
+
+    uint64_t lumen[MIX_SIZE];
+    uint64_t lumen_min = UINT64_MAX;
+    for (size_t i = 0; i < MIX_SIZE; i++) {
+        segment_t segment = find_segment(calibration, LIGHT_MIREDS_MIN + i);
+        lumen[i] = interpolate(&segment, segment.a->lumen, segment.b->lumen, 256);
+        if (lumen[i] < lumen_min)
+            lumen_min = lumen[i];
+    }
+
+    // Scale every mix down to the output of the dimmest one, so the brightness
+    // doesn't change with the temperature
+    for (size_t i = 0; i < MIX_SIZE; i++) {
+        segment_t segment = find_segment(calibration, LIGHT_MIREDS_MIN + i);
+        uint64_t cw = interpolate(&segment, segment.a->cw, segment.b->cw, LIGHT_MAX_DUTY);
+        uint64_t ww = interpolate(&segment, segment.a->ww, segment.b->ww, LIGHT_MAX_DUTY);
+        uint64_t divisor = (uint64_t)LIGHT_CALIBRATION_SCALE * lumen[i];
+
+        mix_cw[i] = (cw * lumen_min + divisor / 2) / divisor;
+        mix_ww[i] = (ww * lumen_min + divisor / 2) / divisor;
+    }
+    return true;
+}
+
+bool light_curve_parse_calibration(const uint8_t *data, size_t size, light_calibration_t *calibration)
+{
+    if (size % LIGHT_CALIBRATION_POINT_SIZE)
+        return false;
+
+    size_t count = size / LIGHT_CALIBRATION_POINT_SIZE;
+    if (count < 2 || count > LIGHT_CALIBRATION_MAX_POINTS)
+        return false;
+
+    calibration->count = count;
+    for (size_t i = 0; i < count; i++, data += LIGHT_CALIBRATION_POINT_SIZE) {
+        calibration->points[i] = (light_calibration_point_t) {
+            .mireds = get_u16(data),
+            .cw = get_u16(data + 2),
+            .ww = get_u16(data + 4),
+            .lumen = get_u16(data + 6),
+        };
+    }
+    return calibration_valid(calibration);
+}
+
+size_t light_curve_format_calibration(const light_calibration_t *calibration, uint8_t *data)
+{
+    for (size_t i = 0; i < calibration->count; i++, data += LIGHT_CALIBRATION_POINT_SIZE) {
+        put_u16(data, calibration->points[i].mireds);
+        put_u16(data + 2, calibration->points[i].cw);
+        put_u16(data + 4, calibration->points[i].ww);
+        put_u16(data + 6, calibration->points[i].lumen);
+    }
+    return calibration->count * LIGHT_CALIBRATION_POINT_SIZE;
+}
+
+light_duty_t light_curve_duty(bool power, uint8_t level, uint16_t temperature)
+{
+    light_duty_t duty = { 0, 0 };
+
+    if (!power)
+        return duty;
+
+    if (level > LIGHT_LEVEL_MAX)
+        level = LIGHT_LEVEL_MAX;
+    if (temperature < LIGHT_MIREDS_MIN)
+        temperature = LIGHT_MIREDS_MIN;
+    else if (temperature > LIGHT_MIREDS_MAX)
+        temperature = LIGHT_MIREDS_MAX;
+
+    uint32_t brightness = dimming_lut[level];
+    duty.cw = (mix_cw[temperature - LIGHT_MIREDS_MIN] * brightness) >> LIGHT_DUTY_RESOLUTION;
+    duty.ww = (mix_ww[temperature - LIGHT_MIREDS_MIN] * brightness) >> LIGHT_DUTY_RESOLUTION;
+    return duty;
+}
+
+bool light_curve_startup_power(uint8_t start_power, bool power)
+{
+    switch (start_power)
+    {
+    case LIGHT_STARTUP_OFF:
+        return false;
+    case LIGHT_STARTUP_ON:
+        return true;
+    case LIGHT_STARTUP_TOGGLE:
+        return !power;
+    case LIGHT_STARTUP_PREVIOUS:
+    default:
+        return power;
+    }
+}
+
+uint16_t light_curve_startup_temperature(uint16_t start_temperature, uint16_t temperature)
+{
+    if (start_temperature != LIGHT_STARTUP_TEMPERATURE_PREVIOUS)
+        return start_temperature;
+    return temperature;
+}
+
+bool light_curve_count_boot(uint8_t *reboot_count)
+{
+    if (*reboot_count < 0xFF)
+        (*reboot_count)++;
+    return *reboot_count >= LIGHT_RESET_REBOOT_COUNT;
+}
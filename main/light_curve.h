@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Platform-independent part of the light driver: colour mixing, dimming and
+ * the startup rules. No ESP-IDF or Zigbee dependencies, so it builds on a host.
+ */
+
+#ifndef LIGHT_DUTY_RESOLUTION
+#define LIGHT_DUTY_RESOLUTION       13      // bits, set by the build from CONFIG_LIGHT_PWM_RESOLUTION
+#endif
+#define LIGHT_MAX_DUTY              (1 << LIGHT_DUTY_RESOLUTION)
+
+#define LIGHT_LEVEL_MIN             1       // CurrentLevel range while on
+#define LIGHT_LEVEL_MAX             254
+
+#define LIGHT_MIREDS_MIN            150
+#define LIGHT_MIREDS_MAX            500
+
+/* ZCL StartUpOnOff values */
+#define LIGHT_STARTUP_OFF           0x00
+#define LIGHT_STARTUP_ON            0x01
+#define LIGHT_STARTUP_TOGGLE        0x02
+#define LIGHT_STARTUP_PREVIOUS      0xFF
+
+/* ZCL StartUpColorTemperatureMireds value to keep the previous temperature */
+#define LIGHT_STARTUP_TEMPERATURE_PREVIOUS  0xFFFF
+
+/* Power cycles in a row, each shorter than the boot success delay, that reset the device */
+#define LIGHT_RESET_REBOOT_COUNT    5
+
+#define LIGHT_CALIBRATION_MAX_POINTS    8
+#define LIGHT_CALIBRATION_POINT_SIZE    8       // serialized: mireds, cw, ww, lumen, all u16 little-endian
+#define LIGHT_CALIBRATION_SCALE         1000    // cw and ww are per mille of full duty
+
+/* Measured mix of a fixture: at `mireds` the channels are driven at cw/ww and
+ * the fixture gives `lumen` (in any unit, only ratios matter). Between points
+ * everything is interpolated linearly, outside them the end points apply.
+ */
+typedef struct {
+    uint16_t mireds;
+    uint16_t cw;
+    uint16_t ww;
+    uint16_t lumen;
+} light_calibration_point_t;
+
+typedef struct {
+    uint8_t count;
+    light_calibration_point_t points[LIGHT_CALIBRATION_MAX_POINTS];
+} light_calibration_t;
+
+extern const light_calibration_t light_calibration_default;
+
+typedef struct {
+    uint32_t cw;
+    uint32_t ww;
+} light_duty_t;
+
+/* Build the mixing table, scaled so every temperature gives the light output of
+ * the dimmest one. Returns false (and keeps the current table) if it is invalid.
+ * Must succeed once before light_curve_duty() is used.
+ */
+bool light_curve_set_calibration(const light_calibration_t *calibration);
+
+bool light_curve_parse_calibration(const uint8_t *data, size_t size, light_calibration_t *calibration);
+
+/* Returns the serialized size, buffer must hold LIGHT_CALIBRATION_MAX_POINTS points */
+size_t light_curve_format_calibration(const light_calibration_t *calibration, uint8_t *data);
+
+light_duty_t light_curve_duty(bool power, uint8_t level, uint16_t temperature);
+
+bool light_curve_startup_power(uint8_t start_power, bool power);
+
+uint16_t light_curve_startup_temperature(uint16_t start_temperature, uint16_t temperature);
+
+/* Count a boot, returns true when the reset gesture is complete */
+bool light_curve_count_boot(uint8_t *reboot_count);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
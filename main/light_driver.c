@@ -1,20 +1,31 @@
 #include "light_driver.h"
+#include "light_curve.h"
+#include "boot.h"
+#include "diag.h"
+#include "report.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "esp_log.h"
+#include "esp_private/esp_clk.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
 #include "nvs_flash.h"
 #include "driver/ledc.h"
+#include "soc/soc_caps.h"
 #include "ha/esp_zigbee_ha_standard.h"
 #include "zcl/esp_zigbee_zcl_common.h"
 #include "zboss_api.h"
 
 #define LEDC_TIMER              LEDC_TIMER_0
 #define LEDC_MODE               LEDC_LOW_SPEED_MODE
-#define LEDC_OUTPUT_CW          GPIO_NUM_10
-#define LEDC_OUTPUT_WW          GPIO_NUM_5
-#define LEDC_CHANNEL_CW         LEDC_CHANNEL_0
-#define LEDC_CHANNEL_WW         LEDC_CHANNEL_1
-#define LEDC_DUTY_RES           LEDC_TIMER_13_BIT // Set duty resolution to 13 bits
-#define LEDC_FREQUENCY          (4000) // Frequency in Hertz. Set frequency at 4 kHz
+#define LEDC_DUTY_RES           CONFIG_LIGHT_PWM_RESOLUTION // Duty resolution in bits
+#define LEDC_FREQUENCY          CONFIG_LIGHT_PWM_FREQUENCY  // Frequency in Hertz
 
 /* Warning:
  * For ESP32, ESP32S2, ESP32S3, ESP32C3, ESP32C2, ESP32C6, ESP32H2, ESP32P4 targets,
@@ -22,236 +33,1169 @@
  * 100% duty cycle is not reachable (duty cannot be set to (2 ** SOC_LEDC_TIMER_BIT_WIDTH)).
  */
 
-static const uint32_t max_duty = 8192;
+_Static_assert(LIGHT_DUTY_RESOLUTION == LEDC_DUTY_RES, "light_curve.h computes duty for a different resolution");
+_Static_assert(LIGHT_STARTUP_PREVIOUS == ZB_ZCL_ON_OFF_START_UP_ON_OFF_IS_PREVIOUS, "StartUpOnOff values");
+_Static_assert(LIGHT_STARTUP_TEMPERATURE_PREVIOUS == ZB_ZCL_COLOR_CONTROL_START_UP_COLOR_TEMPERATURE_USE_PREVIOUS_VALUE, "StartUpColorTemperatureMireds values");
+_Static_assert(LIGHT_ZONES * 2 <= SOC_LEDC_CHANNEL_NUM, "Not enough LEDC channels for the zones");
+
+typedef struct {
+    gpio_num_t gpio;
+    ledc_channel_t channel;
+    bool invert;
+} light_channel_t;
+
+typedef struct {
+    uint8_t endpoint;
+    light_channel_t cw;
+    light_channel_t ww;
+} light_zone_t;
+
+/* CW is on at the start of the PWM period, WW (inverted output) at its end, so
+ * the channels only overlap when their duties add up to more than the period.
+ * The alignment follows the duty by itself, also during hardware fades, and
+ * keeps the peak current and the ripple on the LED supply down.
+ */
+#define ZONE(endpoint, cw_gpio, cw_channel, ww_gpio, ww_channel) \
+    { endpoint, { cw_gpio, cw_channel, false }, { ww_gpio, ww_channel, true } }
+
+// All channels run from LEDC_TIMER, so the PWM periods of all zones start together
+static const light_zone_t zone_table[LIGHT_ZONES] = {
+    ZONE(HA_ESP_LIGHT_ENDPOINT, CONFIG_LIGHT_ZONE1_GPIO_CW, LEDC_CHANNEL_0, CONFIG_LIGHT_ZONE1_GPIO_WW, LEDC_CHANNEL_1),
+#if LIGHT_ZONES > 1
+    ZONE(HA_ESP_LIGHT_ENDPOINT + 1, CONFIG_LIGHT_ZONE2_GPIO_CW, LEDC_CHANNEL_2, CONFIG_LIGHT_ZONE2_GPIO_WW, LEDC_CHANNEL_3),
+#endif
+#if LIGHT_ZONES > 2
+    ZONE(HA_ESP_LIGHT_ENDPOINT + 2, CONFIG_LIGHT_ZONE3_GPIO_CW, LEDC_CHANNEL_4, CONFIG_LIGHT_ZONE3_GPIO_WW, LEDC_CHANNEL_5),
+#endif
+};
+
+// State of a factory-new light
+#define DEFAULT_POWER                   ESP_ZB_ZCL_ON_OFF_ON_OFF_DEFAULT_VALUE
+#define DEFAULT_LEVEL                   254
+#define DEFAULT_TEMPERATURE             ESP_ZB_ZCL_COLOR_CONTROL_COLOR_TEMPERATURE_DEF_VALUE
+#define DEFAULT_START_POWER             ZB_ZCL_ON_OFF_START_UP_ON_OFF_IS_ON
+#define DEFAULT_START_TEMPERATURE       ZB_ZCL_COLOR_CONTROL_START_UP_COLOR_TEMPERATURE_USE_PREVIOUS_VALUE
+
+// A Move-to-* command in flight: the stack may deliver the new value once or in
+// several steps, the hardware fade always heads for the commanded target.
+typedef struct {
+    bool pending;
+    uint16_t origin;
+    uint16_t target;
+    int64_t deadline_us;
+} transition_t;
+
+typedef struct {
+    bool power;
+    uint8_t level;
+    uint16_t temperature;
+    enum zb_zcl_on_off_start_up_on_off_e start_power;
+    uint16_t start_temperature;
+    uint16_t on_off_transition_time;    // OnOffTransitionTime, in 1/10 s
+    transition_t level_transition;
+    transition_t temperature_transition;
+
+    // Collected between light_begin_update() and light_end_update()
+    bool update_pending;
+    uint32_t update_fade_ms;
+    bool update_snapshot;               // a recalled scene brought its own duty
+    light_duty_t update_snapshot_duty;
+
+    // While an effect plays it owns the zone's channels, the state keeps changing
+    // underneath and only state_duty remembers what to restore
+    bool effect_active;
+    light_duty_t state_duty;
+
+    bool state_dirty;                   // under state_lock, written by the next flush
+} zone_state_t;
+
+static zone_state_t zones[LIGHT_ZONES];
+static light_calibration_t calibration;
+static bool reset_requested = false;        // counted the reboot that asks for a factory reset
+static int64_t light_on_us = 0;             // power-on to PWM output, this boot
+
+static void reset_zone(zone_state_t *z)
+{
+    z->power = DEFAULT_POWER;
+    z->level = DEFAULT_LEVEL;
+    z->temperature = DEFAULT_TEMPERATURE;
+    z->start_power = DEFAULT_START_POWER;
+    z->start_temperature = DEFAULT_START_TEMPERATURE;
+    z->on_off_transition_time = 0;
+}
+
+// Off is a separate attribute, the stored level of a light is always one it can be on at
+static uint8_t clamp_level(uint8_t level)
+{
+    if (level < LIGHT_LEVEL_MIN)
+        return LIGHT_LEVEL_MIN;
+    if (level > LIGHT_LEVEL_MAX)
+        return LIGHT_LEVEL_MAX;
+    return level;
+}
+
+static void plan_transition(transition_t *transition, uint16_t origin, uint16_t target, uint16_t transition_time)
+{
+    transition->pending = transition_time > 0;
+    transition->origin = origin;
+    transition->target = target;
+    transition->deadline_us = esp_timer_get_time() + (int64_t)transition_time * 100000;
+}
+
+static uint32_t transition_remaining_ms(transition_t *transition)
+{
+    if (!transition->pending)
+        return 0;
+
+    int64_t remaining_us = transition->deadline_us - esp_timer_get_time();
+    if (remaining_us < 1000) {
+        transition->pending = false;
+        return 0;
+    }
+    return remaining_us / 1000;
+}
+
+// Fade time for a value from the stack, non-zero if it is a step of the planned
+// transition. A value off the way from the origin to the target comes from
+// another command (or the stack rejected the planned one) and ends the plan.
+static uint32_t transition_capture(transition_t *transition, uint16_t value)
+{
+    uint32_t remaining_ms = transition_remaining_ms(transition);
+    if (!remaining_ms)
+        return 0;
+
+    uint16_t low = transition->origin < transition->target ? transition->origin : transition->target;
+    uint16_t high = transition->origin < transition->target ? transition->target : transition->origin;
+    if (value < low || value > high) {
+        transition->pending = false;
+        return 0;
+    }
+    return remaining_ms;
+}
 
-static bool current_power = ESP_ZB_ZCL_ON_OFF_ON_OFF_DEFAULT_VALUE;
-static uint8_t current_level = 254;
-static uint16_t current_temperature = ESP_ZB_ZCL_COLOR_CONTROL_COLOR_TEMPERATURE_DEF_VALUE;
-static enum zb_zcl_on_off_start_up_on_off_e start_power = ZB_ZCL_ON_OFF_START_UP_ON_OFF_IS_ON;
-static uint16_t start_temperature = ZB_ZCL_COLOR_CONTROL_START_UP_COLOR_TEMPERATURE_USE_PREVIOUS_VALUE;
-static uint8_t reboot_count = 0;
+// The new duty of a zone, pending is false for the zones left as they are
+typedef struct {
+    bool pending;
+    light_duty_t duty;
+    uint32_t fade_ms;
+} zone_output_t;
 
-static void set_duty(ledc_channel_t channel, uint32_t duty)
+static uint32_t channel_duty(const light_channel_t *channel, uint32_t duty)
+{
+    return channel->invert ? LIGHT_MAX_DUTY - duty : duty;
+}
+
+static void program_channel(const light_channel_t *channel, uint32_t duty, uint32_t fade_ms)
+{
+    duty = channel_duty(channel, duty);
+    if (fade_ms == 0)
+        ESP_ERROR_CHECK(ledc_set_duty(LEDC_MODE, channel->channel, duty));
+    else
+        // The LEDC fade unit steps the duty in hardware, the CPU only programs it
+        ESP_ERROR_CHECK(ledc_set_fade_with_time(LEDC_MODE, channel->channel, duty, fade_ms));
+}
+
+static void start_channel(const light_channel_t *channel, uint32_t fade_ms)
+{
+    if (fade_ms == 0)
+        ESP_ERROR_CHECK(ledc_update_duty(LEDC_MODE, channel->channel));
+    else
+        ESP_ERROR_CHECK(ledc_fade_start(LEDC_MODE, channel->channel, LEDC_FADE_NO_WAIT));
+}
+
+/* One batch for all channels: every channel is programmed before the first one
+ * starts, so the new duties and fades go live back to back. A low-speed channel
+ * latches its duty at the end of the PWM period of the shared timer, so zones
+ * updated together switch in the same period instead of one after the other.
+ */
+static void write_outputs(const zone_output_t *outputs)
 {
-    ESP_ERROR_CHECK(ledc_set_duty(LEDC_MODE, channel, duty));
-    ESP_ERROR_CHECK(ledc_update_duty(LEDC_MODE, channel));
+    // Freeze any fade in progress at its current duty, so that a new target
+    // continues from where the output actually is, without a jump
+    for (int zone = 0; zone < LIGHT_ZONES; zone++) {
+        if (!outputs[zone].pending)
+            continue;
+        ESP_ERROR_CHECK(ledc_fade_stop(LEDC_MODE, zone_table[zone].cw.channel));
+        ESP_ERROR_CHECK(ledc_fade_stop(LEDC_MODE, zone_table[zone].ww.channel));
+    }
+
+    for (int zone = 0; zone < LIGHT_ZONES; zone++) {
+        if (!outputs[zone].pending)
+            continue;
+        program_channel(&zone_table[zone].cw, outputs[zone].duty.cw, outputs[zone].fade_ms);
+        program_channel(&zone_table[zone].ww, outputs[zone].duty.ww, outputs[zone].fade_ms);
+    }
+
+    for (int zone = 0; zone < LIGHT_ZONES; zone++) {
+        if (!outputs[zone].pending)
+            continue;
+        start_channel(&zone_table[zone].cw, outputs[zone].fade_ms);
+        start_channel(&zone_table[zone].ww, outputs[zone].fade_ms);
+    }
+}
+
+static void write_zone(uint8_t zone, light_duty_t duty, uint32_t fade_ms)
+{
+    zone_output_t outputs[LIGHT_ZONES] = { 0 };
+    outputs[zone] = (zone_output_t) { true, duty, fade_ms };
+    write_outputs(outputs);
+}
+
+static light_duty_t zone_duty(uint8_t zone)
+{
+    return light_curve_duty(zones[zone].power, zones[zone].level, zones[zone].temperature);
+}
+
+// Between light_begin_update() and light_end_update() duty changes are only
+// collected, so a batch of commands touches the LEDC once
+static bool update_deferred = false;
+
+static void output_zones(const zone_output_t *outputs)
+{
+    zone_output_t writes[LIGHT_ZONES];
+
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        writes[zone] = outputs[zone];
+        if (!outputs[zone].pending)
+            continue;
+        zones[zone].state_duty = outputs[zone].duty;
+        writes[zone].pending = !zones[zone].effect_active;
+    }
+    write_outputs(writes);
+
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        if (outputs[zone].pending)
+            light_publish_state(zone);
+    }
+}
+
+static void output_duty(uint8_t zone, light_duty_t duty, uint32_t fade_ms)
+{
+    zone_output_t outputs[LIGHT_ZONES] = { 0 };
+    outputs[zone] = (zone_output_t) { true, duty, fade_ms };
+    output_zones(outputs);
+}
+
+static void defer_update(zone_state_t *z, uint32_t fade_ms)
+{
+    z->update_pending = true;
+    if (fade_ms > z->update_fade_ms)
+        z->update_fade_ms = fade_ms;
+}
+
+static void update_duty(uint8_t zone, uint32_t fade_ms)
+{
+    if (!update_deferred) {
+        output_duty(zone, zone_duty(zone), fade_ms);
+        return;
+    }
+
+    zones[zone].update_snapshot = false;
+    defer_update(&zones[zone], fade_ms);
+}
+
+static void update_duty_snapshot(uint8_t zone, light_duty_t duty, uint32_t fade_ms)
+{
+    if (!update_deferred) {
+        output_duty(zone, duty, fade_ms);
+        return;
+    }
+
+    zones[zone].update_snapshot = true;
+    zones[zone].update_snapshot_duty = duty;
+    defer_update(&zones[zone], fade_ms);
+}
+
+void light_begin_update()
+{
+    update_deferred = true;
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        zones[zone].update_pending = false;
+        zones[zone].update_fade_ms = 0;
+        zones[zone].update_snapshot = false;
+    }
 }
 
-static void update_duty()
+bool light_end_update()
 {
-    if (current_power) {
-        uint32_t cw, ww;
-        if (current_temperature >= 370) {
-            ww = max_duty;
-            if (current_temperature >= 454)
-                cw = (500 - current_temperature) * max_duty / 92;
-            else
-                cw = (538 - current_temperature) * max_duty / 168;
+    zone_output_t outputs[LIGHT_ZONES] = { 0 };
+    bool updated = false;
+
+    update_deferred = false;
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        zone_state_t *z = &zones[zone];
+        if (!z->update_pending)
+            continue;
+
+        z->update_pending = false;
+        outputs[zone] = (zone_output_t) {
+            .pending = true,
+            .duty = z->update_snapshot ? z->update_snapshot_duty : zone_duty(zone),
+            .fade_ms = z->update_fade_ms,
+        };
+        updated = true;
+    }
+
+    // All zones changed by the batch in a single LEDC write
+    if (updated)
+        output_zones(outputs);
+    return updated;
+}
+
+// Persisted state of a zone, written as one blob by the write-behind store
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t power;
+    uint8_t start_power;
+    uint8_t level;
+    uint16_t temperature;
+    uint16_t start_temperature;
+    uint8_t reserved;                   // was the reboot count, see boot.c
+    uint16_t on_off_transition_time;
+    uint32_t crc;
+} stored_state_t;
+
+#define STATE_NAMESPACE         "storage"
+#define STATE_KEY               "state"
+#define STATE_VERSION           1
+#define STATE_DEBOUNCE_US       (1000 * 1000)       // Write once the value settled for 1 s
+#define STATE_MAX_DELAY_US      (10 * 1000 * 1000)  // ...but never hold a change back for more than 10 s
+
+static const char *legacy_keys[] = { "power", "start_power", "level", "temp", "start_temp", "reboot", "onoff_time" };
+
+static esp_timer_handle_t state_timer;
+static portMUX_TYPE state_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t state_dirty_since_us = 0;
+static bool state_migrate_legacy = false;
+static bool state_flush_deferred = false;   // the timer fired during an effect
+
+// The first zone keeps the keys of the single-zone layout, the others get their number appended
+static const char *zone_key(char *key, const char *base, uint8_t zone)
+{
+    if (zone == 0)
+        return base;
+
+    snprintf(key, NVS_KEY_NAME_MAX_SIZE, "%s%d", base, (int)zone);
+    return key;
+}
+
+// Under state_lock, or in the light-control task, the only one that starts and ends effects
+static bool any_effect_active()
+{
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        if (zones[zone].effect_active)
+            return true;
+    }
+    return false;
+}
+
+static uint32_t state_crc(const stored_state_t *state)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)state, offsetof(stored_state_t, crc));
+}
+
+static void flush_state()
+{
+    stored_state_t states[LIGHT_ZONES];
+    bool dirty[LIGHT_ZONES];
+
+    portENTER_CRITICAL(&state_lock);
+    if (!state_dirty_since_us) {
+        portEXIT_CRITICAL(&state_lock);
+        return;
+    }
+    state_dirty_since_us = 0;
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        zone_state_t *z = &zones[zone];
+        dirty[zone] = z->state_dirty;
+        z->state_dirty = false;
+        states[zone] = (stored_state_t) {
+            .version = STATE_VERSION,
+            .power = z->power,
+            .start_power = z->start_power,
+            .level = z->level,
+            .temperature = z->temperature,
+            .start_temperature = z->start_temperature,
+            .on_off_transition_time = z->on_off_transition_time,
+        };
+    }
+    portEXIT_CRITICAL(&state_lock);
+
+    // All zones changed since the last flush go out with a single commit
+    uint32_t bytes_written = 0;
+    nvs_handle_t my_handle;
+    ESP_ERROR_CHECK(nvs_open(STATE_NAMESPACE, NVS_READWRITE, &my_handle));
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        if (!dirty[zone])
+            continue;
+
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        states[zone].crc = state_crc(&states[zone]);
+        ESP_ERROR_CHECK(nvs_set_blob(my_handle, zone_key(key, STATE_KEY, zone), &states[zone], sizeof(states[zone])));
+        bytes_written += sizeof(states[zone]);
+    }
+    if (state_migrate_legacy) {
+        for (size_t i = 0; i < sizeof(legacy_keys) / sizeof(legacy_keys[0]); i++)
+            nvs_erase_key(my_handle, legacy_keys[i]);
+        state_migrate_legacy = false;
+    }
+    ESP_ERROR_CHECK(nvs_commit(my_handle));
+    nvs_close(my_handle);
+    diag_count(DIAG_NVS_COMMITS, 1);
+    diag_count(DIAG_STATE_BYTES_WRITTEN, bytes_written);
+    ESP_LOGD(TAG, "State saved (%" PRIu32 " bytes)", bytes_written);
+}
+
+static void state_timer_callback(void *arg)
+{
+    // No flash writes while an effect plays, light_effect_restore() retries
+    portENTER_CRITICAL(&state_lock);
+    bool defer = any_effect_active();
+    state_flush_deferred = defer;
+    portEXIT_CRITICAL(&state_lock);
+
+    if (!defer)
+        flush_state();
+}
+
+// Only marks the state dirty, the write happens once changes settle
+static void save_state(uint8_t zone)
+{
+    int64_t now_us = esp_timer_get_time();
+    bool restart = true;
+    bool pending;
+
+    portENTER_CRITICAL(&state_lock);
+    zones[zone].state_dirty = true;
+    pending = state_dirty_since_us != 0;
+    if (!pending)
+        state_dirty_since_us = now_us;
+    else if (now_us - state_dirty_since_us >= STATE_MAX_DELAY_US)
+        restart = false;
+    portEXIT_CRITICAL(&state_lock);
+
+    // Goes out with the write already pending
+    if (pending)
+        diag_count(DIAG_STATE_WRITES_AVOIDED, 1);
+
+    if (restart) {
+        esp_timer_stop(state_timer);
+        ESP_ERROR_CHECK(esp_timer_start_once(state_timer, STATE_DEBOUNCE_US));
+    }
+}
+
+// Firmware before the state blob only had the first zone
+static void load_legacy_state(nvs_handle_t my_handle)
+{
+    zone_state_t *z = &zones[0];
+    uint8_t value;
+    if (nvs_get_u8(my_handle, "power", &value) != ESP_OK)
+        return;
+
+    z->power = value;
+    if (nvs_get_u8(my_handle, "start_power", &value) == ESP_OK)
+        z->start_power = value;
+    nvs_get_u8(my_handle, "level", &z->level);
+    z->level = clamp_level(z->level);
+    nvs_get_u16(my_handle, "temp", &z->temperature);
+    nvs_get_u16(my_handle, "start_temp", &z->start_temperature);
+    nvs_get_u16(my_handle, "onoff_time", &z->on_off_transition_time);
+
+    ESP_LOGI(TAG, "Migrating state from the per-key layout");
+    state_migrate_legacy = true;
+    save_state(0);
+}
+
+static void load_state()
+{
+    nvs_handle_t my_handle;
+    if (nvs_open(STATE_NAMESPACE, NVS_READONLY, &my_handle) != ESP_OK)
+        return;
+
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        zone_state_t *z = &zones[zone];
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        stored_state_t state;
+        size_t size = sizeof(state);
+        esp_err_t err = nvs_get_blob(my_handle, zone_key(key, STATE_KEY, zone), &state, &size);
+        if (err == ESP_OK && size == sizeof(state) && state.version == STATE_VERSION && state.crc == state_crc(&state)) {
+            z->power = state.power;
+            z->start_power = state.start_power;
+            z->level = clamp_level(state.level);
+            z->temperature = state.temperature;
+            z->start_temperature = state.start_temperature;
+            z->on_off_transition_time = state.on_off_transition_time;
+        } else {
+            if (err != ESP_ERR_NVS_NOT_FOUND)
+                ESP_LOGW(TAG, "Stored state of zone %d is invalid, ignoring it", (int)zone);
+            if (zone == 0)
+                load_legacy_state(my_handle);
         }
-        else {
-            cw = max_duty;
-            if (current_temperature >= 250)
-                ww = (current_temperature - 130) * max_duty / 240;
-            else
-                ww = (current_temperature - 150) * max_duty / 200;
+    }
+    nvs_close(my_handle);
+}
+
+// Per-fixture mix, written only when a controller changes it
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t count;
+    light_calibration_point_t points[LIGHT_CALIBRATION_MAX_POINTS];
+    uint32_t crc;
+} stored_calibration_t;
+
+#define CALIBRATION_KEY         "calibration"
+#define CALIBRATION_VERSION     1
+
+static bool calibration_deferred = false;   // changed during an effect
+
+static uint32_t calibration_crc(const stored_calibration_t *stored)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)stored, offsetof(stored_calibration_t, crc));
+}
+
+static void save_calibration()
+{
+    if (any_effect_active()) {
+        calibration_deferred = true;
+        return;
+    }
+
+    stored_calibration_t stored = {
+        .version = CALIBRATION_VERSION,
+        .count = calibration.count,
+    };
+    memcpy(stored.points, calibration.points, sizeof(stored.points));
+    stored.crc = calibration_crc(&stored);
+
+    nvs_handle_t my_handle;
+    ESP_ERROR_CHECK(nvs_open(STATE_NAMESPACE, NVS_READWRITE, &my_handle));
+    ESP_ERROR_CHECK(nvs_set_blob(my_handle, CALIBRATION_KEY, &stored, sizeof(stored)));
+    ESP_ERROR_CHECK(nvs_commit(my_handle));
+    nvs_close(my_handle);
+    diag_count(DIAG_NVS_COMMITS, 1);
+}
+
+static void load_calibration()
+{
+    calibration = light_calibration_default;
+
+    nvs_handle_t my_handle;
+    if (nvs_open(STATE_NAMESPACE, NVS_READONLY, &my_handle) == ESP_OK) {
+        stored_calibration_t stored;
+        size_t size = sizeof(stored);
+        esp_err_t err = nvs_get_blob(my_handle, CALIBRATION_KEY, &stored, &size);
+        if (err == ESP_OK && size == sizeof(stored) && stored.version == CALIBRATION_VERSION && stored.crc == calibration_crc(&stored)) {
+            calibration.count = stored.count;
+            memcpy(calibration.points, stored.points, sizeof(calibration.points));
+        } else if (err != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGW(TAG, "Stored calibration is invalid, ignoring it");
         }
-        cw = cw * current_level / 254;
-        ww = ww * current_level / 254;
+        nvs_close(my_handle);
+    }
 
-        set_duty(LEDC_CHANNEL_CW, cw);
-        set_duty(LEDC_CHANNEL_WW, ww);
-    } else {
-        set_duty(LEDC_CHANNEL_CW, 0);
-        set_duty(LEDC_CHANNEL_WW, 0);
+    if (!light_curve_set_calibration(&calibration)) {
+        ESP_LOGW(TAG, "Stored calibration rejected, using the default");
+        calibration = light_calibration_default;
+        light_curve_set_calibration(&calibration);
     }
+    ESP_LOGI(TAG, "Calibration with %d points", (int)calibration.count);
+}
+
+// Scenes stored with Store Scene, with the duty precomputed so that a recall
+// is a single PWM update
+typedef struct __attribute__((packed)) {
+    uint16_t group_id;
+    uint8_t scene_id;
+    uint8_t power;
+    uint8_t level;
+    uint16_t temperature;
+    uint16_t transition_time;   // 1/10 s
+    uint16_t cw;
+    uint16_t ww;
+} light_scene_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t count;
+    light_scene_t scenes[LIGHT_SCENES_MAX];
+    uint32_t crc;
+} stored_scenes_t;
 
-    light_publish_state();
+#define SCENES_KEY              "scenes"
+#define SCENES_VERSION          1
+
+// Each endpoint has its own scene table
+static stored_scenes_t scenes[LIGHT_ZONES];
+static bool scenes_deferred[LIGHT_ZONES];
+
+static uint32_t scenes_crc(const stored_scenes_t *stored)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)stored, offsetof(stored_scenes_t, crc));
 }
 
-static void save_state()
+static void save_scenes(uint8_t zone)
 {
+    if (any_effect_active()) {
+        scenes_deferred[zone] = true;
+        return;
+    }
+
+    stored_scenes_t *stored = &scenes[zone];
+    stored->version = SCENES_VERSION;
+    stored->crc = scenes_crc(stored);
+
+    char key[NVS_KEY_NAME_MAX_SIZE];
     nvs_handle_t my_handle;
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READWRITE, &my_handle));
-    ESP_ERROR_CHECK(nvs_set_u8(my_handle, "power", current_power));
-    ESP_ERROR_CHECK(nvs_set_u8(my_handle, "start_power", start_power));
-    ESP_ERROR_CHECK(nvs_set_u8(my_handle, "level", current_level));
-    ESP_ERROR_CHECK(nvs_set_u16(my_handle, "temp", current_temperature));
-    ESP_ERROR_CHECK(nvs_set_u16(my_handle, "start_temp", start_temperature));
-    ESP_ERROR_CHECK(nvs_set_u8(my_handle, "reboot", reboot_count));
+    ESP_ERROR_CHECK(nvs_open(STATE_NAMESPACE, NVS_READWRITE, &my_handle));
+    ESP_ERROR_CHECK(nvs_set_blob(my_handle, zone_key(key, SCENES_KEY, zone), stored, sizeof(*stored)));
     ESP_ERROR_CHECK(nvs_commit(my_handle));
     nvs_close(my_handle);
+    diag_count(DIAG_NVS_COMMITS, 1);
 }
 
-static void load_state()
+static void load_scenes()
 {
     nvs_handle_t my_handle;
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READONLY, &my_handle));
-    nvs_get_u8(my_handle, "power", (uint8_t*)&current_power);
-    nvs_get_u8(my_handle, "start_power", (uint8_t*)&start_power);
-    nvs_get_u8(my_handle, "level", &current_level);
-    nvs_get_u16(my_handle, "temp", &current_temperature);
-    nvs_get_u16(my_handle, "start_temp", &start_temperature);
-    nvs_get_u8(my_handle, "reboot", &reboot_count);
+    if (nvs_open(STATE_NAMESPACE, NVS_READONLY, &my_handle) != ESP_OK)
+        return;
+
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        stored_scenes_t *stored = &scenes[zone];
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        size_t size = sizeof(*stored);
+        esp_err_t err = nvs_get_blob(my_handle, zone_key(key, SCENES_KEY, zone), stored, &size);
+        if (err != ESP_OK || size != sizeof(*stored) || stored->version != SCENES_VERSION || stored->crc != scenes_crc(stored)
+                || stored->count > LIGHT_SCENES_MAX) {
+            if (err != ESP_ERR_NVS_NOT_FOUND)
+                ESP_LOGW(TAG, "Stored scenes of zone %d are invalid, ignoring them", (int)zone);
+            memset(stored, 0, sizeof(*stored));
+        }
+    }
     nvs_close(my_handle);
 }
 
+// Forget the scenes of all zones, flash is only written if there were any
+static void clear_scenes()
+{
+    nvs_handle_t my_handle;
+    bool erased = false;
+
+    ESP_ERROR_CHECK(nvs_open(STATE_NAMESPACE, NVS_READWRITE, &my_handle));
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        memset(&scenes[zone], 0, sizeof(scenes[zone]));
+        scenes_deferred[zone] = false;
+        if (nvs_erase_key(my_handle, zone_key(key, SCENES_KEY, zone)) == ESP_OK)
+            erased = true;
+    }
+    if (erased) {
+        ESP_ERROR_CHECK(nvs_commit(my_handle));
+        diag_count(DIAG_NVS_COMMITS, 1);
+    }
+    nvs_close(my_handle);
+}
+
+static light_scene_t *find_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id)
+{
+    stored_scenes_t *stored = &scenes[zone];
+    for (size_t i = 0; i < stored->count; i++) {
+        if (stored->scenes[i].group_id == group_id && stored->scenes[i].scene_id == scene_id)
+            return &stored->scenes[i];
+    }
+    return NULL;
+}
+
+static void set_scene_duty(light_scene_t *scene)
+{
+    light_duty_t duty = light_curve_duty(scene->power, scene->level, scene->temperature);
+    scene->cw = duty.cw;
+    scene->ww = duty.ww;
+}
+
+void light_flush_state()
+{
+    esp_timer_stop(state_timer);
+    flush_state();
+}
+
+static void configure_channel(const light_channel_t *channel)
+{
+    ledc_channel_config_t ledc_channel = {
+        .speed_mode     = LEDC_MODE,
+        .channel        = channel->channel,
+        .timer_sel      = LEDC_TIMER,
+        .intr_type      = LEDC_INTR_DISABLE,
+        .gpio_num       = channel->gpio,
+        .duty           = channel_duty(channel, 0), // Set duty to 0%
+        .hpoint         = 0,
+        .flags.output_invert = channel->invert
+    };
+    ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
+}
+
+int light_zone_from_endpoint(uint8_t endpoint)
+{
+    for (int zone = 0; zone < LIGHT_ZONES; zone++) {
+        if (zone_table[zone].endpoint == endpoint)
+            return zone;
+    }
+    return -1;
+}
+
+uint8_t light_zone_endpoint(uint8_t zone)
+{
+    return zone_table[zone].endpoint;
+}
+
 void light_init(void)
 {
-    // Prepare and then apply the LEDC PWM timer configuration
+    // Prepare and then apply the LEDC PWM timer configuration, shared by all channels
     ledc_timer_config_t ledc_timer = {
         .speed_mode       = LEDC_MODE,
         .timer_num        = LEDC_TIMER,
         .duty_resolution  = LEDC_DUTY_RES,
-        .freq_hz          = LEDC_FREQUENCY,  // Set output frequency at 4 kHz
-        .clk_cfg          = LEDC_AUTO_CLK
+        .freq_hz          = LEDC_FREQUENCY,
+        .clk_cfg          = LIGHT_PWM_XTAL_CLOCK ? LEDC_USE_XTAL_CLK : LEDC_AUTO_CLK
     };
     ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
 
-    // Prepare and then apply the LEDC PWM channel configuration
-    ledc_channel_config_t ledc_channel_cw = {
-        .speed_mode     = LEDC_MODE,
-        .channel        = LEDC_CHANNEL_CW,
-        .timer_sel      = LEDC_TIMER,
-        .intr_type      = LEDC_INTR_DISABLE,
-        .gpio_num       = LEDC_OUTPUT_CW,
-        .duty           = 0, // Set duty to 0%
-        .hpoint         = 0
-    };
-    ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel_cw));
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        configure_channel(&zone_table[zone].cw);
+        configure_channel(&zone_table[zone].ww);
+        reset_zone(&zones[zone]);
+    }
 
-    // Prepare and then apply the LEDC PWM channel configuration
-    ledc_channel_config_t ledc_channel_ww = {
-        .speed_mode     = LEDC_MODE,
-        .channel        = LEDC_CHANNEL_WW,
-        .timer_sel      = LEDC_TIMER,
-        .intr_type      = LEDC_INTR_DISABLE,
-        .gpio_num       = LEDC_OUTPUT_WW,
-        .duty           = 0, // Set duty to 0%
-        .hpoint         = 0
+    // Hardware fades, completion is handled by the LEDC fade ISR
+    ESP_ERROR_CHECK(ledc_fade_func_install(0));
+
+    load_calibration();
+    load_scenes();
+
+    esp_timer_create_args_t timer_cfg = {
+        .callback = state_timer_callback,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "State timer",
+        .skip_unhandled_events = true
     };
-    ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel_ww));
+    ESP_ERROR_CHECK(esp_timer_create(&timer_cfg, &state_timer));
+
+    // Don't lose a pending change on esp_restart(), e.g. after an OTA
+    ESP_ERROR_CHECK(esp_register_shutdown_handler(light_flush_state));
+}
+
+void light_effect_output(uint8_t zone, uint8_t level, uint32_t fade_ms)
+{
+    portENTER_CRITICAL(&state_lock);
+    zones[zone].effect_active = true;
+    portEXIT_CRITICAL(&state_lock);
+
+    // In the colour temperature of the zone, whatever its power
+    write_zone(zone, light_curve_duty(level != 0, level, zones[zone].temperature), fade_ms);
+}
+
+void light_effect_restore(uint8_t zone)
+{
+    portENTER_CRITICAL(&state_lock);
+    zones[zone].effect_active = false;
+    bool idle = !any_effect_active();
+    bool flush = idle && state_flush_deferred;
+    if (flush)
+        state_flush_deferred = false;
+    portEXIT_CRITICAL(&state_lock);
+
+    write_zone(zone, zones[zone].state_duty, 0);
+
+    // The last effect to end writes what was held back
+    if (!idle)
+        return;
+    if (calibration_deferred) {
+        calibration_deferred = false;
+        save_calibration();
+    }
+    for (uint8_t i = 0; i < LIGHT_ZONES; i++) {
+        if (scenes_deferred[i]) {
+            scenes_deferred[i] = false;
+            save_scenes(i);
+        }
+    }
+    if (flush) {
+        esp_timer_stop(state_timer);
+        ESP_ERROR_CHECK(esp_timer_start_once(state_timer, STATE_DEBOUNCE_US));
+    }
+}
+
+static void set_power(uint8_t zone, bool power, uint32_t fade_ms)
+{
+    ESP_LOGI(TAG, "Zone %d new state: %s", (int)zone, power ? "On" : "Off");
+    zones[zone].power = power;
+    save_state(zone);
+    update_duty(zone, fade_ms);
+}
+
+void light_set_on_off(uint8_t zone, bool power)
+{
+    set_power(zone, power, zones[zone].on_off_transition_time * 100);
+}
+
+void light_set_on_off_transition_time(uint8_t zone, uint16_t transition_time)
+{
+    ESP_LOGI(TAG, "Zone %d new on/off transition time: %d", (int)zone, (int)transition_time);
+    zones[zone].on_off_transition_time = transition_time;
+    save_state(zone);
+}
+
+void light_move_to_level(uint8_t zone, uint8_t level, uint16_t transition_time)
+{
+    if (transition_time == 0xFFFF)
+        transition_time = zones[zone].on_off_transition_time;
+    plan_transition(&zones[zone].level_transition, zones[zone].level, level, transition_time);
 }
 
-void light_set_on_off(bool power)
+void light_move_to_temperature(uint8_t zone, uint16_t temperature, uint16_t transition_time)
 {
-    ESP_LOGI(TAG, "New state: %s", power ? "On" : "Off");
-    current_power = power;
-    save_state();
-    update_duty();
+    plan_transition(&zones[zone].temperature_transition, zones[zone].temperature, temperature, transition_time);
 }
 
-void light_set_startup_on_off(uint8_t startup)
+void light_set_startup_on_off(uint8_t zone, uint8_t startup)
 {
-    ESP_LOGI(TAG, "New startup state: %d", (int)startup);
-    start_power = startup;
-    save_state();
+    ESP_LOGI(TAG, "Zone %d new startup state: %d", (int)zone, (int)startup);
+    zones[zone].start_power = startup;
+    save_state(zone);
 }
 
-void light_set_level(uint8_t level)
+void light_set_level(uint8_t zone, uint8_t level)
 {
-    if (level == 0) {
-        // Turn off, keep the stored brightness level
-        light_set_on_off(false);
+    zone_state_t *z = &zones[zone];
+
+    uint32_t fade_ms = transition_capture(&z->level_transition, level);
+    if (fade_ms)
+        // Intermediate values from the stack collapse into the planned target
+        level = z->level_transition.target;
+
+    if (level == 0 || level == 0xFF) {
+        // Turn off or on, keep the stored brightness level. A Move to Level
+        // (with On/Off) to 0 fades out over its own transition time.
+        if (z->power != (level != 0))
+            set_power(zone, level != 0, fade_ms ? fade_ms : z->on_off_transition_time * 100);
         return;
     }
-    if (level == 0xFF) {
-        // Turn on to the stored brightness level
-        light_set_on_off(true);
+    if (fade_ms && level == z->level)
         return;
+
+    ESP_LOGI(TAG, "Zone %d new brightness: %d", (int)zone, (int)level);
+    z->level = level;
+    save_state(zone);
+    update_duty(zone, fade_ms);
+}
+
+void light_set_temperature(uint8_t zone, uint16_t temperature)
+{
+    zone_state_t *z = &zones[zone];
+
+    uint32_t fade_ms = transition_capture(&z->temperature_transition, temperature);
+    if (fade_ms) {
+        temperature = z->temperature_transition.target;
+        if (temperature == z->temperature)
+            return;
     }
 
-    ESP_LOGI(TAG, "New brightness: %d", (int)level);
-    current_level = level;
-    save_state();
-    update_duty();
+    ESP_LOGI(TAG, "Zone %d new temperature: %d", (int)zone, (int)temperature);
+    z->temperature = temperature;
+    save_state(zone);
+    update_duty(zone, fade_ms);
 }
 
-void light_set_temperature(uint16_t temperature)
+void light_set_startup_temperature(uint8_t zone, uint16_t startup)
 {
-    ESP_LOGI(TAG, "New temperature: %d", (int)temperature);
-    current_temperature = temperature;
-    save_state();
-    update_duty();
+    ESP_LOGI(TAG, "Zone %d new startup temperature: %d", (int)zone, (int)startup);
+    zones[zone].start_temperature = startup;
+    save_state(zone);
 }
 
-void light_set_startup_temperature(uint16_t startup)
+void light_set_calibration(const light_calibration_t *new_calibration)
 {
-    ESP_LOGI(TAG, "New startup temperature: %d", (int)startup);
-    start_temperature = startup;
-    save_state();
+    if (!light_curve_set_calibration(new_calibration)) {
+        ESP_LOGW(TAG, "Invalid calibration ignored");
+        return;
+    }
+
+    ESP_LOGI(TAG, "New calibration with %d points", (int)new_calibration->count);
+    calibration = *new_calibration;
+    save_calibration();
+
+    // The snapshots were taken with the old mix
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        if (!scenes[zone].count)
+            continue;
+        for (size_t i = 0; i < scenes[zone].count; i++)
+            set_scene_duty(&scenes[zone].scenes[i]);
+        save_scenes(zone);
+    }
+
+    light_publish_calibration();
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++)
+        update_duty(zone, 0);
 }
 
-void light_set_defaults()
+// The entry of the scene, a new one (without a transition time) if there is none yet
+static light_scene_t *add_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id)
 {
-    save_state();
-    light_load_settings();
+    light_scene_t *scene = find_scene(zone, group_id, scene_id);
+    if (scene)
+        return scene;
+
+    if (scenes[zone].count == LIGHT_SCENES_MAX) {
+        ESP_LOGW(TAG, "Scene table of zone %d full, scene %d in group 0x%04x not stored", (int)zone, (int)scene_id, group_id);
+        return NULL;
+    }
+    scene = &scenes[zone].scenes[scenes[zone].count++];
+    *scene = (light_scene_t) { .group_id = group_id, .scene_id = scene_id };
+    return scene;
 }
 
-void light_load_settings()
+void light_store_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id)
+{
+    light_scene_t *scene = add_scene(zone, group_id, scene_id);
+    if (!scene)
+        return;
+
+    ESP_LOGI(TAG, "Zone %d store scene %d in group 0x%04x", (int)zone, (int)scene_id, group_id);
+    scene->power = zones[zone].power;
+    scene->level = zones[zone].level;
+    scene->temperature = zones[zone].temperature;
+    set_scene_duty(scene);
+    save_scenes(zone);
+}
+
+void light_add_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id, const light_scene_fields_t *fields,
+    uint16_t transition_time)
+{
+    light_scene_t *scene = add_scene(zone, group_id, scene_id);
+    if (!scene)
+        return;
+
+    ESP_LOGI(TAG, "Zone %d add scene %d in group 0x%04x, transition time %d", (int)zone, (int)scene_id, group_id,
+        (int)transition_time);
+    scene->power = fields->has_power ? fields->power : zones[zone].power;
+    scene->level = fields->has_level ? clamp_level(fields->level) : zones[zone].level;
+    scene->temperature = fields->has_temperature ? fields->temperature : zones[zone].temperature;
+    scene->transition_time = transition_time;
+    set_scene_duty(scene);
+    save_scenes(zone);
+}
+
+void light_recall_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id, uint16_t transition_time)
+{
+    zone_state_t *z = &zones[zone];
+    const light_scene_t *scene = find_scene(zone, group_id, scene_id);
+    if (!scene) {
+        ESP_LOGW(TAG, "Scene %d in group 0x%04x not stored in zone %d", (int)scene_id, group_id, (int)zone);
+        return;
+    }
+
+    if (transition_time == 0xFFFF)
+        transition_time = scene->transition_time;
+
+    ESP_LOGI(TAG, "Zone %d recall scene %d in group 0x%04x", (int)zone, (int)scene_id, group_id);
+    z->power = scene->power;
+    z->level = scene->level;
+    z->temperature = scene->temperature;
+    z->level_transition.pending = false;
+    z->temperature_transition.pending = false;
+    save_state(zone);
+    update_duty_snapshot(zone, (light_duty_t) { scene->cw, scene->ww }, transition_time * 100);
+}
+
+void light_remove_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id)
+{
+    light_scene_t *scene = find_scene(zone, group_id, scene_id);
+    if (!scene)
+        return;
+
+    *scene = scenes[zone].scenes[--scenes[zone].count];
+    save_scenes(zone);
+}
+
+void light_remove_group_scenes(uint8_t zone, uint16_t group_id)
+{
+    stored_scenes_t *stored = &scenes[zone];
+    size_t count = 0;
+    for (size_t i = 0; i < stored->count; i++) {
+        if (stored->scenes[i].group_id != group_id)
+            stored->scenes[count++] = stored->scenes[i];
+    }
+    if (count == stored->count)
+        return;
+
+    stored->count = count;
+    save_scenes(zone);
+}
+
+static void apply_startup_rules(zone_state_t *z)
+{
+    z->temperature = light_curve_startup_temperature(z->start_temperature, z->temperature);
+    z->power = light_curve_startup_power(z->start_power, z->power);
+}
+
+void light_restore_state()
 {
     load_state();
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++)
+        apply_startup_rules(&zones[zone]);
+    reset_requested = boot_count_power_cycle();
 
-    if (start_temperature != ZB_ZCL_COLOR_CONTROL_START_UP_COLOR_TEMPERATURE_USE_PREVIOUS_VALUE)
-        current_temperature = start_temperature;
-
-    switch (start_power)
-    {
-    case ZB_ZCL_ON_OFF_START_UP_ON_OFF_IS_OFF:
-        current_power = false;
-        break;
-    case ZB_ZCL_ON_OFF_START_UP_ON_OFF_IS_ON:
-        current_power = true;
-        break;
-    case ZB_ZCL_ON_OFF_START_UP_ON_OFF_IS_TOGGLE:
-        current_power = !current_power;
-        break;
-    case ZB_ZCL_ON_OFF_START_UP_ON_OFF_IS_PREVIOUS:
-    default:
-        break;
-    }
-
-    reboot_count++;
-    ESP_LOGI(TAG, "Boot attempt number %d", (int)reboot_count);
-
-    if (reboot_count >= 5) {
+    // Straight to the LEDC, the attributes are published once Zigbee is up
+    if (!reset_requested) {
+        zone_output_t outputs[LIGHT_ZONES];
+        for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+            zones[zone].state_duty = zone_duty(zone);
+            outputs[zone] = (zone_output_t) { true, zones[zone].state_duty, 0 };
+        }
+        write_outputs(outputs);
+    }
+
+    // The RTC counter runs from power-on, through the ROM and the bootloader
+    light_on_us = esp_clk_rtc_time();
+    diag_light_on(light_on_us / 1000);
+    ESP_LOGI(TAG, "Light restored %" PRId64 " ms after power-on", light_on_us / 1000);
+}
+
+void light_set_defaults()
+{
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        reset_zone(&zones[zone]);
+        apply_startup_rules(&zones[zone]);
+        save_state(zone);
+    }
+    reset_requested = false;
+
+    // The scene table of the stack starts empty as well
+    clear_scenes();
+    light_flush_state();
+    light_publish_calibration();
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++)
+        update_duty(zone, 0);
+}
+
+void light_factory_reset()
+{
+    clear_scenes();
+    esp_zb_lock_acquire(portMAX_DELAY);
+    esp_zb_factory_reset();
+    esp_zb_lock_release();
+}
+
+void light_load_settings()
+{
+    if (reset_requested) {
         ESP_LOGI(TAG, "Too many reboots, reset device");
-        esp_zb_factory_reset();
+        light_factory_reset();
         return;
     }
 
-    save_state();
-    update_duty();
+    // The output has been on since light_restore_state(), only sync the attributes
+    ESP_LOGI(TAG, "Attributes synced %" PRId64 " ms after the light came on",
+        (esp_clk_rtc_time() - light_on_us) / 1000);
+    light_publish_calibration();
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++)
+        light_publish_state(zone);
 }
 
-static void reportAttribute(uint16_t clusterID, uint16_t attributeID, void *value)
+static void setAttribute(uint8_t endpoint, uint16_t clusterID, uint16_t attributeID, void *value)
 {
-    esp_zb_zcl_report_attr_cmd_t cmd = {
-        .zcl_basic_cmd = {
-            .dst_addr_u.addr_short = 0x0000,
-            .dst_endpoint = HA_ESP_LIGHT_ENDPOINT,
-            .src_endpoint = HA_ESP_LIGHT_ENDPOINT,
-        },
-        .address_mode = ESP_ZB_APS_ADDR_MODE_16_ENDP_PRESENT,
-        .clusterID = clusterID,
-        .attributeID = attributeID,
-        .cluster_role = ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
-    };
-    esp_zb_zcl_set_attribute_val(HA_ESP_LIGHT_ENDPOINT, clusterID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, attributeID, value, false);
-    esp_zb_zcl_report_attr_cmd_req(&cmd);
+    esp_zb_zcl_set_attribute_val(endpoint, clusterID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, attributeID, value, false);
+}
+
+// Values of the reportable attributes at the last publication
+typedef struct {
+    bool valid;
+    bool power;
+    uint8_t level;
+    uint16_t temperature;
+} published_t;
+
+static published_t published[LIGHT_ZONES];
+
+void light_publish_state(uint8_t zone)
+{
+    zone_state_t *z = &zones[zone];
+    published_t *p = &published[zone];
+    uint8_t endpoint = zone_table[zone].endpoint;
+
+    // Only keep the ZCL attribute table in sync, the stack's reporting engine
+    // decides what actually needs to go on air
+    esp_zb_lock_acquire(portMAX_DELAY);
+    setAttribute(endpoint, ESP_ZB_ZCL_CLUSTER_ID_ON_OFF, ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID, &z->power);
+    setAttribute(endpoint, ESP_ZB_ZCL_CLUSTER_ID_ON_OFF, ESP_ZB_ZCL_ATTR_ON_OFF_START_UP_ON_OFF, &z->start_power);
+    setAttribute(endpoint, ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL, ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_CURRENT_LEVEL_ID, &z->level);
+    setAttribute(endpoint, ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL, ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_ON_OFF_TRANSITION_TIME_ID, &z->on_off_transition_time);
+    setAttribute(endpoint, ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL, ESP_ZB_ZCL_ATTR_COLOR_CONTROL_COLOR_TEMPERATURE_ID, &z->temperature);
+    setAttribute(endpoint, ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL, ESP_ZB_ZCL_ATTR_COLOR_CONTROL_START_UP_COLOR_TEMPERATURE_MIREDS_ID, &z->start_temperature);
+
+    if (!p->valid || z->power != p->power)
+        report_attribute(endpoint, ESP_ZB_ZCL_CLUSTER_ID_ON_OFF, ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID);
+    if (!p->valid || z->level != p->level)
+        report_attribute(endpoint, ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL, ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_CURRENT_LEVEL_ID);
+    if (!p->valid || z->temperature != p->temperature)
+        report_attribute(endpoint, ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL, ESP_ZB_ZCL_ATTR_COLOR_CONTROL_COLOR_TEMPERATURE_ID);
+    esp_zb_lock_release();
+
+    *p = (published_t) { true, z->power, z->level, z->temperature };
+}
+
+void light_publish_calibration()
+{
+    // ZCL octet string: length, then the serialized points
+    uint8_t value[1 + LIGHT_CALIBRATION_MAX_POINTS * LIGHT_CALIBRATION_POINT_SIZE];
+    value[0] = light_curve_format_calibration(&calibration, value + 1);
+
+    // One mix for the fixture, on the first endpoint
+    esp_zb_lock_acquire(portMAX_DELAY);
+    esp_zb_zcl_set_manufacturer_attribute_val(HA_ESP_LIGHT_ENDPOINT, ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+        LIGHT_MANUFACTURER_CODE, LIGHT_ATTR_CALIBRATION_ID, value, false);
+    esp_zb_lock_release();
 }
 
-void light_publish_state()
+// Default reporting configuration, until a controller sends Configure Reporting
+static const struct {
+    uint16_t cluster_id;
+    uint16_t attr_id;
+    uint16_t min_interval;
+    uint16_t max_interval;
+    uint16_t delta;
+} default_reporting[] = {
+    { ESP_ZB_ZCL_CLUSTER_ID_ON_OFF, ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID, 0, 600, 0 },
+    { ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL, ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_CURRENT_LEVEL_ID, 1, 600, 1 },
+    { ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL, ESP_ZB_ZCL_ATTR_COLOR_CONTROL_COLOR_TEMPERATURE_ID, 1, 600, 1 },
+};
+
+void light_configure_reporting()
 {
-    reportAttribute(ESP_ZB_ZCL_CLUSTER_ID_ON_OFF, ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID, &current_power);
-    reportAttribute(ESP_ZB_ZCL_CLUSTER_ID_ON_OFF, ESP_ZB_ZCL_ATTR_ON_OFF_START_UP_ON_OFF, &start_power);
-    reportAttribute(ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL, ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_CURRENT_LEVEL_ID, &current_level);
-    reportAttribute(ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL, ESP_ZB_ZCL_ATTR_COLOR_CONTROL_COLOR_TEMPERATURE_ID, &current_temperature);
-    reportAttribute(ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL, ESP_ZB_ZCL_ATTR_COLOR_CONTROL_START_UP_COLOR_TEMPERATURE_MIREDS_ID, &start_temperature);
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        for (size_t i = 0; i < sizeof(default_reporting) / sizeof(default_reporting[0]); i++) {
+            esp_zb_zcl_reporting_info_t reporting_info = {
+                .direction = ESP_ZB_ZCL_CMD_DIRECTION_TO_SRV,
+                .ep = zone_table[zone].endpoint,
+                .cluster_id = default_reporting[i].cluster_id,
+                .cluster_role = ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+                // Bindings take precedence, an unbound cluster reports to the coordinator
+                .dst.short_addr = REPORT_COORDINATOR_ADDRESS,
+                .dst.endpoint = zone_table[zone].endpoint,
+                .dst.profile_id = ESP_ZB_AF_HA_PROFILE_ID,
+                .u.send_info.min_interval = default_reporting[i].min_interval,
+                .u.send_info.max_interval = default_reporting[i].max_interval,
+                .u.send_info.def_min_interval = default_reporting[i].min_interval,
+                .u.send_info.def_max_interval = default_reporting[i].max_interval,
+                .u.send_info.delta.u16 = default_reporting[i].delta,
+                .attr_id = default_reporting[i].attr_id,
+                .manuf_code = ESP_ZB_ZCL_ATTR_NON_MANUFACTURER_SPECIFIC,
+            };
+            ESP_ERROR_CHECK(esp_zb_zcl_update_reporting_info(&reporting_info));
+        }
+    }
 }
 
 void light_boot_success()
 {
-    ESP_LOGI(TAG, "Successful boot, reset counter");
-    reboot_count = 0;
-    save_state();
+    boot_success();
 }
@@ -3,34 +3,126 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "light_curve.h"
+#include "sdkconfig.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 static const char *TAG = "ESP_ZB_CEILING_LIGHT";
 
-#define HA_ESP_LIGHT_ENDPOINT           10      /* esp light bulb device endpoint, used to process light controlling commands */
+#define HA_ESP_LIGHT_ENDPOINT           10      /* endpoint of the first zone, also carries the device-wide clusters */
+#define LIGHT_MANUFACTURER_CODE         0x1001  /* manufacturer code of the manufacturer-specific attributes */
+
+/* The PWM timer runs from the 40 MHz XTAL when that is fast enough, a clock that
+ * doesn't change with DFS and lets the CPU slow down to 40 MHz. Otherwise it
+ * runs from the 80 MHz PLL, which then must stay powered. */
+#define LIGHT_PWM_XTAL_CLOCK            ((CONFIG_LIGHT_PWM_FREQUENCY << CONFIG_LIGHT_PWM_RESOLUTION) <= 40000000)
+
+/* Manufacturer-specific Color Control attribute, octet string of LIGHT_CALIBRATION_POINT_SIZE-byte points */
+#define LIGHT_ATTR_CALIBRATION_ID       0xF000
+
+/* Each zone is a CW/WW channel pair with its own light endpoint, numbered up
+ * from HA_ESP_LIGHT_ENDPOINT. The zone arguments below are zone indexes. */
+#define LIGHT_ZONES                     CONFIG_LIGHT_ZONES
+
+/* Zone of a light endpoint, -1 for any other endpoint */
+int light_zone_from_endpoint(uint8_t endpoint);
+
+uint8_t light_zone_endpoint(uint8_t zone);
 
 void light_init(void);
 
-void light_set_on_off(bool power);
+void light_set_on_off(uint8_t zone, bool power);
+
+void light_set_on_off_transition_time(uint8_t zone, uint16_t transition_time);
+
+void light_set_startup_on_off(uint8_t zone, uint8_t startup);
+
+void light_set_level(uint8_t zone, uint8_t level);
+
+void light_set_temperature(uint8_t zone, uint16_t temperature);
+
+void light_set_startup_temperature(uint8_t zone, uint16_t startup);
+
+/* Plan a transition (in 1/10 s) for the next level/temperature update from the stack */
+void light_move_to_level(uint8_t zone, uint8_t level, uint16_t transition_time);
+
+void light_move_to_temperature(uint8_t zone, uint16_t temperature, uint16_t transition_time);
 
-void light_set_startup_on_off(uint8_t startup);
+/* Replace the CW/WW calibration of the fixture, for all zones, and store it */
+void light_set_calibration(const light_calibration_t *calibration);
 
-void light_set_level(uint8_t level);
+#define LIGHT_SCENES_MAX                16      /* per zone */
 
-void light_set_temperature(uint16_t temperature);
+/* Extension fields of an Add Scene command, the clusters it leaves out keep the zone's current values */
+typedef struct {
+    bool has_power;
+    bool power;
+    bool has_level;
+    uint8_t level;
+    bool has_temperature;
+    uint16_t temperature;
+} light_scene_fields_t;
 
-void light_set_startup_temperature(uint16_t startup);
+/* Snapshot the current state of the zone (and its PWM duty) as a scene. A scene
+ * stored over an existing one keeps its transition time, a new one has none. */
+void light_store_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id);
 
+/* Define a scene from Add Scene, transition_time in 1/10 s */
+void light_add_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id, const light_scene_fields_t *fields,
+    uint16_t transition_time);
+
+/* Apply a stored scene in one step, transition_time in 1/10 s, 0xFFFF for the scene's own */
+void light_recall_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id, uint16_t transition_time);
+
+void light_remove_scene(uint8_t zone, uint16_t group_id, uint8_t scene_id);
+
+void light_remove_group_scenes(uint8_t zone, uint16_t group_id);
+
+/* Apply the stored state with its startup rules straight to the PWM output.
+ * Early in app_main(), after light_init() and before Zigbee is started. */
+void light_restore_state();
+
+/* Factory new: reset the light state to its defaults and forget the scenes */
 void light_set_defaults();
 
+/* Leave for good: forget the scenes and factory reset the Zigbee stack. Takes the Zigbee lock. */
+void light_factory_reset();
+
+/* Rebooted into a network: publish the state restored at power-on, or factory reset
+ * if the reboot counter asked for it */
 void light_load_settings();
 
-void light_publish_state();
+/* Show an effect segment on a zone at its current colour temperature, level 0 is off.
+ * Until the last light_effect_restore() the state only changes underneath and NVS is not written. */
+void light_effect_output(uint8_t zone, uint8_t level, uint32_t fade_ms);
+
+/* Return the PWM output of the zone to its light state */
+void light_effect_restore(uint8_t zone);
+
+/* Collect the duty changes of several light_set_* calls, on any zones, and apply them once */
+void light_begin_update();
+
+/* Write the collected changes of all zones in one LEDC batch. Returns true if the PWM output was updated */
+bool light_end_update();
+
+/* Sync the ZCL attribute table of the zone's endpoint with the driver state, reports follow from
+ * the reporting configuration. Takes the Zigbee lock, must not be called from the Zigbee task. */
+void light_publish_state(uint8_t zone);
+
+/* Sync the calibration attribute with the driver. Takes the Zigbee lock. */
+void light_publish_calibration();
+
+/* Install default reporting intervals, call after esp_zb_device_register() */
+void light_configure_reporting();
 
 void light_boot_success();
 
+/* Write pending state changes to NVS now instead of after the debounce delay */
+void light_flush_state();
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,128 @@
+#include "network.h"
+#include "diag.h"
+#include "light_driver.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+#include "ha/esp_zigbee_ha_standard.h"
+
+#define NETWORK_NAMESPACE       "storage"
+#define NETWORK_KEY             "network"
+#define NETWORK_VERSION         1
+
+// The last network joined, its channel is scanned before all the others
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t channel;
+    uint16_t pan_id;
+    uint8_t extended_pan_id[8];
+    uint32_t crc;
+} stored_network_t;
+
+static stored_network_t network;
+static bool network_valid = false;
+
+static uint32_t attempts = 0;
+static uint32_t retry_ms = 0;
+static int64_t join_start_us = 0;
+
+static uint32_t network_crc(const stored_network_t *stored)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)stored, offsetof(stored_network_t, crc));
+}
+
+static void load_network()
+{
+    nvs_handle_t my_handle;
+    if (nvs_open(NETWORK_NAMESPACE, NVS_READONLY, &my_handle) != ESP_OK)
+        return;
+
+    size_t size = sizeof(network);
+    esp_err_t err = nvs_get_blob(my_handle, NETWORK_KEY, &network, &size);
+    network_valid = err == ESP_OK && size == sizeof(network) && network.version == NETWORK_VERSION
+        && network.crc == network_crc(&network)
+        && network.channel >= 11 && network.channel <= 26;
+    if (!network_valid && err != ESP_ERR_NVS_NOT_FOUND)
+        ESP_LOGW(TAG, "Stored network is invalid, ignoring it");
+    nvs_close(my_handle);
+}
+
+static void save_network()
+{
+    network.version = NETWORK_VERSION;
+    network.crc = network_crc(&network);
+
+    nvs_handle_t my_handle;
+    ESP_ERROR_CHECK(nvs_open(NETWORK_NAMESPACE, NVS_READWRITE, &my_handle));
+    ESP_ERROR_CHECK(nvs_set_blob(my_handle, NETWORK_KEY, &network, sizeof(network)));
+    ESP_ERROR_CHECK(nvs_commit(my_handle));
+    nvs_close(my_handle);
+    diag_count(DIAG_NVS_COMMITS, 1);
+}
+
+void network_init(void)
+{
+    load_network();
+    join_start_us = esp_timer_get_time();
+
+    if (!network_valid) {
+        ESP_ERROR_CHECK(esp_zb_set_primary_network_channel_set(ESP_ZB_TRANSCEIVER_ALL_CHANNELS_MASK));
+        return;
+    }
+
+    // BDB steering scans the primary set and falls back to the secondary one
+    uint32_t mask = 1UL << network.channel;
+    ESP_LOGI(TAG, "Last network on channel %d, PAN ID 0x%04hx", (int)network.channel, network.pan_id);
+    ESP_ERROR_CHECK(esp_zb_set_primary_network_channel_set(mask));
+    ESP_ERROR_CHECK(esp_zb_set_secondary_network_channel_set(ESP_ZB_TRANSCEIVER_ALL_CHANNELS_MASK & ~mask));
+}
+
+uint32_t network_retry_delay_ms(void)
+{
+    if (retry_ms < NETWORK_RETRY_MAX_MS)
+        retry_ms = retry_ms ? retry_ms * 2 : NETWORK_RETRY_MIN_MS;
+    if (retry_ms > NETWORK_RETRY_MAX_MS)
+        retry_ms = NETWORK_RETRY_MAX_MS;
+    attempts++;
+
+    uint32_t delay_ms = retry_ms / 2 + esp_random() % (retry_ms / 2 + 1);
+    ESP_LOGI(TAG, "Commissioning attempt %" PRIu32 " failed, retrying in %" PRIu32 " ms", attempts, delay_ms);
+    return delay_ms;
+}
+
+void network_joined(void)
+{
+    uint32_t join_ms = (esp_timer_get_time() - join_start_us) / 1000;
+    ESP_LOGI(TAG, "Network joined in %" PRIu32 " ms after %" PRIu32 " failed attempts", join_ms, attempts);
+    diag_network_joined(join_ms, attempts);
+    attempts = 0;
+    retry_ms = 0;
+
+    stored_network_t joined = {
+        .channel = esp_zb_get_current_channel(),
+        .pan_id = esp_zb_get_pan_id(),
+    };
+    esp_zb_get_extended_pan_id(joined.extended_pan_id);
+    if (network_valid && joined.channel == network.channel && joined.pan_id == network.pan_id
+            && memcmp(joined.extended_pan_id, network.extended_pan_id, sizeof(joined.extended_pan_id)) == 0)
+        return;
+
+    network = joined;
+    network_valid = true;
+    save_network();
+}
+
+void network_left(void)
+{
+    join_start_us = esp_timer_get_time();
+    attempts = 0;
+    retry_ms = 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Joining and rejoining the network: the channel of the last network is
+ * scanned first and retries back off, so that a building full of lights
+ * powered on at once doesn't flood the coordinator. Zigbee task only.
+ */
+
+#define NETWORK_RETRY_MIN_MS            1000
+#define NETWORK_RETRY_MAX_MS            (5 * 60 * 1000)
+
+/* Set the channel masks from the stored network, before esp_zb_start() */
+void network_init(void);
+
+/* Delay before the next commissioning attempt: exponential backoff with a random
+ * per-device jitter, between half and all of the doubled delay */
+uint32_t network_retry_delay_ms(void);
+
+/* Joined or rejoined: store the channel and PAN, reset the backoff */
+void network_joined(void);
+
+/* Left the network, the time to rejoin counts from here */
+void network_left(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -1,53 +1,592 @@
 #include "ota.h"
 
+#include <esp_app_format.h>
 #include <esp_err.h>
 #include <esp_log.h>
 #include <esp_ota_ops.h>
+#include <esp_rom_crc.h>
 #include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <mbedtls/sha256.h>
+#include <nvs_flash.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <string.h>
-#include <zlib.h>
+
+#include "diag.h"
+#include "ota_codec.h"
+#include "ota_delta.h"
+#include "ota_parser.h"
 
 static const char *TAG = "ESP_ZB_CEILING_LIGHT_OTA";
 
-bool zlib_init = false;
+#define OTA_SECTOR_SIZE         4096                        // flash is written in whole sectors
+#define OTA_RECEIVE_MAX_RATE    6400                        // bytes/s, 64-byte blocks at most every 10 ms
+#define OTA_ERASE_MAX_MS        400                         // worst-case sector erase, datasheet tSE max
+// Received, still compressed data: what arrives while the writer erases two
+// sectors back to back (one read can fill more than one)
+#define OTA_STREAM_SIZE         (2 * OTA_RECEIVE_MAX_RATE * OTA_ERASE_MAX_MS / 1000)
+#define OTA_WRITER_STACK_SIZE   4096
+#define OTA_WRITER_PRIORITY     4                           // below Zigbee_main
+
+#define OTA_FILE_HEADER_SIZE        56      // create-ota.py writes no optional header fields
+#define OTA_TAG_UPGRADE_IMAGE       0x0000  // zlib stream, 32 KB window
+#define OTA_TAG_COMPRESSED_IMAGE    0xF000  // codec header followed by the compressed image
+#define OTA_TAG_DELTA_IMAGE         0xF001  // delta header followed by the compressed patch
+#define OTA_TAG_IMAGE_HASH          0xF002  // sizes and SHA-256 of an image sub-element and its output
+#define OTA_CODEC_HEADER_SIZE       4       // codec, window bits, flags, reserved
+#define OTA_DELTA_HEADER_SIZE       40      // codec, window bits, flags, reserved, base size, base SHA-256
+#define OTA_IMAGE_HASH_SIZE         74      // tag, input size and SHA-256, output size and SHA-256
+#define OTA_DELTA_FLAG_FALLBACK     0x01    // a full image sub-element follows the patch
+#define OTA_FLAG_SEGMENTED          0x02    // independently compressed segments, each preceded by its length
+#define OTA_SEGMENT_HEADER_SIZE     4
+
+#define OTA_CHECKPOINT_NAMESPACE    "ota"
+#define OTA_CHECKPOINT_KEY          "checkpoint"
+#define OTA_CHECKPOINT_VERSION      2
+
+typedef struct __attribute__((packed)) {
+    uint16_t tag;               // image sub-element this applies to
+    uint32_t input_size;        // sub-element data after the codec or delta header
+    uint8_t input_sha256[32];
+    uint32_t output_size;       // written to the partition
+    uint8_t output_sha256[32];
+} ota_image_hash_t;
+
+_Static_assert(sizeof(ota_image_hash_t) == OTA_IMAGE_HASH_SIZE, "image hash layout");
+
+// Saved at the end of every segment, so an interrupted download can continue there
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint16_t manufacturer_code;
+    uint16_t image_type;
+    uint32_t file_version;
+    uint32_t image_size;
+    uint32_t data_start;        // payload offset of the image sub-element data
+    uint32_t data_size;
+    uint32_t data_consumed;     // up to the end of the last complete segment
+    uint8_t codec;
+    uint8_t window_bits;
+    uint32_t base_size;         // zero for a full image
+    uint8_t base_sha256[32];
+    ota_delta_state_t delta;
+    uint32_t written;
+    uint8_t written_sha256[32];
+    uint8_t verify;             // expected holds the output size and hash
+    ota_image_hash_t expected;
+    uint32_t crc;
+} ota_checkpoint_t;
+
 static const esp_partition_t *s_ota_partition = NULL;
-static esp_ota_handle_t s_ota_handle = 0;
-z_stream zlib_stream;
+static const ota_codec_t *s_ota_codec = NULL;
+static uint8_t s_ota_window_bits = 0;
+static bool s_ota_segmented = false;
+static const esp_partition_t *s_ota_base = NULL;   // running partition when applying a patch
 
-uint8_t ota_header[6];
-size_t ota_header_len = 0;
-bool ota_upgrade_subelement = false;
-size_t ota_data_len = 0;
+static uint8_t ota_running_sha256[32];
+static bool ota_running_sha256_valid = false;
+
+static ota_parser_t ota_parser;
+bool ota_upgrade_subelement = false;        // an image sub-element was selected
+bool ota_upgrade_received = false;          // ...and received completely
 uint64_t ota_last_receive_us = 0;
 size_t ota_receive_not_logged = 0;
 
+// The Zigbee task only queues received data, the writer task inflates it
+// and writes whole sectors to flash
+static StreamBufferHandle_t ota_stream = NULL;
+// All OTA memory is static, so a download can't fail on a fragmented heap.
+// The writer task is created on the first OTA and waits for the next one after it.
+static uint8_t ota_stream_storage[OTA_STREAM_SIZE + 1];
+static StaticStreamBuffer_t ota_stream_buffer;
+static StackType_t ota_writer_stack[OTA_WRITER_STACK_SIZE];
+static StaticTask_t ota_writer_tcb;
+static StaticSemaphore_t ota_writer_done_buffer;
+static TaskHandle_t ota_writer_task = NULL;
+static SemaphoreHandle_t ota_writer_done = NULL;
+static atomic_bool ota_writer_running = false;
+static atomic_bool ota_writer_stop = false;
+static atomic_bool ota_writer_finish = false;
+static atomic_bool ota_writer_failed = false;
+static bool ota_verify_pending = false;     // resumed, flash not checked against the checkpoint yet
+static uint8_t ota_sector[OTA_SECTOR_SIZE];
+static size_t ota_sector_len = 0;
+static size_t ota_flash_offset = 0;         // partition offset of the sector being filled
+static mbedtls_sha256_context ota_sha256;   // everything handed to the sector buffer
+
+// Writer position in the image sub-element data
+static ota_checkpoint_t ota_checkpoint;
+static size_t ota_consumed = 0;
+static uint8_t ota_segment_header[OTA_SEGMENT_HEADER_SIZE];
+static size_t ota_segment_header_len = 0;
+static size_t ota_segment_remaining = 0;
+static size_t ota_output_limit = 0;         // declared output size, or the partition size
+
+// Integrity of the selected image sub-element, checked as soon as it ends
+static uint16_t ota_image_tag = 0;
+static bool ota_hash_pending = false;       // hash sub-element seen, image not yet
+static bool ota_input_hashing = false;
+static bool ota_input_digest_valid = false;
+static uint8_t ota_input_digest[32];
+static mbedtls_sha256_context ota_input_sha256;
+
+static uint64_t ota_start_us = 0;
+static size_t ota_received = 0;
+static size_t ota_resumed = 0;
+static uint32_t ota_max_stall_us = 0;
+
+static uint32_t get_u32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// The partition is written directly rather than through esp_ota_write(), so
+// that a download can continue in the middle of it
+static bool ota_write_sector()
+{
+    if (ota_sector_len == 0) {
+        return true;
+    }
+
+    if (ota_flash_offset == 0 && ota_sector[0] != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE(TAG, "OTA data is not an app image");
+        return false;
+    }
+
+    esp_err_t err = esp_partition_erase_range(s_ota_partition, ota_flash_offset, OTA_SECTOR_SIZE);
+    if (err == ESP_OK) {
+        err = esp_partition_write(s_ota_partition, ota_flash_offset, ota_sector, ota_sector_len);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error writing OTA: %d", err);
+        return false;
+    }
+
+    // A partial sector stays in the buffer and is written again when it is full
+    if (ota_sector_len == OTA_SECTOR_SIZE) {
+        ota_flash_offset += OTA_SECTOR_SIZE;
+        ota_sector_len = 0;
+    }
+    return true;
+}
+
+// Output of the patch interpreter
+static bool ota_output(const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        size_t chunk = OTA_SECTOR_SIZE - ota_sector_len;
+        if (chunk > size)
+            chunk = size;
+
+        if (ota_flash_offset + ota_sector_len + chunk > ota_output_limit) {
+            ESP_LOGE(TAG, "OTA image larger than %zu bytes", ota_output_limit);
+            return false;
+        }
+
+        memcpy(ota_sector + ota_sector_len, data, chunk);
+        mbedtls_sha256_update(&ota_sha256, data, chunk);
+        ota_sector_len += chunk;
+        data += chunk;
+        size -= chunk;
+
+        if (ota_sector_len == OTA_SECTOR_SIZE && !ota_write_sector()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static ota_codec_status_t ota_decode(const uint8_t *data, size_t size, bool finish)
+{
+    uint8_t patch[256];
+    ota_codec_buf_t buf = {
+        .next_in = data,
+        .avail_in = size,
+    };
+
+    while (1) {
+        // A full image is decoded straight into the sector buffer, a patch
+        // goes through the interpreter first
+        if (s_ota_base) {
+            buf.next_out = patch;
+            buf.avail_out = sizeof(patch);
+        } else {
+            buf.next_out = ota_sector + ota_sector_len;
+            buf.avail_out = OTA_SECTOR_SIZE - ota_sector_len;
+        }
+
+        ota_codec_status_t status = s_ota_codec->decode(&buf, finish);
+        if (status == OTA_CODEC_ERROR) {
+            return status;
+        }
+
+        if (s_ota_base) {
+            if (!ota_delta_apply(patch, sizeof(patch) - buf.avail_out)) {
+                return OTA_CODEC_ERROR;
+            }
+        } else {
+            size_t len = OTA_SECTOR_SIZE - buf.avail_out;
+            if (ota_flash_offset + len > ota_output_limit) {
+                ESP_LOGE(TAG, "OTA image larger than %zu bytes", ota_output_limit);
+                return OTA_CODEC_ERROR;
+            }
+            mbedtls_sha256_update(&ota_sha256, ota_sector + ota_sector_len, len - ota_sector_len);
+            ota_sector_len = len;
+            if (ota_sector_len == OTA_SECTOR_SIZE && !ota_write_sector()) {
+                return OTA_CODEC_ERROR;
+            }
+        }
+
+        if (status == OTA_CODEC_END || (buf.avail_in == 0 && buf.avail_out > 0)) {
+            return status;
+        }
+    }
+}
+
+static uint32_t ota_checkpoint_crc(const ota_checkpoint_t *checkpoint)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)checkpoint, offsetof(ota_checkpoint_t, crc));
+}
+
+static void ota_checkpoint_erase()
+{
+    nvs_handle_t my_handle;
+    if (nvs_open(OTA_CHECKPOINT_NAMESPACE, NVS_READWRITE, &my_handle) == ESP_OK) {
+        nvs_erase_key(my_handle, OTA_CHECKPOINT_KEY);
+        nvs_commit(my_handle);
+        nvs_close(my_handle);
+        diag_count(DIAG_NVS_COMMITS, 1);
+    }
+}
+
+// Called by the writer at the end of a segment
+static bool ota_checkpoint_save()
+{
+    // Everything before the checkpoint must be in flash first
+    if (!ota_write_sector()) {
+        return false;
+    }
+
+    ota_checkpoint.data_consumed = ota_consumed;
+    if (s_ota_base) {
+        ota_delta_save(&ota_checkpoint.delta);
+    }
+    ota_checkpoint.written = ota_flash_offset + ota_sector_len;
+
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_clone(&sha256, &ota_sha256);
+    mbedtls_sha256_finish(&sha256, ota_checkpoint.written_sha256);
+    mbedtls_sha256_free(&sha256);
+
+    ota_checkpoint.crc = ota_checkpoint_crc(&ota_checkpoint);
+
+    nvs_handle_t my_handle;
+    esp_err_t err = nvs_open(OTA_CHECKPOINT_NAMESPACE, NVS_READWRITE, &my_handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(my_handle, OTA_CHECKPOINT_KEY, &ota_checkpoint, sizeof(ota_checkpoint));
+        if (err == ESP_OK)
+            err = nvs_commit(my_handle);
+        nvs_close(my_handle);
+        diag_count(DIAG_NVS_COMMITS, 1);
+    }
+    if (err != ESP_OK) {
+        // Not fatal, the download just cannot continue from here
+        ESP_LOGW(TAG, "Error saving OTA checkpoint: %d", err);
+    }
+    return true;
+}
+
+static bool ota_inflate(const uint8_t *data, size_t size)
+{
+    if (!s_ota_segmented) {
+        return ota_decode(data, size, false) != OTA_CODEC_ERROR;
+    }
+
+    while (size > 0) {
+        if (ota_segment_header_len < OTA_SEGMENT_HEADER_SIZE) {
+            ota_segment_header[ota_segment_header_len++] = data[0];
+            data++;
+            size--;
+            ota_consumed++;
+
+            if (ota_segment_header_len == OTA_SEGMENT_HEADER_SIZE) {
+                // Every segment is a complete stream of its own
+                ota_segment_remaining = get_u32(ota_segment_header);
+                s_ota_codec->end();
+                if (ota_segment_remaining == 0 || !s_ota_codec->init(s_ota_window_bits)) {
+                    ESP_LOGE(TAG, "Invalid OTA segment");
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        size_t chunk = size < ota_segment_remaining ? size : ota_segment_remaining;
+        ota_segment_remaining -= chunk;
+
+        ota_codec_status_t status = ota_decode(data, chunk, ota_segment_remaining == 0);
+        if (status == OTA_CODEC_ERROR) {
+            return false;
+        }
+
+        data += chunk;
+        size -= chunk;
+        ota_consumed += chunk;
+
+        if (ota_segment_remaining == 0) {
+            if (status != OTA_CODEC_END) {
+                ESP_LOGE(TAG, "OTA segment truncated");
+                return false;
+            }
+
+            ota_segment_header_len = 0;
+            if (!ota_checkpoint_save()) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool ota_inflate_finish()
+{
+    if (s_ota_segmented) {
+        if (ota_segment_header_len || ota_segment_remaining) {
+            ESP_LOGE(TAG, "OTA image truncated");
+            return false;
+        }
+    } else if (ota_decode(NULL, 0, true) == OTA_CODEC_ERROR) {
+        return false;
+    }
+
+    if (s_ota_base && !ota_delta_finish()) {
+        return false;
+    }
+    return ota_write_sector();
+}
+
+// Hash what a resumed download already has in flash, in the writer before it
+// takes new data. This also leaves the hash ready to continue.
+static bool ota_verify_written()
+{
+    uint8_t digest[32];
+
+    for (size_t offset = 0; offset < ota_checkpoint.written; offset += OTA_SECTOR_SIZE) {
+        size_t len = ota_checkpoint.written - offset < OTA_SECTOR_SIZE ? ota_checkpoint.written - offset : OTA_SECTOR_SIZE;
+        if (esp_partition_read(s_ota_partition, offset, ota_sector, len) != ESP_OK) {
+            return false;
+        }
+        mbedtls_sha256_update(&ota_sha256, ota_sector, len);
+    }
+
+    mbedtls_sha256_context check;
+    mbedtls_sha256_init(&check);
+    mbedtls_sha256_clone(&check, &ota_sha256);
+    mbedtls_sha256_finish(&check, digest);
+    mbedtls_sha256_free(&check);
+    if (memcmp(digest, ota_checkpoint.written_sha256, sizeof(digest))) {
+        ESP_LOGW(TAG, "OTA partition does not match the checkpoint");
+        return false;
+    }
+
+    // The last, partial sector is read back and written again when it is full
+    ota_flash_offset = ota_checkpoint.written & ~(OTA_SECTOR_SIZE - 1);
+    ota_sector_len = ota_checkpoint.written - ota_flash_offset;
+    return !ota_sector_len || esp_partition_read(s_ota_partition, ota_flash_offset, ota_sector, ota_sector_len) == ESP_OK;
+}
+
+static void ota_writer_run()
+{
+    uint8_t buf[256];
+
+    // Data received meanwhile waits in the stream. On a mismatch the
+    // download fails, and without the checkpoint the next one starts over.
+    if (ota_verify_pending) {
+        ota_verify_pending = false;
+        if (!ota_verify_written()) {
+            ota_checkpoint_erase();
+            atomic_store(&ota_writer_failed, true);
+            return;
+        }
+    }
+
+    while (!atomic_load(&ota_writer_stop)) {
+        size_t size = xStreamBufferReceive(ota_stream, buf, sizeof(buf), pdMS_TO_TICKS(100));
+        if (size > 0) {
+            if (!ota_inflate(buf, size)) {
+                atomic_store(&ota_writer_failed, true);
+                break;
+            }
+        } else if (atomic_load(&ota_writer_finish) && xStreamBufferIsEmpty(ota_stream)) {
+            if (!ota_inflate_finish()) {
+                atomic_store(&ota_writer_failed, true);
+            }
+            break;
+        }
+    }
+}
+
+static void ota_writer(void *pvParameters)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        ota_writer_run();
+        xSemaphoreGive(ota_writer_done);
+    }
+}
+
+static void ota_writer_join()
+{
+    if (atomic_load(&ota_writer_running)) {
+        xSemaphoreTake(ota_writer_done, portMAX_DELAY);
+        atomic_store(&ota_writer_running, false);
+    }
+}
+
 void ota_reset()
 {
+    atomic_store(&ota_writer_stop, true);
+    ota_writer_join();
+
+    // Whatever was written stays in the partition, with the checkpoint
+    // pointing into it for the next attempt
     if (s_ota_partition) {
-        esp_ota_abort(s_ota_handle);
+        mbedtls_sha256_free(&ota_sha256);
+        mbedtls_sha256_free(&ota_input_sha256);
         s_ota_partition = NULL;
     }
 
-    if (zlib_init) {
-        inflateEnd(&zlib_stream);
-        zlib_init = false;
+    if (s_ota_codec) {
+        s_ota_codec->end();
+        s_ota_codec = NULL;
     }
+    s_ota_base = NULL;
+    ota_sector_len = 0;
 }
 
-bool ota_start()
+bool ota_set_codec(uint8_t id, uint8_t window_bits)
 {
-    zlib_init = false;
-    s_ota_partition = NULL;
-    s_ota_handle = 0;
+    const ota_codec_t *codec = ota_codec_get(id);
+    if (!codec) {
+        ESP_LOGE(TAG, "OTA codec %u not supported", id);
+        return false;
+    }
 
-    memset(&zlib_stream, 0, sizeof(zlib_stream));
-    int ret = inflateInit(&zlib_stream);
-    if (ret == Z_OK) {
-        zlib_init = true;
-    } else {
-        ESP_LOGE(TAG, "zlib init failed: %d", ret);
+    if (id != OTA_CODEC_NONE && window_bits > OTA_CODEC_MAX_WINDOW_BITS) {
+        ESP_LOGE(TAG, "OTA window bits %u, this build takes at most %d", window_bits, OTA_CODEC_MAX_WINDOW_BITS);
+        return false;
+    }
+
+    if (!codec->init(window_bits)) {
+        ESP_LOGE(TAG, "OTA codec %s with window bits %u not supported", codec->name, window_bits);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "OTA codec %s, window bits %u", codec->name, window_bits);
+    s_ota_codec = codec;
+    s_ota_window_bits = window_bits;
+    ota_checkpoint.codec = id;
+    ota_checkpoint.window_bits = window_bits;
+    return true;
+}
+
+// Check a patch's base against the running image before anything is written
+static bool ota_delta_base_matches(const uint8_t *sha256, size_t size)
+{
+    const esp_partition_t *running = esp_ota_get_running_partition();
+
+    if (!ota_running_sha256_valid) {
+        esp_err_t err = esp_partition_get_sha256(running, ota_running_sha256);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Error hashing running image: %d", err);
+            return false;
+        }
+        ota_running_sha256_valid = true;
+    }
+
+    return size <= running->size && !memcmp(sha256, ota_running_sha256, sizeof(ota_running_sha256));
+}
+
+static bool ota_set_delta(const uint8_t *sha256, size_t base_size)
+{
+    if (!ota_delta_base_matches(sha256, base_size)) {
+        return false;
+    }
+
+    s_ota_base = esp_ota_get_running_partition();
+    ota_delta_init(s_ota_base, base_size, ota_output);
+    ota_checkpoint.base_size = base_size;
+    memcpy(ota_checkpoint.base_sha256, sha256, sizeof(ota_checkpoint.base_sha256));
+    ESP_LOGI(TAG, "OTA patch against running image (%zu bytes)", base_size);
+    return true;
+}
+
+// Continue an interrupted download of the same image from its last checkpoint
+static bool ota_resume(const esp_zb_zcl_ota_upgrade_value_message_t *message)
+{
+    ota_checkpoint_t checkpoint;
+    size_t size = sizeof(checkpoint);
+    nvs_handle_t my_handle;
+
+    if (nvs_open(OTA_CHECKPOINT_NAMESPACE, NVS_READONLY, &my_handle) != ESP_OK)
+        return false;
+    esp_err_t err = nvs_get_blob(my_handle, OTA_CHECKPOINT_KEY, &checkpoint, &size);
+    nvs_close(my_handle);
+
+    if (err != ESP_OK || size != sizeof(checkpoint) || checkpoint.version != OTA_CHECKPOINT_VERSION
+            || checkpoint.crc != ota_checkpoint_crc(&checkpoint)) {
+        return false;
+    }
+
+    if (checkpoint.manufacturer_code != message->ota_header.manufacturer_code
+            || checkpoint.image_type != message->ota_header.image_type
+            || checkpoint.file_version != message->ota_header.file_version
+            || checkpoint.image_size != message->ota_header.image_size) {
+        ESP_LOGI(TAG, "OTA checkpoint is for another image");
+        ota_checkpoint_erase();
+        return false;
+    }
+
+    if (!ota_set_codec(checkpoint.codec, checkpoint.window_bits)
+            || (checkpoint.base_size && !ota_set_delta(checkpoint.base_sha256, checkpoint.base_size))) {
         return false;
     }
+    if (s_ota_base) {
+        ota_delta_restore(&checkpoint.delta);
+    }
+
+    ota_checkpoint = checkpoint;
+    ota_image_tag = checkpoint.base_size ? OTA_TAG_DELTA_IMAGE : OTA_TAG_COMPRESSED_IMAGE;
+    ota_output_limit = checkpoint.verify ? checkpoint.expected.output_size : s_ota_partition->size;
+    s_ota_segmented = true;
+    ota_consumed = checkpoint.data_consumed;
+    ota_upgrade_subelement = true;
+    ota_input_hashing = false;
+    // A checkpoint after the last segment ends the sub-element right away
+    if (!ota_parser_resume(&ota_parser, checkpoint.data_start + checkpoint.data_consumed,
+            ota_image_tag, checkpoint.data_size - checkpoint.data_consumed)) {
+        return false;
+    }
+    ota_resumed = checkpoint.written;
+    ota_verify_pending = true;
+
+    ESP_LOGI(TAG, "OTA resuming at offset %zu, %" PRIu32 " bytes already written",
+        ota_parser.offset, checkpoint.written);
+    return true;
+}
+
+bool ota_start(const esp_zb_zcl_ota_upgrade_value_message_t *message)
+{
+    s_ota_partition = NULL;
+    s_ota_codec = NULL;
+    s_ota_segmented = false;
+    s_ota_base = NULL;
 
     s_ota_partition = esp_ota_get_next_update_partition(NULL);
     if (!s_ota_partition) {
@@ -55,83 +594,276 @@ bool ota_start()
         return false;
     }
 
-    esp_err_t err = esp_ota_begin(s_ota_partition, OTA_WITH_SEQUENTIAL_WRITES, &s_ota_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error starting OTA: %d", err);
-        s_ota_partition = NULL;
-        return false;
+    if (!ota_writer_task) {
+        ota_stream = xStreamBufferCreateStatic(OTA_STREAM_SIZE, 1, ota_stream_storage, &ota_stream_buffer);
+        ota_writer_done = xSemaphoreCreateBinaryStatic(&ota_writer_done_buffer);
+        ota_writer_task = xTaskCreateStatic(ota_writer, "OTA_writer", OTA_WRITER_STACK_SIZE, NULL, OTA_WRITER_PRIORITY,
+            ota_writer_stack, &ota_writer_tcb);
     }
+    xStreamBufferReset(ota_stream);
+
+    mbedtls_sha256_init(&ota_sha256);
+    mbedtls_sha256_starts(&ota_sha256, 0);
+    mbedtls_sha256_init(&ota_input_sha256);
+    ota_input_hashing = false;
+    ota_input_digest_valid = false;
+    ota_hash_pending = false;
+    ota_image_tag = 0;
+    ota_output_limit = s_ota_partition->size;
+    ota_sector_len = 0;
+    ota_flash_offset = 0;
+    ota_consumed = 0;
+    ota_segment_header_len = 0;
+    ota_segment_remaining = 0;
+    ota_start_us = esp_timer_get_time();
+    ota_received = 0;
+    ota_resumed = 0;
+    ota_max_stall_us = 0;
+    ota_verify_pending = false;
+
+    if (ota_resume(message)) {
+        // Ask the server for the rest of the file only
+        uint32_t file_offset = OTA_FILE_HEADER_SIZE + ota_parser.offset;
+        esp_zb_zcl_set_attribute_val(message->info.dst_endpoint, ESP_ZB_ZCL_CLUSTER_ID_OTA_UPGRADE,
+            ESP_ZB_ZCL_CLUSTER_CLIENT_ROLE, ESP_ZB_ZCL_ATTR_OTA_UPGRADE_FILE_OFFSET_ID, &file_offset, false);
+    } else {
+        if (s_ota_codec) {
+            s_ota_codec->end();
+            s_ota_codec = NULL;
+        }
+        s_ota_base = NULL;
+        s_ota_segmented = false;
+        mbedtls_sha256_free(&ota_sha256);
+        mbedtls_sha256_init(&ota_sha256);
+        mbedtls_sha256_starts(&ota_sha256, 0);
+        ota_sector_len = 0;
+        ota_flash_offset = 0;
+        ota_consumed = 0;
+        ota_checkpoint = (ota_checkpoint_t) {
+            .version = OTA_CHECKPOINT_VERSION,
+            .manufacturer_code = message->ota_header.manufacturer_code,
+            .image_type = message->ota_header.image_type,
+            .file_version = message->ota_header.file_version,
+            .image_size = message->ota_header.image_size,
+        };
+    }
+
+    atomic_store(&ota_writer_stop, false);
+    atomic_store(&ota_writer_finish, false);
+    atomic_store(&ota_writer_failed, false);
 
+    atomic_store(&ota_writer_running, true);
+    xTaskNotifyGive(ota_writer_task);
     return true;
 }
 
-bool ota_write(const uint8_t *data, size_t size, bool flush)
+static bool ota_check_input()
 {
-    uint8_t buf[256];
+    const ota_image_hash_t *expected = &ota_checkpoint.expected;
 
-    if (!s_ota_partition) {
+    if (!ota_input_digest_valid) {
+        // Resumed download, only the output can be checked
+        return true;
+    }
+
+    if (ota_checkpoint.data_size != expected->input_size
+            || memcmp(ota_input_digest, expected->input_sha256, sizeof(ota_input_digest))) {
+        ESP_LOGE(TAG, "OTA sub-element %04x hash mismatch", ota_image_tag);
         return false;
     }
 
-    zlib_stream.avail_in = size;
-    zlib_stream.next_in = data;
+    ESP_LOGI(TAG, "OTA sub-element %04x hash verified", ota_image_tag);
+    return true;
+}
 
-    do {
-        zlib_stream.avail_out = sizeof(buf);
-        zlib_stream.next_out = buf;
+// The image sub-element has been received completely
+static bool ota_input_end()
+{
+    if (!ota_input_hashing) {
+        return true;
+    }
 
-        int ret = inflate(&zlib_stream, flush ? Z_FINISH : Z_NO_FLUSH);
-        if (ret == Z_STREAM_ERROR || ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
-            ESP_LOGE(TAG, "zlib error: %d", ret);
-            esp_ota_abort(s_ota_handle);
-            s_ota_partition = NULL;
-            return false;
-        }
+    mbedtls_sha256_finish(&ota_input_sha256, ota_input_digest);
+    ota_input_hashing = false;
+    ota_input_digest_valid = true;
+    return !ota_checkpoint.verify || ota_check_input();
+}
 
-        size_t available = sizeof(buf) - zlib_stream.avail_out;
-        if (available > 0) {
-            esp_err_t err = esp_ota_write(s_ota_handle, buf, available);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Error writing OTA: %d", err);
-                esp_ota_abort(s_ota_handle);
-                s_ota_partition = NULL;
-                return false;
+// A hash sub-element normally comes before the image it describes; after it
+// for the legacy layout, where the image has to be the first sub-element
+static bool ota_set_image_hash(const uint8_t *data)
+{
+    ota_image_hash_t hash;
+    memcpy(&hash, data, sizeof(hash));
+
+    if (!ota_upgrade_subelement) {
+        ota_checkpoint.expected = hash;
+        ota_hash_pending = true;
+        return true;
+    }
+
+    if (ota_checkpoint.verify || !ota_upgrade_received || hash.tag != ota_image_tag) {
+        // For another image in the file
+        return true;
+    }
+
+    ota_checkpoint.expected = hash;
+    ota_checkpoint.verify = true;
+    return ota_check_input();
+}
+
+static ota_parser_action_t ota_hash_begin(uint16_t tag, const uint8_t *header, size_t length)
+{
+    return ota_set_image_hash(header) ? OTA_PARSER_SKIP : OTA_PARSER_ABORT;
+}
+
+// Choose whether to write an image sub-element, its fixed header already read
+static ota_parser_action_t ota_image_begin(uint16_t tag, const uint8_t *header, size_t length)
+{
+    if (ota_upgrade_subelement) {
+        // Only one image is used, e.g. the full image following an applied patch is skipped
+        ESP_LOGD(TAG, "OTA skipping sub-element %04x (%zu bytes)", tag, length);
+        return OTA_PARSER_SKIP;
+    }
+
+    bool ok = false;
+    if (tag == OTA_TAG_UPGRADE_IMAGE) {
+        ok = ota_set_codec(OTA_CODEC_ZLIB, 15);
+    } else if (tag == OTA_TAG_COMPRESSED_IMAGE) {
+        ok = ota_set_codec(header[0], header[1]);
+        s_ota_segmented = header[2] & OTA_FLAG_SEGMENTED;
+    } else if (tag == OTA_TAG_DELTA_IMAGE) {
+        if (!ota_set_delta(&header[8], get_u32(&header[4]))) {
+            if (header[2] & OTA_DELTA_FLAG_FALLBACK) {
+                ESP_LOGW(TAG, "OTA patch base does not match the running image, using the full image");
+                ota_hash_pending = false;
+                return OTA_PARSER_SKIP;
             }
+            ESP_LOGE(TAG, "OTA patch base does not match the running image, a full image is required");
+            return OTA_PARSER_ABORT;
+        }
+        ok = ota_set_codec(header[0], header[1]);
+        s_ota_segmented = header[2] & OTA_FLAG_SEGMENTED;
+    }
+
+    if (ok && ota_hash_pending && ota_checkpoint.expected.tag == tag) {
+        const ota_image_hash_t *expected = &ota_checkpoint.expected;
+
+        if (expected->input_size != length) {
+            ESP_LOGE(TAG, "OTA sub-element size %zu, expected %" PRIu32, length, expected->input_size);
+            ok = false;
+        } else if (expected->output_size > s_ota_partition->size) {
+            ESP_LOGE(TAG, "OTA image size %" PRIu32 " larger than the partition", expected->output_size);
+            ok = false;
+        } else {
+            ota_checkpoint.verify = true;
+            ota_output_limit = expected->output_size;
         }
-    } while (zlib_stream.avail_in > 0 || zlib_stream.avail_out == 0);
+    }
+    ota_hash_pending = false;
+
+    if (!ok) {
+        return OTA_PARSER_ABORT;
+    }
 
+    ota_image_tag = tag;
+    mbedtls_sha256_starts(&ota_input_sha256, 0);
+    ota_input_hashing = true;
+    ota_upgrade_subelement = true;
+    ota_checkpoint.data_start = ota_parser.offset;
+    ota_checkpoint.data_size = length;
+    ESP_LOGD(TAG, "OTA sub-element size %zu%s", length, s_ota_segmented ? ", resumable" : "");
+    return OTA_PARSER_ACCEPT;
+}
+
+static bool ota_image_end()
+{
+    ota_upgrade_received = true;
+    return ota_input_end();
+}
+
+bool ota_write(const uint8_t *data, size_t size)
+{
+    if (!s_ota_partition || !s_ota_codec || !atomic_load(&ota_writer_running) || atomic_load(&ota_writer_failed)) {
+        return false;
+    }
+
+    // Never wait in the stack task. The stream covers the longest erase, a
+    // writer further behind than that fails the download, which resumes
+    // from the last checkpoint.
+    if (xStreamBufferSpacesAvailable(ota_stream) < size) {
+        ESP_LOGE(TAG, "OTA writer stalled");
+        return false;
+    }
+    xStreamBufferSend(ota_stream, data, size, 0);
+
+    if (ota_input_hashing) {
+        mbedtls_sha256_update(&ota_input_sha256, data, size);
+    }
+    ota_received += size;
     return true;
 }
 
+static const ota_parser_handler_t ota_handlers[] = {
+    { OTA_TAG_UPGRADE_IMAGE, 0, ota_image_begin, ota_write, ota_image_end },
+    { OTA_TAG_COMPRESSED_IMAGE, OTA_CODEC_HEADER_SIZE, ota_image_begin, ota_write, ota_image_end },
+    { OTA_TAG_DELTA_IMAGE, OTA_DELTA_HEADER_SIZE, ota_image_begin, ota_write, ota_image_end },
+    { OTA_TAG_IMAGE_HASH, OTA_IMAGE_HASH_SIZE, ota_hash_begin, NULL, NULL },
+};
+
+_Static_assert(OTA_IMAGE_HASH_SIZE <= OTA_PARSER_MAX_HEADER, "parser header buffer too small");
+
 bool ota_finish()
 {
-    if (!s_ota_partition) {
+    if (!s_ota_partition || !atomic_load(&ota_writer_running)) {
         ESP_LOGE(TAG, "OTA not running");
         return false;
     }
 
-    if (!ota_write(NULL, 0, true)) {
+    if (!ota_parser_finish(&ota_parser)) {
+        ESP_LOGE(TAG, "OTA file invalid: %s", ota_parser.error);
         return false;
     }
 
-    esp_err_t err = esp_ota_end(s_ota_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error ending OTA: %d", err);
-        s_ota_partition = NULL;
+    if (!s_ota_codec || !ota_upgrade_received) {
+        ESP_LOGE(TAG, "OTA file has no usable image");
+        return false;
+    }
+
+    atomic_store(&ota_writer_finish, true);
+    ota_writer_join();
+    if (atomic_load(&ota_writer_failed)) {
         return false;
     }
 
-    inflateEnd(&zlib_stream);
-    zlib_init = false;
+    size_t codec_memory = ota_codec_peak_memory();
+    size_t written = ota_flash_offset + ota_sector_len;
+    s_ota_codec->end();
+    s_ota_codec = NULL;
+
+    if (ota_checkpoint.verify) {
+        uint8_t digest[32];
+        mbedtls_sha256_finish(&ota_sha256, digest);
+        if (written != ota_checkpoint.expected.output_size
+                || memcmp(digest, ota_checkpoint.expected.output_sha256, sizeof(digest))) {
+            ESP_LOGE(TAG, "OTA image hash mismatch");
+            ota_checkpoint_erase();
+            return false;
+        }
+    }
 
-    err = esp_ota_set_boot_partition(s_ota_partition);
+    // Verifies the image, as esp_ota_end() would have
+    esp_err_t err = esp_ota_set_boot_partition(s_ota_partition);
+    ota_checkpoint_erase();
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error setting boot partition: %d", err);
-        s_ota_partition = NULL;
         return false;
     }
 
-    s_ota_partition = NULL;
+    uint64_t elapsed_us = esp_timer_get_time() - ota_start_us;
+    ESP_LOGI(TAG, "OTA received %zu bytes, wrote %zu bytes (%zu resumed) in %" PRIu64 " s (%" PRIu64 " bytes/s), longest stall %" PRIu32 " us, codec peak RAM %zu bytes",
+        ota_received, written, ota_resumed, elapsed_us / 1000000,
+        elapsed_us ? (uint64_t)ota_received * 1000000 / elapsed_us : 0, ota_max_stall_us, codec_memory);
     return true;
 }
 
@@ -153,63 +885,47 @@ esp_err_t zb_ota_upgrade_status_handler(esp_zb_zcl_ota_upgrade_value_message_t m
         case ESP_ZB_ZCL_OTA_UPGRADE_STATUS_START:
             ESP_LOGI(TAG, "OTA start");
             ota_reset();
-            ota_header_len = 0;
+            ota_parser_init(&ota_parser, ota_handlers, sizeof(ota_handlers) / sizeof(ota_handlers[0]));
             ota_upgrade_subelement = false;
-            ota_data_len = 0;
-            if (!ota_start()) {
+            ota_upgrade_received = false;
+            if (!ota_start(&message)) {
                 ota_reset();
                 ret = ESP_FAIL;
             }
             break;
 
         case ESP_ZB_ZCL_OTA_UPGRADE_STATUS_RECEIVE:
-            const uint8_t *payload = message.payload;
-            size_t payload_size = message.payload_size;
-
-            // Read and process the first sub-element, ignoring everything else
-            while (ota_header_len < 6 && payload_size > 0) {
-                ota_header[ota_header_len++] = payload[0];
-                payload++;
-                payload_size--;
+            uint64_t receive_start_us = esp_timer_get_time();
+            size_t received = ota_received;
+            diag_count(DIAG_OTA_BYTES, message.payload_size);
+
+            // Every sub-element goes to its handler, the first usable image is written
+            if (!ota_parser_feed(&ota_parser, message.payload, message.payload_size)) {
+                ESP_LOGE(TAG, "OTA file invalid: %s", ota_parser.error);
+                ota_reset();
+                ret = ESP_FAIL;
             }
 
-            if (!ota_upgrade_subelement && ota_header_len == 6) {
-                if (ota_header[0] == 0 && ota_header[1] == 0) {
-                    ota_upgrade_subelement = true;
-                    ota_data_len =
-                          (((int)ota_header[5] & 0xFF) << 24)
-                        | (((int)ota_header[4] & 0xFF) << 16)
-                        | (((int)ota_header[3] & 0xFF) << 8 )
-                        |  ((int)ota_header[2] & 0xFF);
-                    ESP_LOGD(TAG, "OTA sub-element size %zu", ota_data_len);
+            if (ota_received != received) {
+                uint64_t now_us = esp_timer_get_time();
+                if (!ota_last_receive_us
+                        || now_us - ota_last_receive_us >= 30 * 1000 * 1000) {
+                    ESP_LOGD(TAG, "OTA receive data (%zu messages suppressed)",
+                        ota_receive_not_logged);
+                    ota_last_receive_us = now_us;
+                    ota_receive_not_logged = 0;
                 } else {
-                    ESP_LOGE(TAG, "OTA sub-element type %02x%02x not supported", ota_header[0], ota_header[1]);
-                    ota_reset();
-                    ret = ESP_FAIL;
+                    ota_receive_not_logged++;
                 }
             }
 
-            if (ota_data_len) {
-                if (payload_size > ota_data_len)
-                    payload_size = ota_data_len;
-                ota_data_len -= payload_size;
-
-                if (ota_write(payload, payload_size, false)) {
-                    uint64_t now_us = esp_timer_get_time();
-                    if (!ota_last_receive_us
-                            || now_us - ota_last_receive_us >= 30 * 1000 * 1000) {
-                        ESP_LOGD(TAG, "OTA receive data (%zu messages suppressed)",
-                            ota_receive_not_logged);
-                        ota_last_receive_us = now_us;
-                        ota_receive_not_logged = 0;
-                    } else {
-                        ota_receive_not_logged++;
-                    }
-                } else {
-                    ota_reset();
-                    ret = ESP_FAIL;
-                }
+            uint64_t end_us = esp_timer_get_time();
+            uint32_t stall_us = end_us - receive_start_us;
+            if (stall_us > ota_max_stall_us) {
+                ota_max_stall_us = stall_us;
             }
+            diag_ota_progress(ota_max_stall_us,
+                end_us > ota_start_us ? (uint64_t)ota_received * 1000000 / (end_us - ota_start_us) : 0);
             break;
 
         case ESP_ZB_ZCL_OTA_UPGRADE_STATUS_APPLY:
@@ -0,0 +1,156 @@
+#include "ota_codec.h"
+
+#include <esp_log.h>
+#include <string.h>
+#include <zlib.h>
+
+static const char *TAG = "ESP_ZB_CEILING_LIGHT_OTA";
+
+static bool zlib_init = false;
+static z_stream zlib_stream;
+static size_t zlib_memory = 0;
+static size_t zlib_memory_peak = 0;
+static unsigned int zlib_blocks = 0;
+
+// inflate makes two allocations, its state and then the window. They come from
+// a static arena, so an OTA after a long uptime can't fail on a fragmented heap.
+static uint8_t zlib_arena[OTA_CODEC_ARENA_SIZE] __attribute__((aligned(8)));
+
+_Static_assert(OTA_CODEC_MAX_WINDOW_BITS >= 9 && OTA_CODEC_MAX_WINDOW_BITS <= MAX_WBITS, "OTA window out of zlib's range");
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+    size_t bytes = ((size_t)items * size + 7) & ~(size_t)7;
+    if (bytes > sizeof(zlib_arena) - zlib_memory) {
+        ESP_LOGE(TAG, "zlib arena exhausted (%d + %d bytes)", (int)zlib_memory, (int)bytes);
+        return Z_NULL;
+    }
+
+    voidpf block = zlib_arena + zlib_memory;
+    zlib_memory += bytes;
+    zlib_blocks++;
+    if (zlib_memory > zlib_memory_peak) {
+        zlib_memory_peak = zlib_memory;
+    }
+    return block;
+}
+
+// A bump allocator: the arena is reused once everything is freed
+static void zlib_free(voidpf opaque, voidpf address)
+{
+    if (--zlib_blocks == 0) {
+        zlib_memory = 0;
+    }
+}
+
+static bool zlib_start(int window_bits)
+{
+    memset(&zlib_stream, 0, sizeof(zlib_stream));
+    zlib_stream.zalloc = zlib_alloc;
+    zlib_stream.zfree = zlib_free;
+    zlib_memory_peak = zlib_memory;
+
+    int ret = inflateInit2(&zlib_stream, window_bits);
+    if (ret != Z_OK) {
+        ESP_LOGE(TAG, "zlib init failed: %d", ret);
+        return false;
+    }
+
+    zlib_init = true;
+    return true;
+}
+
+static bool zlib_codec_init(uint8_t window_bits)
+{
+    return window_bits >= 8 && window_bits <= OTA_CODEC_MAX_WINDOW_BITS && zlib_start(window_bits);
+}
+
+static bool deflate_codec_init(uint8_t window_bits)
+{
+    // Negative window bits select a raw deflate stream
+    return window_bits >= 9 && window_bits <= OTA_CODEC_MAX_WINDOW_BITS && zlib_start(-window_bits);
+}
+
+static ota_codec_status_t zlib_codec_decode(ota_codec_buf_t *buf, bool finish)
+{
+    zlib_stream.next_in = (Bytef *)buf->next_in;     // only read, zlib isn't built with ZLIB_CONST
+    zlib_stream.avail_in = buf->avail_in;
+    zlib_stream.next_out = buf->next_out;
+    zlib_stream.avail_out = buf->avail_out;
+
+    int ret = inflate(&zlib_stream, finish ? Z_FINISH : Z_NO_FLUSH);
+
+    buf->next_in = zlib_stream.next_in;
+    buf->avail_in = zlib_stream.avail_in;
+    buf->next_out = zlib_stream.next_out;
+    buf->avail_out = zlib_stream.avail_out;
+
+    switch (ret) {
+    case Z_OK:
+        return OTA_CODEC_OK;
+    case Z_STREAM_END:
+        return OTA_CODEC_END;
+    case Z_BUF_ERROR:
+        // No progress possible: fine while more input is coming, truncated at the end
+        if (finish && buf->avail_out > 0) {
+            ESP_LOGE(TAG, "Compressed stream truncated");
+            return OTA_CODEC_ERROR;
+        }
+        return OTA_CODEC_OK;
+    default:
+        ESP_LOGE(TAG, "zlib error: %d", ret);
+        return OTA_CODEC_ERROR;
+    }
+}
+
+static void zlib_codec_end(void)
+{
+    if (zlib_init) {
+        inflateEnd(&zlib_stream);
+        zlib_init = false;
+    }
+}
+
+static bool none_codec_init(uint8_t window_bits)
+{
+    zlib_memory_peak = 0;
+    return true;
+}
+
+static ota_codec_status_t none_codec_decode(ota_codec_buf_t *buf, bool finish)
+{
+    size_t size = buf->avail_in < buf->avail_out ? buf->avail_in : buf->avail_out;
+
+    // The final call has no input at all
+    if (size > 0) {
+        memcpy(buf->next_out, buf->next_in, size);
+        buf->next_in += size;
+        buf->avail_in -= size;
+        buf->next_out += size;
+        buf->avail_out -= size;
+    }
+    return finish && buf->avail_in == 0 ? OTA_CODEC_END : OTA_CODEC_OK;
+}
+
+static void none_codec_end(void)
+{
+}
+
+static const ota_codec_t codecs[] = {
+    [OTA_CODEC_NONE] = { "none", none_codec_init, none_codec_decode, none_codec_end },
+    [OTA_CODEC_ZLIB] = { "zlib", zlib_codec_init, zlib_codec_decode, zlib_codec_end },
+    [OTA_CODEC_DEFLATE] = { "deflate", deflate_codec_init, zlib_codec_decode, zlib_codec_end },
+};
+
+const ota_codec_t *ota_codec_get(uint8_t id)
+{
+    if (id >= sizeof(codecs) / sizeof(codecs[0])) {
+        return NULL;
+    }
+    return &codecs[id];
+}
+
+size_t ota_codec_peak_memory(void)
+{
+    return zlib_memory_peak;
+}
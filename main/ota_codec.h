@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Codec identifiers carried in the OTA_TAG_COMPRESSED_IMAGE sub-element header */
+typedef enum {
+    OTA_CODEC_NONE = 0,     // stored, no compression
+    OTA_CODEC_ZLIB = 1,     // zlib stream
+    OTA_CODEC_DEFLATE = 2,  // raw deflate, usually with a reduced window
+} ota_codec_id_t;
+
+typedef enum {
+    OTA_CODEC_OK,           // all input consumed or output full, call again
+    OTA_CODEC_END,          // end of the compressed stream
+    OTA_CODEC_ERROR,
+} ota_codec_status_t;
+
+typedef struct {
+    const uint8_t *next_in;
+    size_t avail_in;
+    uint8_t *next_out;
+    size_t avail_out;
+} ota_codec_buf_t;
+
+typedef struct {
+    const char *name;
+    bool (*init)(uint8_t window_bits);
+    ota_codec_status_t (*decode)(ota_codec_buf_t *buf, bool finish);
+    void (*end)(void);
+} ota_codec_t;
+
+/* Static memory for the decompressor: the inflate state (about 7 KB) and the window.
+ * Streams with a larger window than the configured one are rejected. */
+#define OTA_CODEC_MAX_WINDOW_BITS   CONFIG_LIGHT_OTA_MAX_WINDOW_BITS
+#define OTA_CODEC_ARENA_SIZE        (8 * 1024 + (1 << OTA_CODEC_MAX_WINDOW_BITS))
+
+const ota_codec_t *ota_codec_get(uint8_t id);
+
+/* Peak arena memory used by the decompressor since the last init */
+size_t ota_codec_peak_memory(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
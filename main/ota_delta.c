@@ -0,0 +1,172 @@
+#include "ota_delta.h"
+
+#include <esp_log.h>
+#include <inttypes.h>
+#include <string.h>
+
+static const char *TAG = "ESP_ZB_CEILING_LIGHT_OTA";
+
+typedef enum {
+    DELTA_OP,
+    DELTA_ARGS,
+    DELTA_COPY_ADD,
+    DELTA_INSERT,
+} delta_state_t;
+
+static const esp_partition_t *delta_base = NULL;
+static size_t delta_base_size = 0;
+static ota_delta_output_t delta_output = NULL;
+
+static delta_state_t delta_state = DELTA_OP;
+static uint8_t delta_op = 0;
+static uint8_t delta_args[8];
+static size_t delta_args_len = 0;
+static size_t delta_args_size = 0;
+static uint32_t delta_offset = 0;
+static uint32_t delta_remaining = 0;
+
+static uint32_t get_u32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+void ota_delta_init(const esp_partition_t *base, size_t base_size, ota_delta_output_t output)
+{
+    delta_base = base;
+    delta_base_size = base_size;
+    delta_output = output;
+    delta_state = DELTA_OP;
+    delta_args_len = 0;
+}
+
+static bool delta_start_op()
+{
+    if (delta_op == OTA_DELTA_COPY_ADD) {
+        delta_offset = get_u32(delta_args);
+        delta_remaining = get_u32(delta_args + 4);
+        if (delta_offset > delta_base_size || delta_remaining > delta_base_size - delta_offset) {
+            ESP_LOGE(TAG, "Delta copy 0x%" PRIx32 "+%" PRIu32 " outside the base image", delta_offset, delta_remaining);
+            return false;
+        }
+        delta_state = DELTA_COPY_ADD;
+    } else {
+        delta_remaining = get_u32(delta_args);
+        delta_state = DELTA_INSERT;
+    }
+
+    if (delta_remaining == 0) {
+        delta_state = DELTA_OP;
+    }
+    return true;
+}
+
+static bool delta_copy_add(const uint8_t *diff, size_t size)
+{
+    uint8_t buf[256];
+
+    while (size > 0) {
+        size_t chunk = size < sizeof(buf) ? size : sizeof(buf);
+
+        esp_err_t err = esp_partition_read(delta_base, delta_offset, buf, chunk);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Error reading base image: %d", err);
+            return false;
+        }
+        for (size_t i = 0; i < chunk; i++) {
+            buf[i] += diff[i];
+        }
+        if (!delta_output(buf, chunk)) {
+            return false;
+        }
+
+        delta_offset += chunk;
+        diff += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool ota_delta_apply(const uint8_t *patch, size_t size)
+{
+    while (size > 0) {
+        switch (delta_state) {
+        case DELTA_OP:
+            delta_op = patch[0];
+            patch++;
+            size--;
+            if (delta_op == OTA_DELTA_COPY_ADD) {
+                delta_args_size = 8;
+            } else if (delta_op == OTA_DELTA_INSERT) {
+                delta_args_size = 4;
+            } else {
+                ESP_LOGE(TAG, "Delta operation %02x not supported", delta_op);
+                return false;
+            }
+            delta_args_len = 0;
+            delta_state = DELTA_ARGS;
+            break;
+
+        case DELTA_ARGS:
+            while (delta_args_len < delta_args_size && size > 0) {
+                delta_args[delta_args_len++] = patch[0];
+                patch++;
+                size--;
+            }
+            if (delta_args_len == delta_args_size && !delta_start_op()) {
+                return false;
+            }
+            break;
+
+        case DELTA_COPY_ADD:
+        case DELTA_INSERT: {
+            size_t chunk = size < delta_remaining ? size : delta_remaining;
+            bool ok = delta_state == DELTA_COPY_ADD
+                ? delta_copy_add(patch, chunk)
+                : delta_output(patch, chunk);
+            if (!ok) {
+                return false;
+            }
+
+            patch += chunk;
+            size -= chunk;
+            delta_remaining -= chunk;
+            if (delta_remaining == 0) {
+                delta_state = DELTA_OP;
+            }
+            break;
+        }
+        }
+    }
+
+    return true;
+}
+
+void ota_delta_save(ota_delta_state_t *state)
+{
+    state->state = delta_state;
+    state->op = delta_op;
+    state->args_len = delta_args_len;
+    memcpy(state->args, delta_args, sizeof(delta_args));
+    state->offset = delta_offset;
+    state->remaining = delta_remaining;
+}
+
+void ota_delta_restore(const ota_delta_state_t *state)
+{
+    delta_state = state->state;
+    delta_op = state->op;
+    delta_args_len = state->args_len;
+    delta_args_size = delta_op == OTA_DELTA_COPY_ADD ? 8 : 4;
+    memcpy(delta_args, state->args, sizeof(delta_args));
+    delta_offset = state->offset;
+    delta_remaining = state->remaining;
+}
+
+bool ota_delta_finish(void)
+{
+    if (delta_state != DELTA_OP) {
+        ESP_LOGE(TAG, "Delta patch truncated");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <esp_partition.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Patch operations, all integers little-endian:
+ *   OTA_DELTA_COPY_ADD offset:u32 length:u32 diff[length]  output = base[offset + i] + diff[i]
+ *   OTA_DELTA_INSERT   length:u32 data[length]              output = data
+ */
+#define OTA_DELTA_COPY_ADD      0x01
+#define OTA_DELTA_INSERT        0x02
+
+typedef bool (*ota_delta_output_t)(const uint8_t *data, size_t size);
+
+/* Interpreter position, saved with an OTA checkpoint */
+typedef struct __attribute__((packed)) {
+    uint8_t state;
+    uint8_t op;
+    uint8_t args_len;
+    uint8_t args[8];
+    uint32_t offset;
+    uint32_t remaining;
+} ota_delta_state_t;
+
+/* Start applying a patch against the first base_size bytes of the base partition */
+void ota_delta_init(const esp_partition_t *base, size_t base_size, ota_delta_output_t output);
+
+/* Feed the next piece of the (decompressed) patch stream */
+bool ota_delta_apply(const uint8_t *patch, size_t size);
+
+void ota_delta_save(ota_delta_state_t *state);
+void ota_delta_restore(const ota_delta_state_t *state);
+
+/* The patch must end on an operation boundary */
+bool ota_delta_finish(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
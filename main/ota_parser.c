@@ -0,0 +1,141 @@
+#include "ota_parser.h"
+
+#include <string.h>
+
+static const ota_parser_handler_t *find_handler(const ota_parser_t *parser, uint16_t tag)
+{
+    for (size_t i = 0; i < parser->handler_count; i++) {
+        if (parser->handlers[i].tag == tag) {
+            return &parser->handlers[i];
+        }
+    }
+    return NULL;
+}
+
+void ota_parser_init(ota_parser_t *parser, const ota_parser_handler_t *handlers, size_t handler_count)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->handlers = handlers;
+    parser->handler_count = handler_count;
+    parser->header_size = OTA_PARSER_TLV_SIZE;
+}
+
+static bool end_subelement(ota_parser_t *parser)
+{
+    const ota_parser_handler_t *handler = parser->current;
+
+    parser->current = NULL;
+    if (handler && handler->end && !handler->end()) {
+        parser->error = "sub-element rejected";
+        return false;
+    }
+    return true;
+}
+
+bool ota_parser_resume(ota_parser_t *parser, size_t offset, uint16_t tag, size_t remaining)
+{
+    parser->current = find_handler(parser, tag);
+    if (!parser->current) {
+        parser->error = "no handler to resume";
+        return false;
+    }
+
+    parser->header_len = 0;
+    parser->header_size = OTA_PARSER_TLV_SIZE;
+    parser->remaining = remaining;
+    parser->offset = offset;
+
+    // Interrupted after the last of its data, the sub-element ends here
+    return parser->remaining || end_subelement(parser);
+}
+
+// The TLV header and any fixed header of the handler are complete
+static bool begin_subelement(ota_parser_t *parser)
+{
+    uint16_t tag = parser->header[0] | (parser->header[1] << 8);
+    size_t length = parser->header[2] | (parser->header[3] << 8) | (parser->header[4] << 16)
+        | ((size_t)parser->header[5] << 24);
+    const ota_parser_handler_t *handler = find_handler(parser, tag);
+
+    if (handler && parser->header_size == OTA_PARSER_TLV_SIZE && handler->header_size) {
+        if (length < handler->header_size) {
+            parser->error = "sub-element shorter than its header";
+            return false;
+        }
+        parser->header_size += handler->header_size;
+        return true;
+    }
+
+    parser->header_len = 0;
+    parser->header_size = OTA_PARSER_TLV_SIZE;
+    parser->current = NULL;
+    parser->remaining = length - (handler ? handler->header_size : 0);
+
+    // Unknown tags are skipped without being buffered
+    if (handler) {
+        switch (handler->begin(tag, &parser->header[OTA_PARSER_TLV_SIZE], parser->remaining)) {
+        case OTA_PARSER_ACCEPT:
+            parser->current = handler;
+            break;
+        case OTA_PARSER_SKIP:
+            break;
+        default:
+            parser->error = "sub-element rejected";
+            return false;
+        }
+    }
+
+    return parser->remaining || end_subelement(parser);
+}
+
+bool ota_parser_feed(ota_parser_t *parser, const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        size_t chunk;
+
+        if (parser->remaining) {
+            chunk = size < parser->remaining ? size : parser->remaining;
+            if (parser->current && parser->current->data && !parser->current->data(data, chunk)) {
+                parser->error = "sub-element data rejected";
+                return false;
+            }
+
+            parser->remaining -= chunk;
+            if (!parser->remaining && !end_subelement(parser)) {
+                return false;
+            }
+        } else {
+            chunk = parser->header_size - parser->header_len;
+            if (chunk > size)
+                chunk = size;
+            memcpy(&parser->header[parser->header_len], data, chunk);
+            parser->header_len += chunk;
+
+            if (parser->header_len == parser->header_size) {
+                // Data of the sub-element starts after this header
+                parser->offset += chunk;
+                data += chunk;
+                size -= chunk;
+                if (!begin_subelement(parser)) {
+                    return false;
+                }
+                continue;
+            }
+        }
+
+        parser->offset += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+
+    return true;
+}
+
+bool ota_parser_finish(ota_parser_t *parser)
+{
+    if (parser->remaining || parser->header_len) {
+        parser->error = "file truncated";
+        return false;
+    }
+    return true;
+}
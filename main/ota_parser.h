@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Streaming parser for the sub-elements (tag:u16, length:u32, data) of a
+ * Zigbee OTA file, fed with payload slices as they arrive. It has no
+ * platform dependencies so it can be built on a host.
+ */
+
+#define OTA_PARSER_TLV_SIZE     6       // tag, length
+#define OTA_PARSER_MAX_HEADER   80      // largest fixed header of a handled tag
+
+typedef enum {
+    OTA_PARSER_ACCEPT,                  // pass the data to the handler
+    OTA_PARSER_SKIP,                    // ignore this sub-element
+    OTA_PARSER_ABORT,
+} ota_parser_action_t;
+
+typedef struct {
+    uint16_t tag;
+    size_t header_size;                 // fixed header buffered before begin() is called
+    ota_parser_action_t (*begin)(uint16_t tag, const uint8_t *header, size_t length);
+    bool (*data)(const uint8_t *data, size_t size);    // slices of the payload, not copied
+    bool (*end)(void);
+} ota_parser_handler_t;
+
+typedef struct {
+    const ota_parser_handler_t *handlers;
+    size_t handler_count;
+
+    uint8_t header[OTA_PARSER_TLV_SIZE + OTA_PARSER_MAX_HEADER];
+    size_t header_len;
+    size_t header_size;
+
+    const ota_parser_handler_t *current;    // NULL while skipping
+    size_t remaining;                       // data left in the current sub-element
+    size_t offset;                          // payload bytes consumed so far
+    const char *error;
+} ota_parser_t;
+
+void ota_parser_init(ota_parser_t *parser, const ota_parser_handler_t *handlers, size_t handler_count);
+
+/* Continue in the data of a sub-element, e.g. after a download was interrupted.
+ * With nothing remaining the handler's end() is called before it returns. */
+bool ota_parser_resume(ota_parser_t *parser, size_t offset, uint16_t tag, size_t remaining);
+
+bool ota_parser_feed(ota_parser_t *parser, const uint8_t *data, size_t size);
+
+/* The file must end on a sub-element boundary */
+bool ota_parser_finish(ota_parser_t *parser);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,131 @@
+#include "power.h"
+#include "diag.h"
+#include "light_driver.h"
+
+#include <inttypes.h>
+
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nvs_flash.h"
+
+#define POWER_NAMESPACE         "storage"
+#define POWER_KEY               "power_profile"
+
+#define POWER_MAX_FREQ_MHZ      CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#define POWER_XTAL_FREQ_MHZ     40
+#define POWER_PLL_FREQ_MHZ      80
+
+// With the PWM timer on the PLL, the PLL must stay powered and the CPU can't go below 80 MHz
+#if LIGHT_PWM_XTAL_CLOCK
+#define POWER_MIN_FREQ_MHZ      POWER_XTAL_FREQ_MHZ
+#else
+#define POWER_MIN_FREQ_MHZ      POWER_PLL_FREQ_MHZ
+#endif
+
+static power_profile_t current_profile = POWER_PROFILE_DYNAMIC;
+static uint32_t min_freq_mhz = POWER_MAX_FREQ_MHZ;
+
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t stats_since_us = 0;
+static uint64_t stats_idle_since = 0;
+static uint64_t time_max_us = 0;
+static uint64_t time_min_us = 0;
+
+// DFS drops to the minimum frequency as soon as only the idle task runs and
+// no driver holds a lock, so the idle run time approximates the time spent there
+static void account_time()
+{
+    int64_t now_us = esp_timer_get_time();
+    uint64_t idle = ulTaskGetIdleRunTimeCounter();
+    uint64_t elapsed = now_us - stats_since_us;
+    uint64_t idle_elapsed = idle - stats_idle_since;
+
+    if (idle_elapsed > elapsed)
+        idle_elapsed = elapsed;
+
+    if (min_freq_mhz < POWER_MAX_FREQ_MHZ) {
+        time_min_us += idle_elapsed;
+        time_max_us += elapsed - idle_elapsed;
+    } else {
+        time_max_us += elapsed;
+    }
+
+    stats_since_us = now_us;
+    stats_idle_since = idle;
+}
+
+static void apply_profile(power_profile_t profile)
+{
+    // A router must keep its receiver on, so automatic light sleep is never enabled
+    esp_pm_config_t config = {
+        .max_freq_mhz = POWER_MAX_FREQ_MHZ,
+        .min_freq_mhz = profile == POWER_PROFILE_DYNAMIC ? POWER_MIN_FREQ_MHZ : POWER_MAX_FREQ_MHZ,
+        .light_sleep_enable = false,
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&config));
+
+    portENTER_CRITICAL(&stats_lock);
+    account_time();
+    current_profile = profile;
+    min_freq_mhz = config.min_freq_mhz;
+    portEXIT_CRITICAL(&stats_lock);
+
+    ESP_LOGI(TAG, "Power profile %d, CPU %" PRIu32 "-%" PRIu32 " MHz", (int)profile,
+        (uint32_t)config.min_freq_mhz, (uint32_t)config.max_freq_mhz);
+}
+
+void power_init(void)
+{
+    power_profile_t profile = POWER_PROFILE_DYNAMIC;
+
+    nvs_handle_t my_handle;
+    if (nvs_open(POWER_NAMESPACE, NVS_READONLY, &my_handle) == ESP_OK) {
+        uint8_t value;
+        if (nvs_get_u8(my_handle, POWER_KEY, &value) == ESP_OK && value < POWER_PROFILE_MAX)
+            profile = value;
+        nvs_close(my_handle);
+    }
+
+    apply_profile(profile);
+}
+
+void power_set_profile(power_profile_t profile)
+{
+    if (profile >= POWER_PROFILE_MAX) {
+        ESP_LOGW(TAG, "Unknown power profile %d ignored", (int)profile);
+        return;
+    }
+    if (profile == current_profile)
+        return;
+
+    apply_profile(profile);
+
+    nvs_handle_t my_handle;
+    ESP_ERROR_CHECK(nvs_open(POWER_NAMESPACE, NVS_READWRITE, &my_handle));
+    ESP_ERROR_CHECK(nvs_set_u8(my_handle, POWER_KEY, profile));
+    ESP_ERROR_CHECK(nvs_commit(my_handle));
+    nvs_close(my_handle);
+    diag_count(DIAG_NVS_COMMITS, 1);
+}
+
+power_profile_t power_get_profile(void)
+{
+    return current_profile;
+}
+
+void power_get_stats(power_stats_t *stats)
+{
+    portENTER_CRITICAL(&stats_lock);
+    account_time();
+    *stats = (power_stats_t) {
+        .max_freq_mhz = POWER_MAX_FREQ_MHZ,
+        .min_freq_mhz = min_freq_mhz,
+        .profile = current_profile,
+        .time_max_us = time_max_us,
+        .time_min_us = time_min_us,
+    };
+    portEXIT_CRITICAL(&stats_lock);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Manufacturer-specific Basic cluster attribute selecting the power profile (8-bit enum) */
+#define POWER_ATTR_PROFILE_ID           0xF000
+
+typedef enum {
+    POWER_PROFILE_PERFORMANCE,          // CPU always at the maximum frequency
+    POWER_PROFILE_DYNAMIC,              // DFS, the CPU slows down while idle
+    POWER_PROFILE_MAX,
+} power_profile_t;
+
+typedef struct {
+    uint32_t max_freq_mhz;
+    uint32_t min_freq_mhz;
+    power_profile_t profile;
+    uint64_t time_max_us;               // time at each frequency since boot, estimated from
+    uint64_t time_min_us;               // the idle task run time while DFS is active
+} power_stats_t;
+
+/* Apply the stored profile, call after nvs_flash_init() */
+void power_init(void);
+
+/* Apply and store a profile, safe to call from any task */
+void power_set_profile(power_profile_t profile);
+
+power_profile_t power_get_profile(void);
+
+void power_get_stats(power_stats_t *stats);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,134 @@
+#include "report.h"
+#include "diag.h"
+#include "light_driver.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "ha/esp_zigbee_ha_standard.h"
+
+#define REPORT_BINDINGS_REFRESH_MS      60000
+#define REPORT_BINDINGS_CHANGED_MS      500     // a burst of binds is read back once
+
+// Clusters with reported attributes, on every light endpoint
+static const uint16_t report_clusters[] = {
+    ESP_ZB_ZCL_CLUSTER_ID_ON_OFF,
+    ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL,
+    ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL,
+};
+#define CLUSTERS_COUNT          (sizeof(report_clusters) / sizeof(report_clusters[0]))
+
+typedef struct {
+    uint8_t unicast;                // bound devices
+    uint8_t group;                  // bound groups
+} report_bindings_t;
+
+// Only written by the Zigbee task, read with the Zigbee lock held
+static report_bindings_t bindings[LIGHT_ZONES][CLUSTERS_COUNT];
+
+// Counted while the table is read page by page
+static report_bindings_t bindings_next[LIGHT_ZONES][CLUSTERS_COUNT];
+
+static int find_cluster(uint16_t cluster_id)
+{
+    for (size_t i = 0; i < CLUSTERS_COUNT; i++) {
+        if (report_clusters[i] == cluster_id)
+            return (int)i;
+    }
+    return -1;
+}
+
+static void request_bindings(uint8_t start_index);
+
+static void bindings_received(const esp_zb_zdo_binding_table_info_t *table_info, void *user_ctx)
+{
+    if (table_info->status != ESP_ZB_ZDP_STATUS_SUCCESS) {
+        ESP_LOGD(TAG, "Binding table request failed: %d", (int)table_info->status);
+        return;
+    }
+
+    for (const esp_zb_zdo_binding_table_record_t *record = table_info->record; record; record = record->next) {
+        int zone = light_zone_from_endpoint(record->src_endp);
+        int cluster = find_cluster(record->cluster_id);
+        if (zone < 0 || cluster < 0)
+            continue;
+        report_bindings_t *entry = &bindings_next[zone][cluster];
+        if (record->dst_addr_mode == ESP_ZB_ZDO_BIND_DST_ADDR_MODE_16_BIT_GROUP)
+            entry->group++;
+        else
+            entry->unicast++;
+    }
+
+    uint8_t next_index = table_info->index + table_info->count;
+    if (table_info->count && next_index < table_info->total) {
+        request_bindings(next_index);
+        return;
+    }
+
+    for (uint8_t zone = 0; zone < LIGHT_ZONES; zone++) {
+        for (size_t i = 0; i < CLUSTERS_COUNT; i++) {
+            const report_bindings_t *entry = &bindings_next[zone][i];
+            if (bindings[zone][i].unicast != entry->unicast || bindings[zone][i].group != entry->group)
+                ESP_LOGI(TAG, "Endpoint %d cluster 0x%04x reports to %d devices and %d groups", (int)light_zone_endpoint(zone),
+                    report_clusters[i], (int)entry->unicast, (int)entry->group);
+            bindings[zone][i] = *entry;
+        }
+    }
+}
+
+static void request_bindings(uint8_t start_index)
+{
+    if (start_index == 0)
+        memset(bindings_next, 0, sizeof(bindings_next));
+
+    // Mgmt_Bind_req to ourselves returns the local binding table
+    esp_zb_zdo_mgmt_bind_param_t request = {
+        .start_index = start_index,
+        .dst_addr = esp_zb_get_short_address(),
+    };
+    esp_zb_zdo_binding_table_req(&request, bindings_received, NULL);
+}
+
+static void refresh_bindings(uint8_t param)
+{
+    request_bindings(0);
+    esp_zb_scheduler_alarm(refresh_bindings, 0, REPORT_BINDINGS_REFRESH_MS);
+}
+
+void report_start(void)
+{
+    esp_zb_scheduler_alarm_cancel(refresh_bindings, 0);
+    refresh_bindings(0);
+}
+
+void report_stop(void)
+{
+    esp_zb_scheduler_alarm_cancel(refresh_bindings, 0);
+    memset(bindings, 0, sizeof(bindings));
+}
+
+void report_bindings_changed(void)
+{
+    // The next periodic read follows this one
+    esp_zb_scheduler_alarm_cancel(refresh_bindings, 0);
+    esp_zb_scheduler_alarm(refresh_bindings, 0, REPORT_BINDINGS_CHANGED_MS);
+}
+
+void report_attribute(uint8_t endpoint, uint16_t cluster_id, uint16_t attr_id)
+{
+    int zone = light_zone_from_endpoint(endpoint);
+    int cluster = find_cluster(cluster_id);
+    if (zone < 0 || cluster < 0)
+        return;
+
+    diag_count(DIAG_REPORTS, 1);
+    // The reporting engine fans the change out over the bindings, or
+    // sends it to the coordinator when there are none
+    const report_bindings_t *entry = &bindings[zone][cluster];
+    if (entry->unicast || entry->group) {
+        diag_count(DIAG_CHANGES_TO_DEVICES, entry->unicast);
+        diag_count(DIAG_CHANGES_TO_GROUPS, entry->group);
+    } else {
+        diag_count(DIAG_CHANGES_TO_COORDINATOR, 1);
+    }
+}
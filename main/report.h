@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The stack's reporting engine sends reports through the binding table: a
+ * unicast frame per bound device and one group-cast frame per bound group.
+ * A cluster nobody is bound to reports to the destination of its reporting
+ * configuration, the coordinator by default, with the same min interval and
+ * reportable change. This keeps a count of the bindings of the reported
+ * clusters for the diagnostics. Bindings are counted per light endpoint,
+ * from their source endpoint.
+ */
+
+#define REPORT_COORDINATOR_ADDRESS      0x0000
+
+/* Read the binding table now and periodically. In the Zigbee task, once the device
+ * is on a network: Mgmt_Bind_req needs a short address. Restarts a running refresh. */
+void report_start(void);
+
+/* Left the network: stop reading the binding table, the bindings are gone */
+void report_stop(void);
+
+/* A Bind_req or Unbind_req arrived, read the table again once the stack has handled it */
+void report_bindings_changed(void);
+
+/* An attribute of a light endpoint changed, hold the Zigbee lock */
+void report_attribute(uint8_t endpoint, uint16_t cluster_id, uint16_t attr_id);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
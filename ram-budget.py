@@ -0,0 +1,128 @@
+#!/usr/bin/env python
+# ram-budget - List the static RAM of the firmware per subsystem, from the linker map
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+import argparse
+import collections
+import os
+import re
+import sys
+
+# Sources of the main component by subsystem
+SUBSYSTEMS = {
+	"boot.c": "Boot",
+	"diag.c": "Diagnostics",
+	"effect.c": "Light",
+	"esp_zb_light.c": "Zigbee",
+	"light_control.c": "Light",
+	"light_curve.c": "Light",
+	"light_driver.c": "Light",
+	"network.c": "Zigbee",
+	"ota.c": "OTA",
+	"ota_codec.c": "OTA",
+	"ota_delta.c": "OTA",
+	"ota_parser.c": "OTA",
+	"power.c": "Power",
+	"report.c": "Zigbee",
+}
+
+# Input section prefixes by the memory they take
+KINDS = [
+	(".rtc_noinit", "rtc"),
+	(".rtc", "rtc"),
+	(".sbss", "bss"),
+	(".bss", "bss"),
+	(".noinit", "bss"),
+	(".sdata", "data"),
+	(".srodata", None),
+	(".data", "data"),
+	(".dram", "data"),
+]
+
+# An input section, either on one line or with the name on a line of its own
+SECTION = re.compile(r"^ (\.[\w.$]+|COMMON)\s*\n?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S[^\n]*)$", re.M)
+MEMBER = re.compile(r"([^/\\(]+)\.a\(([^)]+)\)$")
+
+
+def kind(name):
+	if name == "COMMON":
+		return "bss"
+	for prefix, k in KINDS:
+		if name.startswith(prefix):
+			return k
+	return None
+
+
+def subsystem(path):
+	match = MEMBER.search(path)
+	if not match:
+		return os.path.basename(path), None
+	archive, member = match.groups()
+	source = member[:-len(".obj")] if member.endswith(".obj") else member
+	if archive == "libmain":
+		return SUBSYSTEMS.get(source, "Main"), source
+	return archive[3:] if archive.startswith("lib") else archive, None
+
+
+def parse(text):
+	start = text.find("Linker script and memory map")
+	totals = collections.defaultdict(lambda: collections.Counter())
+	objects = []
+
+	for name, address, size, path in SECTION.findall(text[start:]):
+		k = kind(name)
+		size = int(size, 16)
+		if not k or not size or int(address, 16) == 0:
+			continue
+		group, source = subsystem(path.strip())
+		totals[group][k] += size
+		if source:
+			symbol = name.split(".", 2)[-1] if name.count(".") >= 2 else name
+			objects.append((size, source, symbol, k))
+
+	return totals, sorted(objects, reverse=True)
+
+
+def report(totals, objects, largest):
+	print(f"{'Subsystem':24} {'.data':>8} {'.bss':>8} {'RTC':>8} {'Total':>8}")
+	rows = sorted(totals.items(), key=lambda item: -sum(item[1].values()))
+	sum_all = collections.Counter()
+	for group, counter in rows:
+		sum_all.update(counter)
+		print(f"{group:24} {counter['data']:8} {counter['bss']:8} {counter['rtc']:8} {sum(counter.values()):8}")
+	print(f"{'Total':24} {sum_all['data']:8} {sum_all['bss']:8} {sum_all['rtc']:8} {sum(sum_all.values()):8}")
+
+	if largest and objects:
+		print()
+		print("Largest static objects of the main component")
+		for size, source, symbol, k in objects[:largest]:
+			print(f"{size:8} {k:5} {source:18} {symbol}")
+
+
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser(description="List the static RAM of the firmware per subsystem")
+	parser.add_argument("map", metavar="MAP", type=str, help="Linker map file of the application")
+	parser.add_argument("-n", "--largest", type=int, default=10, help="Number of the largest main objects to list")
+
+	args = parser.parse_args()
+	try:
+		with open(args.map) as f:
+			text = f.read()
+	except OSError as e:
+		print(f"ram-budget: {e}", file=sys.stderr)
+		sys.exit(1)
+
+	totals, objects = parse(text)
+	report(totals, objects, args.largest)